@@ -19,9 +19,11 @@
 
 #include <algorithm>
 #include <concepts>
+#include <cstddef>
 #include <filesystem>
 #include <optional>
 #include <ranges>
+#include <string>
 #include <string_view>
 
 namespace frz {
@@ -83,26 +85,53 @@ constexpr bool IsBase32Number(T str) {
 }
 // clang-format on
 
-// The number of subdirectory levels to use for base-32 symlink names.
-inline constexpr int kSymlinkSubdirs = 2;
+// How base-32 symlink names are split into a directory hierarchy: the first
+// `subdirs * subdir_digits` digits form `subdirs` levels of subdirectory
+// names with `subdir_digits` digits each, and the remaining digits form the
+// filename.
+struct SymlinkLayout {
+    int subdirs;
+    int subdir_digits;
 
-// The number of base-32 digits to use for each directory name.
-inline constexpr int kSymlinkSubdirDigits = 2;
+    constexpr bool operator==(const SymlinkLayout&) const = default;
+};
 
-// Construct a symlink path for the given base-32 hash string,
-inline std::filesystem::path SymlinkPath(std::string_view base32) {
-    static_assert(kSymlinkSubdirs == 2);
-    static_assert(kSymlinkSubdirDigits == 2);
-    return std::filesystem::path(base32.substr(0, 2)) / base32.substr(2, 2) /
-           base32.substr(4);
+// The layout used unless the repository says otherwise: two levels of
+// two-digit subdirectories, for a total of 1024 * 1024 leaf directories.
+inline constexpr SymlinkLayout kDefaultSymlinkLayout = {.subdirs = 2,
+                                                        .subdir_digits = 2};
+
+// The largest layouts we support. Base-32 hash strings are always longer
+// than the total number of subdirectory digits allowed here.
+inline constexpr int kMaxSymlinkSubdirs = 4;
+inline constexpr int kMaxSymlinkSubdirDigits = 3;
+
+inline constexpr bool IsValidSymlinkLayout(SymlinkLayout layout) {
+    return layout.subdirs >= 0 && layout.subdirs <= kMaxSymlinkSubdirs &&
+           layout.subdir_digits >= 1 &&
+           layout.subdir_digits <= kMaxSymlinkSubdirDigits;
+}
+
+// Construct a symlink path for the given base-32 hash string.
+inline std::filesystem::path SymlinkPath(std::string_view base32,
+                                         SymlinkLayout layout) {
+    std::filesystem::path path;
+    for (int i = 0; i < layout.subdirs; ++i) {
+        path /= base32.substr(0, layout.subdir_digits);
+        base32.remove_prefix(layout.subdir_digits);
+    }
+    return path / base32;
 }
 
 // Parse a base-32 number out of a symlink target path. Return nullopt if
-// parsing fails.
+// parsing fails. Any valid SymlinkLayout is accepted, so that links created
+// before the index layout was changed can still be recognized.
 inline std::optional<std::string> PathBase32(
     std::string_view hash_name, const std::filesystem::path& link_target) {
     std::string base32;
     int seen_elements = 0;
+    int seen_subdirs = 0;
+    std::size_t last_element_size = 0;
     for (const std::filesystem::path& element : link_target) {
         if (seen_elements == 0) {
             if (element != ".frz") {
@@ -112,24 +141,24 @@ inline std::optional<std::string> PathBase32(
             if (element != hash_name) {
                 return std::nullopt;
             }
-        } else if (seen_elements - 2 < kSymlinkSubdirs) {
-            if (element.native().size() == kSymlinkSubdirDigits &&
-                IsBase32Number(element.native())) {
-                base32.append(element);
-            } else {
-                return std::nullopt;
-            }
-        } else if (seen_elements - 2 == kSymlinkSubdirs) {
-            if (IsBase32Number(element.native())) {
-                base32.append(element);
-            } else {
-                return std::nullopt;
+        } else if (!element.empty() && IsBase32Number(element.native())) {
+            if (seen_elements > 2) {
+                // The previous element was a subdirectory, not the filename.
+                if (last_element_size > kMaxSymlinkSubdirDigits ||
+                    ++seen_subdirs > kMaxSymlinkSubdirs) {
+                    return std::nullopt;
+                }
             }
+            base32.append(element);
+            last_element_size = element.native().size();
         } else {
             return std::nullopt;
         }
         ++seen_elements;
     }
+    if (seen_elements < 3) {
+        return std::nullopt;
+    }
     return base32;
 }
 
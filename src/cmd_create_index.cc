@@ -16,6 +16,7 @@
 
 #include <CLI/CLI.hpp>
 #include <absl/strings/str_format.h>
+#include <absl/synchronization/mutex.h>
 #include <string>
 
 #include "blake3_256_hasher.hh"
@@ -24,6 +25,7 @@
 #include "hash_index.hh"
 #include "hasher.hh"
 #include "stream.hh"
+#include "worker.hh"
 
 namespace frz {
 namespace {
@@ -38,44 +40,53 @@ int main(int argc, char** argv) {
     std::string index_dir;
     app.add_option("-i,--index-dir", index_dir, "Index directory")->required();
 
+    int jobs = 8;
+    app.add_option("-j,--jobs", jobs, "Number of files to hash concurrently")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+
     CLI11_PARSE(app, argc, argv);
 
+    // The disk index may be inserted into from any number of threads.
     const std::unique_ptr<HashIndex<256>> index =
         CreateDiskHashIndex(index_dir);
-    const std::unique_ptr<Streamer> streamer =
-        CreateMultiThreadedStreamer({.bytes_per_buffer = 1024 * 1024,
-                                     .num_buffers = 4,
-                                     .num_buffers_secondary = 1024});
+    absl::Mutex mutex;
     std::int64_t successful = 0;
     std::int64_t duplicates = 0;
     std::int64_t nonfiles = 0;
     std::int64_t errors = 0;
+    WorkerPool pool(jobs);
     for (const std::filesystem::directory_entry& dent :
          std::filesystem::recursive_directory_iterator(content_dir)) {
-        try {
-            if (std::filesystem::is_directory(dent.symlink_status())) {
-                continue;
-            } else if (!std::filesystem::is_regular_file(
-                           dent.symlink_status())) {
-                ++nonfiles;
-                continue;
-            }
-            auto source = CreateFileSource(dent.path());
-            SizeHasher hasher(CreateBlake3_256Hasher());
-            streamer->Stream(*source, hasher);
-            auto hs = hasher.Finish();
-            const bool inserted = index->Insert(hs, dent.path());
-            if (inserted) {
-                ++successful;
-            } else {
-                ++duplicates;
-            }
-            absl::PrintF("%s %s\n", inserted ? "+" : "=", dent.path());
-        } catch (const Error& e) {
-            ++errors;
-            absl::PrintF("*** %s\n *- %s\n", dent.path(), e.what());
+        if (std::filesystem::is_directory(dent.symlink_status())) {
+            continue;
+        } else if (!std::filesystem::is_regular_file(dent.symlink_status())) {
+            ++nonfiles;
+            continue;
         }
+        pool.Do([&, path = dent.path()] {
+            try {
+                auto source = CreateFileSource(path);
+                SizeHasher hasher(CreateBlake3_256Hasher());
+                CreateSingleThreadedStreamer({.buffer_size = 1024 * 1024})
+                    ->Stream(*source, hasher);
+                auto hs = hasher.Finish();
+                const bool inserted = index->Insert(hs, path);
+                absl::MutexLock ml(&mutex);
+                if (inserted) {
+                    ++successful;
+                } else {
+                    ++duplicates;
+                }
+                absl::PrintF("%s %s\n", inserted ? "+" : "=", path);
+            } catch (const Error& e) {
+                absl::MutexLock ml(&mutex);
+                ++errors;
+                absl::PrintF("*** %s\n *- %s\n", path, e.what());
+            }
+        });
     }
+    pool.Wait();
 
     absl::PrintF(
         "\n"
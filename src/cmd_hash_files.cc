@@ -16,6 +16,7 @@
 
 #include <CLI/CLI.hpp>
 #include <absl/strings/str_format.h>
+#include <absl/synchronization/mutex.h>
 #include <absl/time/clock.h>
 #include <absl/time/time.h>
 #include <map>
@@ -30,6 +31,7 @@
 #include "openssl_sha256_hasher.hh"
 #include "openssl_sha512_256_hasher.hh"
 #include "stream.hh"
+#include "worker.hh"
 
 namespace frz {
 namespace {
@@ -57,10 +59,18 @@ int main(int argc, char** argv) {
     std::string index_dir;
     app.add_option("-i,--index-dir", index_dir, "Index directory");
 
+    int jobs = 1;
+    app.add_option("-j,--jobs", jobs,
+                   "Number of files to hash concurrently (each with a "
+                   "single-threaded streamer, if more than one)")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+
     CLI11_PARSE(app, argc, argv);
 
+    // Both of these may be inserted into from any number of threads.
     std::unique_ptr<HashIndex<256>> index =
-        index_dir.empty() ? CreateRamHashIndex()
+        index_dir.empty() ? CreateConcurrentRamHashIndex(jobs)
                           : CreateDiskHashIndex(index_dir);
     const auto& [algo_name, algo_create] = *algorithm_map.find(algorithm);
     absl::PrintF("Hashing with %s, multithreading %s\n", algo_name,
@@ -72,19 +82,36 @@ int main(int argc, char** argv) {
                                            .num_buffers = 4,
                                            .num_buffers_secondary = 1024})
             : CreateSingleThreadedStreamer({.buffer_size = 1024 * 1024});
-    absl::Time start = absl::Now();
-    for (const auto& f : files) {
+    absl::Mutex mutex;
+    auto hash_file = [&](const std::string& f, Streamer& s) {
         try {
             auto source = CreateFileSource(f);
             SizeHasher hasher(algo_create());
-            streamer->Stream(*source, hasher);
+            s.Stream(*source, hasher);
             auto hs = hasher.Finish();
             const bool inserted = index->Insert(hs, f);
+            absl::MutexLock ml(&mutex);
             absl::PrintF("%s %s  %s\n", inserted ? "+" : "=", hs.ToBase32(), f);
             total_bytes += hs.GetSize();
         } catch (const Error& e) {
+            absl::MutexLock ml(&mutex);
             absl::PrintF("*** %s\n", e.what());
         }
+    };
+    absl::Time start = absl::Now();
+    if (jobs == 1) {
+        for (const auto& f : files) {
+            hash_file(f, *streamer);
+        }
+    } else {
+        WorkerPool pool(jobs);
+        for (const auto& f : files) {
+            pool.Do([&] {
+                hash_file(f, *CreateSingleThreadedStreamer(
+                                 {.buffer_size = 1024 * 1024}));
+            });
+        }
+        pool.Wait();
     }
     absl::Time stop = absl::Now();
     absl::PrintF("Hashed %d bytes in %s (%.1f MiB/s)\n", total_bytes,
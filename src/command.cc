@@ -18,8 +18,12 @@
 
 #include <CLI/CLI.hpp>
 #include <absl/algorithm/container.h>
+#include <absl/strings/str_replace.h>
+#include <filesystem>
 #include <memory>
+#include <optional>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
 #include "blake3_256_hasher.hh"
@@ -39,7 +43,9 @@ class ContentSourceOptions final {
           copy_from_opt_(
               *app.add_option("--copy-from", copy_from_,
                               "If content is found to be missing, search this\n"
-                              "directory for matching files to copy")
+                              "directory or tar archive for matching files to\n"
+                              "copy (or, if it's a frz repository, look them\n"
+                              "up in its index)")
                    ->type_name("DIR")),
           move_from_opt_(
               *app.add_option(
@@ -47,43 +53,91 @@ class ContentSourceOptions final {
                       "If content is found to be missing, search this\n"
                       "directory for matching files to move into\n"
                       ".frz/content (or copy, if moving isn't possible)")
-                   ->type_name("DIR")) {}
+                   ->type_name("DIR")),
+          peer_opt_(*app.add_option(
+                             "--copy-from-peer", peers_,
+                             "If content is found to be missing, ask this\n"
+                             "peer for it: \"unix:PATH\" for a socket that\n"
+                             "`frz serve --socket=PATH` listens on, or\n"
+                             "\"exec:COMMAND\" for a command (such as\n"
+                             "\"ssh host frz serve\") that runs `frz serve`")
+                         ->type_name("ADDRESS")) {
+        app.add_option("--cache-dir", cache_dir_,
+                       "Remember the files and hashes found in --copy-from\n"
+                       "directories here, so that the next run needn't\n"
+                       "list and hash them all again")
+            ->type_name("DIR");
+    }
 
     std::vector<Frz::ContentSource> GetResult(
         const std::filesystem::path& working_dir) const {
-        // Merge `copy_from_` and `move_from_` into a single list, interleaving
-        // in the order they were given on the command line.
+        // Merge `copy_from_`, `move_from_`, and `peers_` into a single list,
+        // interleaving in the order they were given on the command line.
         std::vector<std::string> copy_from = copy_from_;
         std::vector<std::string> move_from = move_from_;
+        std::vector<std::string> peers = peers_;
         absl::c_reverse(copy_from);
         absl::c_reverse(move_from);
+        absl::c_reverse(peers);
         std::vector<Frz::ContentSource> content_sources;
         for (const auto* option : app_.parse_order()) {
             if (option == &copy_from_opt_) {
+                const std::filesystem::path dir =
+                    working_dir / copy_from.back();
                 content_sources.push_back(
-                    {.path = working_dir / copy_from.back(),
-                     .read_only = true});
+                    {.path = dir,
+                     .read_only = true,
+                     .cache_file = CacheFile(working_dir, dir),
+                     .peer = std::nullopt});
                 copy_from.pop_back();
             } else if (option == &move_from_opt_) {
                 content_sources.push_back(
                     {.path = working_dir / move_from.back(),
-                     .read_only = false});
+                     .read_only = false,
+                     .cache_file = std::nullopt,
+                     .peer = std::nullopt});
                 move_from.pop_back();
+            } else if (option == &peer_opt_) {
+                content_sources.push_back({.path = working_dir,
+                                           .read_only = true,
+                                           .cache_file = std::nullopt,
+                                           .peer = peers.back()});
+                peers.pop_back();
             }
         }
         FRZ_ASSERT_EQ(copy_from.size(), 0);
         FRZ_ASSERT_EQ(move_from.size(), 0);
+        FRZ_ASSERT_EQ(peers.size(), 0);
         FRZ_ASSERT_EQ(content_sources.size(),
-                      copy_from_.size() + move_from_.size());
+                      copy_from_.size() + move_from_.size() + peers_.size());
         return content_sources;
     }
 
   private:
+    // The cache file for the given source directory, if we use a cache.
+    // Each directory gets its own file, named after its absolute path.
+    std::optional<std::filesystem::path> CacheFile(
+        const std::filesystem::path& working_dir,
+        const std::filesystem::path& dir) const {
+        if (cache_dir_.empty()) {
+            return std::nullopt;
+        }
+        const std::filesystem::path cache_dir = working_dir / cache_dir_;
+        std::filesystem::create_directories(cache_dir);
+        return cache_dir /
+               absl::StrReplaceAll(
+                   std::filesystem::absolute(dir).lexically_normal().string(),
+                   {{"%", "%25"}, {"/", "%2F"}});
+    }
+
     std::vector<std::string> copy_from_;
     std::vector<std::string> move_from_;
+    std::vector<std::string> peers_;
+    std::string cache_dir_;
     const CLI::App& app_;
     const CLI::Option& copy_from_opt_;
     const CLI::Option& move_from_opt_;
+    const CLI::Option& peer_opt_;
 };
 
 struct CommonArgs {
@@ -109,6 +163,9 @@ int Add(CommonArgs& common_args, const AddArgs& add_args) {
         return path.lexically_normal().lexically_proximate(
             common_args.working_dir.lexically_normal());
     };
+    // Files to add to git once they've been replaced with symlinks, which may
+    // not happen until we commit.
+    std::vector<std::filesystem::path> added;
     auto add_file = [&](const std::filesystem::directory_entry& dent) {
         if (std::filesystem::is_directory(dent.symlink_status())) {
             return;
@@ -125,8 +182,7 @@ int Add(CommonArgs& common_args, const AddArgs& add_args) {
             ++duplicates;
             absl::PrintF("= %s\n", pretty_path(dent.path()));
         }
-        git->Add(dent.path());  // don't use plain `dent` here, since AddFile()
-                                // will have replaced the file with a symlink
+        added.push_back(dent.path());
     };
     for (const auto& file : add_args.files) {
         try {
@@ -160,6 +216,28 @@ int Add(CommonArgs& common_args, const AddArgs& add_args) {
         }
     }
 
+    try {
+        common_args.frz_repo->Commit();
+    } catch (const Error& e) {
+        ++errors;
+        absl::PrintF("*** %s\n", e.what());
+    }
+    for (const std::filesystem::path& path : added) {
+        try {
+            // In durable mode, the file is replaced with a symlink only when
+            // it's committed; if that failed, the file is still a regular
+            // file that git shouldn't see.
+            const std::filesystem::directory_entry dent(path);
+            if (!dent.is_symlink()) {
+                continue;
+            }
+            git->Add(dent);
+        } catch (const Error& e) {
+            ++errors;
+            absl::PrintF("*** %s\n *- %s\n", pretty_path(path), e.what());
+        }
+    }
+
     git->Save();
 
     absl::PrintF(
@@ -194,14 +272,16 @@ int Fill(CommonArgs& common_args, const FillArgs& fill_args) {
 
 struct RepairArgs {
     bool fast = false;
+    bool incremental = false;
+    int jobs = 16;
     std::vector<Frz::ContentSource> content_sources;
 };
 int Repair(CommonArgs& common_args, const RepairArgs& repair_args) {
     try {
         const auto result = common_args.frz_repo->Repair(
             common_args.log, common_args.working_dir,
-            /*verify_all_hashes=*/!repair_args.fast,
-            repair_args.content_sources);
+            /*verify_all_hashes=*/!repair_args.fast, repair_args.incremental,
+            repair_args.jobs, repair_args.content_sources);
         common_args.log.Important(
             "Index symlinks\n"
             "  %d OK\n"
@@ -222,6 +302,92 @@ int Repair(CommonArgs& common_args, const RepairArgs& repair_args) {
     }
 }
 
+struct MigrateArgs {
+    std::optional<SymlinkLayout> index_layout;
+    std::optional<std::string> content_layout;
+    SymlinkLayout hashed_content_layout = kDefaultSymlinkLayout;
+};
+int Migrate(CommonArgs& common_args, const MigrateArgs& migrate_args) {
+    try {
+        Frz::MigrateOptions options = {
+            .index_layout = migrate_args.index_layout,
+            .change_content_layout = false,
+            .content_layout = std::nullopt};
+        if (migrate_args.content_layout.has_value()) {
+            options.change_content_layout = true;
+            if (*migrate_args.content_layout == "hashed") {
+                options.content_layout = migrate_args.hashed_content_layout;
+            } else if (*migrate_args.content_layout != "random") {
+                throw Error("Unknown content layout: %s",
+                            *migrate_args.content_layout);
+            }
+        }
+        if (!options.index_layout.has_value() &&
+            !options.change_content_layout) {
+            throw Error("Nothing to migrate");
+        }
+        const auto result = common_args.frz_repo->Migrate(
+            common_args.log, common_args.working_dir, options);
+        common_args.log.Important(
+            "Index symlinks\n"
+            "  %d moved to the new layout\n"
+            "File symlinks\n"
+            "  %d updated\n"
+            "Content files\n"
+            "  %d moved to hashed paths",
+            result.num_index_symlinks, result.num_updated_symlinks,
+            result.num_moved_content_files);
+        return 0;
+    } catch (const Error& e) {
+        common_args.log.Error(e.what());
+        return 1;
+    }
+}
+
+int Tier(CommonArgs& common_args) {
+    try {
+        const auto result = common_args.frz_repo->Tier(
+            common_args.log, common_args.working_dir);
+        common_args.log.Important(
+            "Content files\n"
+            "  %d moved to the cold tier\n"
+            "  %d moved to the hot tier",
+            result.num_moved_to_cold, result.num_moved_to_hot);
+        return 0;
+    } catch (const Error& e) {
+        common_args.log.Error(e.what());
+        return 1;
+    }
+}
+
+struct ServeArgs {
+    std::optional<std::filesystem::path> socket;
+};
+int Serve(CommonArgs& common_args, const ServeArgs& serve_args) {
+    try {
+        Frz::ServeOptions options = {.socket = std::nullopt,
+                                     .read_fd = STDIN_FILENO,
+                                     .write_fd = STDOUT_FILENO};
+        if (serve_args.socket.has_value()) {
+            options.socket = common_args.working_dir / *serve_args.socket;
+        } else {
+            // Standard output is the peer connection, so move it out of the
+            // way of log messages, which go to standard error instead.
+            options.write_fd = dup(STDOUT_FILENO);
+            if (options.write_fd == -1 ||
+                dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+                throw ErrnoError();
+            }
+        }
+        common_args.frz_repo->Serve(common_args.log, common_args.working_dir,
+                                    options);
+        return 0;
+    } catch (const Error& e) {
+        common_args.log.Error(e.what());
+        return 1;
+    }
+}
+
 }  // namespace
 
 int Command(const std::filesystem::path& working_dir,
@@ -256,8 +422,58 @@ int Command(const std::filesystem::path& working_dir, int argc,
     RepairArgs repair_args;
     repair_command.add_flag("--fast", repair_args.fast,
                             "Don't re-hash all content");
+    repair_command.add_flag(
+        "--incremental", repair_args.incremental,
+        "Only check directories that changed since the last repair");
+    repair_command
+        .add_option("-j,--jobs", repair_args.jobs,
+                    "Number of unindexed content files to hash concurrently")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
     ContentSourceOptions repair_content_sources(repair_command);
 
+    CLI::App& migrate_command = *app.add_subcommand(
+        "migrate", "Change the on-disk layout of the repository");
+    MigrateArgs migrate_args;
+    SymlinkLayout index_layout;
+    CLI::Option* const index_subdirs_option = migrate_command.add_option(
+        "--index-subdirs", index_layout.subdirs,
+        "Number of levels of index subdirectories");
+    CLI::Option* const index_subdir_digits_option = migrate_command.add_option(
+        "--index-subdir-digits", index_layout.subdir_digits,
+        "Number of base-32 digits per index subdirectory name");
+    index_subdirs_option->needs(index_subdir_digits_option);
+    index_subdir_digits_option->needs(index_subdirs_option);
+    std::string content_layout;
+    CLI::Option* const content_layout_option = migrate_command.add_option(
+        "--content-layout", content_layout,
+        "Put content files at random paths (\"random\") or at paths derived "
+        "from their hashes (\"hashed\")");
+    migrate_command
+        .add_option("--content-subdirs",
+                    migrate_args.hashed_content_layout.subdirs,
+                    "Number of levels of hashed content subdirectories")
+        ->needs(content_layout_option);
+    migrate_command
+        .add_option("--content-subdir-digits",
+                    migrate_args.hashed_content_layout.subdir_digits,
+                    "Number of base-32 digits per hashed content subdirectory "
+                    "name")
+        ->needs(content_layout_option);
+
+    CLI::App& tier_command = *app.add_subcommand(
+        "tier", "Move content files between the hot and cold tiers");
+
+    CLI::App& serve_command = *app.add_subcommand(
+        "serve",
+        "Serve this repository's content to `--copy-from-peer` clients");
+    ServeArgs serve_args;
+    serve_command
+        .add_option("--socket", serve_args.socket,
+                    "Listen on a Unix socket here, instead of serving a "
+                    "single client on standard input and output")
+        ->type_name("PATH");
+
     CLI11_PARSE(app, argc, argv);
 
     const std::unique_ptr<Streamer> streamer =
@@ -279,6 +495,18 @@ int Command(const std::filesystem::path& working_dir, int argc,
         repair_args.content_sources =
             repair_content_sources.GetResult(working_dir);
         return Repair(common_args, repair_args);
+    } else if (migrate_command.parsed()) {
+        if (index_subdirs_option->count() > 0) {
+            migrate_args.index_layout = index_layout;
+        }
+        if (content_layout_option->count() > 0) {
+            migrate_args.content_layout = content_layout;
+        }
+        return Migrate(common_args, migrate_args);
+    } else if (tier_command.parsed()) {
+        return Tier(common_args);
+    } else if (serve_command.parsed()) {
+        return Serve(common_args, serve_args);
     } else {
         FRZ_CHECK(false);
     }
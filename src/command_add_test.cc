@@ -21,6 +21,7 @@
 #include <gtest/gtest.h>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "command.hh"
@@ -308,5 +309,33 @@ TEST_P(TestCommandAdd2, FrzDirectoryIsIgnored) {
         ElementsAre(AllOf(IsRegularFile(), ReadContents(StrEq("bar")))));
 }
 
+TEST_P(TestCommandAdd2, Durable) {
+    TempDir d;
+    d.File(".frz/config", "durable = true\n");
+    if (UseGit()) {
+        CreateGitRepository(d.Path());
+    }
+    d.File("a", "same");
+    d.File("sub/b", "same");
+    d.File("sub/c", "other");
+
+    EXPECT_EQ(0, Command(d.Path(), {"add", "."}));
+
+    for (const auto& [file, contents] :
+         {std::pair("a", "same"), std::pair("sub/b", "same"),
+          std::pair("sub/c", "other")}) {
+        EXPECT_THAT(d.Path() / file,
+                    AllOf(IsSymlinkWhoseTarget(StartsWith(".frz/blake3/")),
+                          ReadContents(StrEq(contents)),
+                          UseGit() ? GitStatus(ElementsAre("index_new"))
+                                   : Not(GitStatus(_))));
+    }
+    EXPECT_THAT(RecursiveListDirectory(d.Path() / ".frz/content"),
+                AllOf(SizeIs(2), Each(IsRegularFile())));
+    EXPECT_THAT(
+        RecursiveListDirectory(d.Path() / ".frz/unused-content"),
+        ElementsAre(AllOf(IsRegularFile(), ReadContents(StrEq("same")))));
+}
+
 }  // namespace
 }  // namespace frz
@@ -132,6 +132,23 @@ TEST(TestCommandFill, MoveFrom) {
     EXPECT_THAT(d.Path() / "sub/foo", IsNotFound());
 }
 
+TEST(TestCommandFill, FromAnotherRepository) {
+    for (const char* flag : {"--copy-from", "--move-from"}) {
+        TempDir replica = CreateSmallTestRepo();
+        TempDir d = CreateSmallTestRepo();
+        d.Remove(".frz/content");
+        d.Remove(".frz/blake3");
+        EXPECT_EQ(0, Command(d.Path(), {"fill", flag, replica.Path().string()}));
+        EXPECT_THAT(d.Path() / "file1", ReadContents(StrEq("123")));
+        EXPECT_THAT(d.Path() / "file3", ReadContents(StrEq("789")));
+
+        // Whether we were told to copy or move, the other repository is left
+        // intact.
+        EXPECT_EQ(0, Command(replica.Path(), {"repair"}));
+        EXPECT_THAT(replica.Path() / "file1", ReadContents(StrEq("123")));
+    }
+}
+
 TEST(TestCommandFill, ContentSourcesAreOrdered) {
     TempDir d = CreateSmallTestRepo();
     d.Remove(".frz/content");
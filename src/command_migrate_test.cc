@@ -0,0 +1,165 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <filesystem>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "command.hh"
+#include "filesystem_testing.hh"
+
+namespace frz {
+namespace {
+
+using ::testing::AllOf;
+using ::testing::HasSubstr;
+using ::testing::MatchesRegex;
+using ::testing::Not;
+using ::testing::StrEq;
+
+TempDir CreateSmallTestRepo() {
+    TempDir d;
+    d.Dir(".frz");
+    d.File("file1", "123");
+    d.File("dir/file2", "456");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "."}));
+    return d;
+}
+
+int RunMigrate(const std::filesystem::path& working_dir, int subdirs,
+               int subdir_digits) {
+    return Command(working_dir, {"migrate", "--index-subdirs",
+                                 std::to_string(subdirs),
+                                 "--index-subdir-digits",
+                                 std::to_string(subdir_digits)});
+}
+
+TEST(TestCommandMigrate, MigrateIndexAndBack) {
+    TempDir d = CreateSmallTestRepo();
+
+    // One level of three-digit subdirectories.
+    EXPECT_EQ(0, RunMigrate(d.Path(), 1, 3));
+    EXPECT_THAT(d.Path() / "file1",
+                AllOf(IsSymlinkWhoseTarget(
+                          MatchesRegex("\\.frz/blake3/[^/]{3}/[^/]+")),
+                      ReadContents(StrEq("123"))));
+    EXPECT_THAT(d.Path() / "dir/file2",
+                AllOf(IsSymlinkWhoseTarget(
+                          MatchesRegex("\\.frz/blake3/[^/]{3}/[^/]+")),
+                      ReadContents(StrEq("456"))));
+    EXPECT_THAT(d.Path() / ".frz/config",
+                ReadContents(HasSubstr("index.subdirs = 1")));
+    EXPECT_EQ(0, Command(d.Path(), {"repair"}));
+
+    // Migrating to the layout we already have is a no-op.
+    EXPECT_EQ(0, RunMigrate(d.Path(), 1, 3));
+
+    // Files added after the migration use the new layout.
+    d.File("file3", "789");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "file3"}));
+    EXPECT_THAT(d.Path() / "file3",
+                IsSymlinkWhoseTarget(
+                    MatchesRegex("\\.frz/blake3/[^/]{3}/[^/]+")));
+
+    // And back to the default layout.
+    EXPECT_EQ(0, RunMigrate(d.Path(), 2, 2));
+    EXPECT_THAT(d.Path() / "file3",
+                AllOf(IsSymlinkWhoseTarget(
+                          MatchesRegex("\\.frz/blake3/[^/]{2}/[^/]{2}/[^/]+")),
+                      ReadContents(StrEq("789"))));
+    EXPECT_EQ(0, Command(d.Path(), {"repair"}));
+}
+
+TEST(TestCommandMigrate, InterruptedMigrationCanBeResumed) {
+    TempDir d = CreateSmallTestRepo();
+
+    // Pretend that a migration to a flat layout was interrupted right after
+    // it started.
+    d.File(".frz/config",
+           "index.subdirs = 1\n"
+           "index.subdir-digits = 1\n"
+           "index.previous-subdirs = 2\n"
+           "index.previous-subdir-digits = 2\n");
+
+    // The repository is usable in the meantime.
+    EXPECT_EQ(0, Command(d.Path(), {"fill"}));
+    EXPECT_THAT(d.Path() / "file1", ReadContents(StrEq("123")));
+
+    // A migration to some other layout must wait.
+    EXPECT_EQ(1, RunMigrate(d.Path(), 3, 1));
+
+    EXPECT_EQ(0, RunMigrate(d.Path(), 1, 1));
+    EXPECT_THAT(d.Path() / "file1",
+                AllOf(IsSymlinkWhoseTarget(
+                          MatchesRegex("\\.frz/blake3/[^/]/[^/]+")),
+                      ReadContents(StrEq("123"))));
+    EXPECT_THAT(d.Path() / ".frz/config",
+                ReadContents(Not(HasSubstr("previous"))));
+    EXPECT_EQ(0, Command(d.Path(), {"repair"}));
+}
+
+TEST(TestCommandMigrate, HashedContentLayout) {
+    TempDir d = CreateSmallTestRepo();
+    EXPECT_EQ(0, Command(d.Path(), {"migrate", "--content-layout", "hashed",
+                                    "--content-subdirs", "1"}));
+    EXPECT_THAT(d.Path() / ".frz/config",
+                ReadContents(HasSubstr("content.subdirs = 1")));
+
+    // Content files, old and new, are found at paths derived from their
+    // hashes.
+    d.File("file3", "789");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "file3"}));
+    const std::filesystem::path root = std::filesystem::canonical(d.Path());
+    for (const char* file : {"file1", "dir/file2", "file3"}) {
+        const std::filesystem::path content =
+            std::filesystem::canonical(d.Path() / file);
+        EXPECT_THAT(content.lexically_relative(root).generic_string(),
+                    MatchesRegex("\\.frz/content/[^/]{2}/[^/]+"))
+            << file;
+
+        // The index symlink's name is the hash minus the first four digits,
+        // and the content file's name is the hash minus the first two.
+        EXPECT_EQ(content.filename().string().substr(2),
+                  std::filesystem::read_symlink(d.Path() / file).filename())
+            << file;
+    }
+    EXPECT_EQ(0, Command(d.Path(), {"repair"}));
+
+    // If the index is lost, fill finds the content without any sources.
+    d.Remove(".frz/blake3");
+    EXPECT_EQ(0, Command(d.Path(), {"fill"}));
+    EXPECT_THAT(d.Path() / "file3", ReadContents(StrEq("789")));
+
+    // Switching back to random names just leaves the files where they are.
+    EXPECT_EQ(0, Command(d.Path(), {"migrate", "--content-layout", "random"}));
+    EXPECT_THAT(d.Path() / ".frz/config",
+                ReadContents(Not(HasSubstr("content."))));
+    EXPECT_EQ(0, Command(d.Path(), {"repair"}));
+}
+
+TEST(TestCommandMigrate, BadLayoutIsRejected) {
+    TempDir d = CreateSmallTestRepo();
+    EXPECT_NE(0, RunMigrate(d.Path(), 5, 2));
+    EXPECT_NE(0, RunMigrate(d.Path(), 2, 0));
+    EXPECT_NE(0, RunMigrate(d.Path(), 2, 4));
+    EXPECT_NE(0, Command(d.Path(), {"migrate", "--content-layout", "sorted"}));
+    EXPECT_NE(0, Command(d.Path(), {"migrate"}));
+    EXPECT_THAT(d.Path() / ".frz/config", IsNotFound());
+}
+
+}  // namespace
+}  // namespace frz
@@ -14,6 +14,8 @@
   limitations under the License.
 */
 
+#include <absl/strings/str_format.h>
+#include <chrono>
 #include <filesystem>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -28,6 +30,8 @@ namespace frz {
 namespace {
 
 using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::SizeIs;
 using ::testing::StartsWith;
 using ::testing::StrEq;
 
@@ -124,6 +128,33 @@ TEST_P(TestCommandRepair, ContentFilePermissions) {
         std::filesystem::symlink_status(d.FollowSymlinks("file1").back())));
 }
 
+TEST_P(TestCommandRepair, ReindexesManyContentFilesConcurrently) {
+    TempDir d;
+    d.Dir(".frz");
+    for (int i = 0; i < 100; ++i) {
+        d.File(absl::StrFormat("file%d", i), absl::StrFormat("%d", i % 60));
+    }
+    EXPECT_EQ(0, Command(d.Path(), {"add", "."}));
+    d.Remove(".frz/blake3");
+
+    // Put copies of some of the content files in the content directory, so
+    // that there are duplicates to be found too.
+    for (int i = 0; i < 10; ++i) {
+        d.File(absl::StrFormat(".frz/content/dup%d", i),
+               absl::StrFormat("%d", i));
+    }
+
+    EXPECT_EQ(0, RunRepair(d.Path(), {"--jobs", "8"}));
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_THAT(d.Path() / absl::StrFormat("file%d", i),
+                    ReadContents(StrEq(absl::StrFormat("%d", i % 60))));
+    }
+    EXPECT_THAT(RecursiveListDirectory(d.Path() / ".frz/content"),
+                SizeIs(60));
+    EXPECT_THAT(RecursiveListDirectory(d.Path() / ".frz/unused-content"),
+                SizeIs(40 + 10));
+}
+
 TEST_P(TestCommandRepair, AddsMissingFrzSymlink) {
     TempDir d;
     d.Dir(".frz");
@@ -198,5 +229,66 @@ TEST_P(TestCommandRepair, ContentSourcesAreOrdered) {
     EXPECT_THAT(d.Path() / "sub3/c", IsNotFound());
 }
 
+// Pretend that all directories in the repository were last modified an hour
+// ago, so that incremental repair doesn't consider them too recently modified
+// to be trusted.
+void BackdateDirectories(const std::filesystem::path& dir) {
+    const auto an_hour_ago =
+        std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+    std::filesystem::last_write_time(dir, an_hour_ago);
+    for (const std::filesystem::directory_entry& dent :
+         std::filesystem::recursive_directory_iterator(dir)) {
+        if (std::filesystem::is_directory(dent.symlink_status())) {
+            std::filesystem::last_write_time(dent.path(), an_hour_ago);
+        }
+    }
+}
+
+TempDir CreateRepairedTestRepo() {
+    TempDir d = CreateSmallTestRepo();
+    BackdateDirectories(d.Path());
+    EXPECT_EQ(0, Command(d.Path(), {"repair", "--fast"}));
+    EXPECT_THAT(d.Path() / ".frz/repair-snapshot", IsRegularFile());
+    return d;
+}
+
+TEST(TestCommandRepairIncremental, TrustsUnchangedDirectories) {
+    TempDir d = CreateRepairedTestRepo();
+    AddWritePermission(d.FollowSymlinks("file1").back());
+    d.File("file1", "1x3");  // Replace one character.
+
+    // No directories have changed, so an incremental repair doesn't look at
+    // the content file, even when asked to verify hashes.
+    EXPECT_EQ(0, Command(d.Path(), {"repair", "--incremental"}));
+
+    // A full repair finds the problem.
+    EXPECT_EQ(1, Command(d.Path(), {"repair"}));
+    EXPECT_THAT(d.Path() / ".frz/repair-snapshot", IsNotFound());
+}
+
+TEST(TestCommandRepairIncremental, DetectsRemovedContentFile) {
+    TempDir d = CreateRepairedTestRepo();
+    std::filesystem::remove(d.FollowSymlinks("file1").back());
+    EXPECT_EQ(1, Command(d.Path(), {"repair", "--fast", "--incremental"}));
+}
+
+TEST(TestCommandRepairIncremental, RecreatesRemovedIndexSymlink) {
+    TempDir d = CreateRepairedTestRepo();
+    const std::filesystem::path index_symlink = d.FollowSymlinks("file1")[1];
+    std::filesystem::remove(index_symlink);
+    EXPECT_EQ(0, Command(d.Path(), {"repair", "--fast", "--incremental"}));
+    EXPECT_THAT(index_symlink, IsSymlinkWhoseTarget(HasSubstr("/content/")));
+    EXPECT_THAT(d.Path() / "file1", ReadContents(StrEq("123")));
+}
+
+TEST(TestCommandRepairIncremental, NoticesNewFiles) {
+    TempDir d = CreateRepairedTestRepo();
+    d.File("sub/file4", "abc");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "sub"}));
+    std::filesystem::remove(d.FollowSymlinks("sub/file4")[1]);
+    EXPECT_EQ(0, Command(d.Path(), {"repair", "--fast", "--incremental"}));
+    EXPECT_THAT(d.Path() / "sub/file4", ReadContents(StrEq("abc")));
+}
+
 }  // namespace
 }  // namespace frz
@@ -0,0 +1,93 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <filesystem>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "command.hh"
+#include "filesystem_testing.hh"
+
+namespace frz {
+namespace {
+
+using ::testing::MatchesRegex;
+using ::testing::StrEq;
+
+// The path of the content file that `file` refers to, relative to the
+// repository root.
+std::string ContentPath(const TempDir& d, const std::filesystem::path& file) {
+    return std::filesystem::canonical(d.Path() / file)
+        .lexically_relative(std::filesystem::canonical(d.Path()))
+        .generic_string();
+}
+
+TEST(TestCommandTier, MoveToColdTierAndBack) {
+    TempDir d;
+    d.Dir(".frz");
+    d.File("small", "123");
+    d.File("dir/large", "4567890");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "."}));
+    d.File(".frz/config",
+           "tier.cold-min-size = 5\n"
+           "tier.cold-min-idle-days = 0\n");
+
+    // The large file goes to the cold tier; the small one stays.
+    EXPECT_EQ(0, Command(d.Path(), {"tier"}));
+    EXPECT_THAT(ContentPath(d, "dir/large"),
+                MatchesRegex("\\.frz/cold-content/.+"));
+    EXPECT_THAT(ContentPath(d, "small"), MatchesRegex("\\.frz/content/.+"));
+    EXPECT_THAT(d.Path() / "dir/large", ReadContents(StrEq("4567890")));
+    EXPECT_EQ(0, Command(d.Path(), {"repair"}));
+
+    // New files go to the hot tier.
+    d.File("large2", "0987654");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "large2"}));
+    EXPECT_THAT(ContentPath(d, "large2"), MatchesRegex("\\.frz/content/.+"));
+
+    // Once the threshold is raised, the file is no longer large enough to be
+    // cold.
+    d.File(".frz/config",
+           "tier.cold-min-size = 100\n"
+           "tier.cold-min-idle-days = 0\n");
+    EXPECT_EQ(0, Command(d.Path(), {"tier"}));
+    EXPECT_THAT(ContentPath(d, "dir/large"),
+                MatchesRegex("\\.frz/content/.+"));
+    EXPECT_THAT(d.Path() / "dir/large", ReadContents(StrEq("4567890")));
+    EXPECT_EQ(0, Command(d.Path(), {"repair"}));
+}
+
+TEST(TestCommandTier, RecentlyAddedFilesStayHot) {
+    TempDir d;
+    d.Dir(".frz");
+    d.File(".frz/config", "tier.cold-min-size = 1\n");
+    d.File("file", "123");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "file"}));
+    EXPECT_EQ(0, Command(d.Path(), {"tier"}));
+    EXPECT_THAT(ContentPath(d, "file"), MatchesRegex("\\.frz/content/.+"));
+}
+
+TEST(TestCommandTier, NoColdTier) {
+    TempDir d;
+    d.Dir(".frz");
+    d.File("file", "123");
+    EXPECT_EQ(0, Command(d.Path(), {"add", "file"}));
+    EXPECT_NE(0, Command(d.Path(), {"tier"}));
+}
+
+}  // namespace
+}  // namespace frz
@@ -16,23 +16,74 @@
 
 #include "content_source.hh"
 
+#include <absl/base/thread_annotations.h>
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/synchronization/mutex.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <filesystem>
 #include <functional>
 #include <memory>
 #include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 #include "content_store.hh"
 #include "exceptions.hh"
+#include "file_list.hh"
 #include "file_stream.hh"
+#include "fingerprint.hh"
 #include "hash.hh"
+#include "hash_index.hh"
 #include "hasher.hh"
 #include "log.hh"
+#include "read_order.hh"
+#include "source_cache.hh"
 #include "stream.hh"
+#include "tar_reader.hh"
+#include "worker.hh"
 
 namespace frz {
 namespace {
 
+// The number of candidate files that `FindFile` and `FindMany` hash
+// concurrently, and the size of the read buffer used by each of them.
+constexpr int kNumHashThreads = 8;
+constexpr int kHashBufferSize = 256 * 1024;
+
+// Hash the file at `path`, and report each buffer's worth of bytes to
+// `progress`. If `copy` is non-null, pass the bytes on to it too. Give up and
+// return nullopt if `cancelled` becomes true before we're done.
+std::optional<HashAndSize<256>> HashFileUnlessCancelled(
+    const std::filesystem::path& path, std::unique_ptr<Hasher<256>> hasher,
+    const std::atomic<bool>& cancelled, std::function<void(int)> progress,
+    StreamSink* const copy = nullptr) {
+    if (cancelled) {
+        return std::nullopt;  // don't even open the file
+    }
+    auto source = CreateFileSource(path);
+    SizeHasher size_hasher(std::move(hasher));
+    std::vector<std::byte> buffer(kHashBufferSize);
+    while (!cancelled) {
+        const FillBufferFromStreamResult r =
+            FillBufferFromStream(*source, buffer);
+        size_hasher.AddBytes(std::span(buffer).first(r.num_bytes));
+        if (copy != nullptr) {
+            copy->AddBytes(std::span(buffer).first(r.num_bytes));
+        }
+        progress(r.num_bytes);
+        if (r.end) {
+            return size_hasher.Finish();
+        }
+    }
+    return std::nullopt;
+}
+
 // A content source based on a directory tree of files. Starts out knowing only
 // the set of files and their file sizes (which can be obtained by a relatively
 // quick directory traversal), and lazily computes content hashes as necessary.
@@ -44,11 +95,21 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
   public:
     DirectoryContentSource(
         const std::filesystem::path& dir, bool read_only, Streamer& streamer,
-        std::function<std::unique_ptr<Hasher<256>>()> create_hasher)
+        std::function<std::unique_ptr<Hasher<256>>()> create_hasher,
+        std::function<std::optional<Fingerprint>(const HashAndSize<HashBits>&)>
+            fingerprint,
+        const std::optional<std::filesystem::path>& cache_file)
         : dir_(dir),
           read_only_(read_only),
           streamer_(streamer),
-          create_hasher_(std::move(create_hasher)) {}
+          create_hasher_(std::move(create_hasher)),
+          fingerprint_(std::move(fingerprint)) {
+        // We change the directories we move files from, so caching them
+        // would be of little use.
+        if (cache_file.has_value() && read_only_) {
+            cache_.emplace(dir_, *cache_file);
+        }
+    }
 
     std::optional<std::filesystem::path> Fetch(
         Log& log, const HashAndSize<HashBits>& hs,
@@ -72,19 +133,279 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
         return std::nullopt;
     }
 
+    void FetchMany(Log& log, std::span<const HashAndSize<HashBits>> wanted,
+                   ContentStore& content_store,
+                   std::function<void(const HashAndSize<HashBits>& hs,
+                                      const std::filesystem::path& path)>
+                       fetched,
+                   std::function<bool(const HashAndSize<HashBits>& hs)>
+                       still_wanted) override {
+        ListFiles(log);
+        FindMany(log, wanted, content_store, std::move(fetched),
+                 std::move(still_wanted));
+        if (cache_.has_value()) {
+            try {
+                cache_->Save();
+            } catch (const Error& e) {
+                log.Important("When saving the cache for %s: %s", dir_,
+                              e.what());
+            }
+        }
+    }
+
   private:
-    // Traverse the directory tree and populate files_by_size_.
+    // Hash only files whose sizes are wanted, in the order they're laid out
+    // on disk, and stop as soon as everything we can possibly find has been
+    // found.
+    void FindMany(Log& log, std::span<const HashAndSize<HashBits>> wanted,
+                  ContentStore& content_store,
+                  std::function<void(const HashAndSize<HashBits>& hs,
+                                     const std::filesystem::path& path)>
+                      fetched,
+                  const std::function<bool(const HashAndSize<HashBits>& hs)>&
+                      still_wanted) {
+        // Changes to our maps, logging, and calls to `fetched` and
+        // `still_wanted` are done while holding `mutex`. Candidates are
+        // hashed concurrently (see below), but the content store isn't
+        // thread-safe, so inserts are done one at a time, while holding
+        // `insert_mutex`. Never wait for `insert_mutex` while holding
+        // `mutex`.
+        absl::Mutex mutex;
+        absl::Mutex insert_mutex;
+        auto insert = [&](const HashAndSize<HashBits>& hs,
+                          const std::filesystem::path& path) {
+            {
+                absl::MutexLock ml(&mutex);
+                if (still_wanted != nullptr && !still_wanted(hs)) {
+                    return;
+                }
+            }
+            std::filesystem::path inserted;
+            try {
+                absl::MutexLock il(&insert_mutex);
+                inserted = read_only_
+                               ? content_store.CopyInsert(path, streamer_)
+                               : content_store.MoveInsert(path, streamer_);
+            } catch (const Error& e) {
+                absl::MutexLock ml(&mutex);
+                log.Important("When fetching %s: %s", hs.ToBase32(),
+                              e.what());
+                return;
+            }
+            absl::MutexLock ml(&mutex);
+            fetched(hs, inserted);
+        };
+
+        // Take care of the files whose hashes we already know, and count the
+        // ones we'll have to look for, by size.
+        absl::flat_hash_set<HashAndSize<HashBits>> remaining;
+        absl::flat_hash_map<std::uintmax_t, int> num_remaining_by_size;
+        std::int64_t num_remaining_bytes = 0;
+        for (const HashAndSize<HashBits>& hs : wanted) {
+            if (const std::optional<std::filesystem::path> p = KnownFile(hs)) {
+                insert(hs, *p);
+            } else if (files_by_size_.contains(hs.GetSize()) &&
+                       remaining.insert(hs).second) {
+                ++num_remaining_by_size[hs.GetSize()];
+                num_remaining_bytes += hs.GetSize();
+            }
+        }
+        if (remaining.empty()) {
+            return;
+        }
+
+        // For the sizes where we know the fingerprints of all the files we
+        // want, candidates with other fingerprints needn't be hashed.
+        absl::flat_hash_map<std::uintmax_t, absl::flat_hash_set<Fingerprint>>
+            fingerprints_by_size;
+        absl::flat_hash_set<std::uintmax_t> unfingerprinted_sizes;
+        for (const HashAndSize<HashBits>& hs : remaining) {
+            const std::optional<Fingerprint> fp = LookupFingerprint(hs);
+            if (!fp.has_value()) {
+                unfingerprinted_sizes.insert(hs.GetSize());
+            } else {
+                fingerprints_by_size[hs.GetSize()].insert(*fp);
+            }
+        }
+        for (std::uintmax_t size : unfingerprinted_sizes) {
+            fingerprints_by_size.erase(size);
+        }
+
+        auto progress = log.Progress("Hashing files in %s", dir_);
+        auto file_counter = progress.AddCounter("files");
+        auto wanted_counter =
+            progress.AddCounter("bytes wanted", num_remaining_bytes);
+
+        // Hash the candidates of the given sizes, skipping those that
+        // `fingerprints_by_size` rules out. Candidates are hashed
+        // concurrently, but started in the order they're laid out on disk.
+        auto hash_candidates =
+            [&](std::span<const std::uintmax_t> sizes,
+                const absl::flat_hash_map<std::uintmax_t,
+                                          absl::flat_hash_set<Fingerprint>>&
+                    fingerprints_by_size) {
+                // Collect every file of the given sizes. Each size gets a
+                // flag that cancels the hashing of its remaining candidates
+                // once no one wants a file of that size anymore.
+                std::vector<std::pair<FileList::FileId, std::size_t>>
+                    candidates;
+                std::vector<std::filesystem::path> candidate_paths;
+                std::vector<std::size_t> num_candidates;
+                for (std::size_t s = 0; s < sizes.size(); ++s) {
+                    auto size_it = files_by_size_.find(sizes[s]);
+                    for (FileList::FileId f : size_it->second) {
+                        candidates.emplace_back(f, s);
+                        candidate_paths.push_back(file_list_.Path(f));
+                    }
+                    num_candidates.push_back(size_it->second.size());
+                    files_by_size_.erase(size_it);
+                }
+                std::vector<std::atomic<bool>> size_done(sizes.size());
+
+                WorkerPool pool(kNumHashThreads);
+                for (std::size_t i : DiskReadOrder(candidate_paths)) {
+                    const auto [f, s] = candidates[i];
+                    const std::uintmax_t size = sizes[s];
+                    std::atomic<bool>& done = size_done[s];
+                    if (done) {
+                        absl::MutexLock ml(&mutex);
+                        files_by_size_[size].push_back(f);
+                        continue;
+                    }
+                    auto fp_it = fingerprints_by_size.find(size);
+                    const absl::flat_hash_set<Fingerprint>* const fingerprints =
+                        fp_it == fingerprints_by_size.end() ? nullptr
+                                                            : &fp_it->second;
+                    // A read-only source's only candidate of its size is
+                    // probably the file we want, so we copy it into the
+                    // content store while we hash it, rather than read it
+                    // again once we know it matches.
+                    const bool copy_while_hashing =
+                        read_only_ && num_candidates[s] == 1;
+                    pool.Do([&, f, size, fingerprints, copy_while_hashing,
+                             p = candidate_paths[i]] {
+                        std::optional<HashAndSize<256>> p_hs;
+                        std::optional<std::filesystem::path> inserted;
+                        try {
+                            if (fingerprints != nullptr &&
+                                !MayMatch(f, size, *fingerprints)) {
+                                // Ruled out by its fingerprint.
+                            } else if (!copy_while_hashing) {
+                                p_hs = HashFileUnlessCancelled(
+                                    p, create_hasher_(), done, [](int) {});
+                            } else {
+                                absl::MutexLock il(&insert_mutex);
+                                inserted = content_store.StreamInsertHashed(
+                                    [&](StreamSink& sink)
+                                        -> std::optional<HashAndSize<256>> {
+                                        p_hs = HashFileUnlessCancelled(
+                                            p, create_hasher_(), done,
+                                            [](int) {}, &sink);
+                                        absl::MutexLock ml(&mutex);
+                                        if (!p_hs.has_value() ||
+                                            !remaining.contains(*p_hs) ||
+                                            (still_wanted != nullptr &&
+                                             !still_wanted(*p_hs))) {
+                                            return std::nullopt;
+                                        }
+                                        return p_hs;
+                                    });
+                            }
+                        } catch (const Error& e) {
+                            absl::MutexLock ml(&mutex);
+                            log.Important("When reading %s: %s", p, e.what());
+                            file_counter.Increment(1);
+                            return;
+                        }
+                        std::optional<std::filesystem::path> to_insert;
+                        {
+                            absl::MutexLock ml(&mutex);
+                            if (!p_hs.has_value()) {
+                                // Ruled out by its fingerprint, or cancelled.
+                                files_by_size_[size].push_back(f);
+                                return;
+                            }
+                            file_counter.Increment(1);
+                            auto it = RememberHash(*p_hs, f);
+                            if (remaining.erase(*p_hs) > 0) {
+                                if (--num_remaining_by_size.at(size) == 0) {
+                                    done = true;
+                                }
+                                wanted_counter.Increment(size);
+                                if (inserted.has_value()) {
+                                    fetched(*p_hs, *inserted);
+                                } else if (!copy_while_hashing) {
+                                    to_insert = file_list_.Path(it->second);
+                                }
+                            }
+                        }
+                        if (to_insert.has_value()) {
+                            insert(*p_hs, *to_insert);
+                        }
+                    });
+                }
+                pool.Wait();
+            };
+
+        std::vector<std::uintmax_t> sizes;
+        for (const auto& [size, num_remaining] : num_remaining_by_size) {
+            sizes.push_back(size);
+        }
+        hash_candidates(sizes, fingerprints_by_size);
+
+        // A recorded fingerprint could be wrong, so if what we want wasn't
+        // among the candidates it let through, hash the ones it ruled out
+        // after all.
+        sizes.clear();
+        for (const auto& [size, fingerprints] : fingerprints_by_size) {
+            if (num_remaining_by_size.at(size) > 0 &&
+                files_by_size_.contains(size)) {
+                sizes.push_back(size);
+            }
+        }
+        if (!sizes.empty()) {
+            hash_candidates(sizes, {});
+        }
+    }
+
+    // Traverse the directory tree and populate file_list_ and files_by_size_
+    // (and, with a cache, files_by_hash_).
     void ListFiles(Log& log) {
         if (files_listed_) {
             return;
         }
         auto progress = log.Progress("Listing files in %s", dir_);
         auto file_counter = progress.AddCounter("files");
-        for (const std::filesystem::directory_entry& dent :
-             std::filesystem::recursive_directory_iterator(dir_)) {
-            if (std::filesystem::is_regular_file(dent.symlink_status())) {
+        if (cache_.has_value()) {
+            cache_->List(file_list_,
+                         [&](FileList::FileId f,
+                             const SourceCache::FileState& state,
+                             const std::optional<HashAndSize<256>>& hs) {
+                             if (hs.has_value()) {
+                                 files_by_hash_.insert({*hs, f});
+                             } else {
+                                 files_by_size_[state.size].push_back(f);
+                             }
+                             file_counter.Increment(1);
+                         });
+            files_listed_ = true;
+            return;
+        }
+        // The directory we're in at each depth of the traversal.
+        std::vector<FileList::DirId> dirs = {
+            file_list_.AddDir(FileList::kNoDir, dir_.native())};
+        for (auto it = std::filesystem::recursive_directory_iterator(dir_);
+             it != std::filesystem::recursive_directory_iterator(); ++it) {
+            const std::filesystem::file_status status = it->symlink_status();
+            dirs.resize(it.depth() + 1);
+            if (std::filesystem::is_directory(status)) {
+                // The traversal will descend into this directory next.
+                dirs.push_back(file_list_.AddDir(
+                    dirs.back(), it->path().filename().native()));
+            } else if (std::filesystem::is_regular_file(status)) {
                 // A regular file (not a symlink to one).
-                files_by_size_[dent.file_size()].push_back(dent.path());
+                files_by_size_[it->file_size()].push_back(file_list_.AddFile(
+                    dirs.back(), it->path().filename().native()));
                 file_counter.Increment(1);
             }
         }
@@ -92,7 +413,7 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
     }
 
     // Locate a file with the given hash+size, and return its path---or
-    // nullopt, if it cannot be found. In the process, move file paths from
+    // nullopt, if it cannot be found. In the process, move files from
     // `files_by_size_` to `files_by_hash_` as their hashes become known. In
     // case it's efficient to do so, stream-insert the file to `content_store`
     // as part of the search.
@@ -106,11 +427,120 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
     std::optional<FindFileResult> FindFile(Log& log,
                                            const HashAndSize<HashBits>& hs,
                                            ContentStore* const content_store) {
-        auto hash_it = files_by_hash_.find(hs);
-        if (hash_it != files_by_hash_.end()) {
-            return FindFileResult{.path = hash_it->second,
-                                  .already_inserted = false};
+        if (const std::optional<std::filesystem::path> p = KnownFile(hs)) {
+            return FindFileResult{.path = *p, .already_inserted = false};
         }
+
+        // Candidates that are ruled out by their fingerprints are set aside
+        // while we hash the others, since later requests may want them.
+        const std::vector<FileList::FileId> set_aside = SetAsideMismatches(hs);
+        std::optional<FindFileResult> r =
+            HashCandidates(log, hs, content_store);
+        for (FileList::FileId f : set_aside) {
+            files_by_size_[hs.GetSize()].push_back(f);
+        }
+        if (!r.has_value() && !set_aside.empty()) {
+            // The recorded fingerprint could be wrong, so hash the
+            // candidates it ruled out after all.
+            r = HashCandidates(log, hs, content_store);
+        }
+        return r;
+    }
+
+    // Return the path of a file we know to have hash+size `hs`, if any. If
+    // the hash came from the cache and the file has changed since, forget
+    // the hash, and list the file among those we haven't hashed.
+    std::optional<std::filesystem::path> KnownFile(
+        const HashAndSize<HashBits>& hs) {
+        auto it = files_by_hash_.find(hs);
+        if (it == files_by_hash_.end()) {
+            return std::nullopt;
+        }
+        std::filesystem::path p = file_list_.Path(it->second);
+        if (!cache_.has_value() || cache_->Verify(it->second)) {
+            return p;
+        }
+        const FileList::FileId f = it->second;
+        files_by_hash_.erase(it);
+        if (const std::optional<SourceCache::FileState> state =
+                SourceCache::Stat(p)) {
+            files_by_size_[state->size].push_back(f);
+        }
+        return std::nullopt;
+    }
+
+    // Record that file `f` has hash+size `hs`. Return the entry for `hs` in
+    // `files_by_hash_` (which may name another file with the same content).
+    auto RememberHash(const HashAndSize<HashBits>& hs, FileList::FileId f) {
+        if (cache_.has_value()) {
+            cache_->SetHash(f, hs);
+        }
+        return files_by_hash_.insert({hs, f}).first;
+    }
+
+    // Look up the fingerprint of a file we want, if it's large enough to
+    // have one.
+    std::optional<Fingerprint> LookupFingerprint(
+        const HashAndSize<HashBits>& hs) const {
+        if (hs.GetSize() < kMinFingerprintedSize || fingerprint_ == nullptr) {
+            return std::nullopt;
+        }
+        return fingerprint_(hs);
+    }
+
+    // Could file `f`, of the given size, have one of the `wanted`
+    // fingerprints? Candidate fingerprints are cached, since reading them
+    // takes seeks.
+    bool MayMatch(FileList::FileId f, std::uintmax_t size,
+                  const absl::flat_hash_set<Fingerprint>& wanted) {
+        {
+            absl::MutexLock ml(&candidate_fingerprints_mutex_);
+            auto it = candidate_fingerprints_.find(f);
+            if (it != candidate_fingerprints_.end()) {
+                return wanted.contains(it->second);
+            }
+        }
+        std::optional<Fingerprint> fp;
+        try {
+            fp = ComputeFingerprint(file_list_.Path(f), size,
+                                    *create_hasher_());
+        } catch (const Error&) {
+            return true;  // let the full hash report the problem
+        }
+        absl::MutexLock ml(&candidate_fingerprints_mutex_);
+        candidate_fingerprints_.insert({f, *fp});
+        return wanted.contains(*fp);
+    }
+
+    // If we know the fingerprint of `hs`, take the candidate files of its
+    // size whose fingerprints differ out of `files_by_size_`, and return
+    // them.
+    std::vector<FileList::FileId> SetAsideMismatches(
+        const HashAndSize<HashBits>& hs) {
+        std::vector<FileList::FileId> set_aside;
+        auto size_it = files_by_size_.find(hs.GetSize());
+        const std::optional<Fingerprint> fp = LookupFingerprint(hs);
+        if (size_it == files_by_size_.end() || !fp.has_value()) {
+            return set_aside;
+        }
+        const absl::flat_hash_set<Fingerprint> wanted = {*fp};
+        std::vector<FileList::FileId> keep;
+        for (FileList::FileId f : size_it->second) {
+            (MayMatch(f, hs.GetSize(), wanted) ? keep : set_aside).push_back(f);
+        }
+        if (keep.empty()) {
+            files_by_size_.erase(size_it);
+        } else {
+            size_it->second = std::move(keep);
+        }
+        return set_aside;
+    }
+
+    // Hash the candidate files of the requested size until we find one with
+    // the requested hash. This is the part of FindFile that does the work.
+    std::optional<FindFileResult> HashCandidates(
+        Log& log, const HashAndSize<HashBits>& hs,
+        ContentStore* const content_store) {
         auto size_it = files_by_size_.find(hs.GetSize());
         if (size_it == files_by_size_.end()) {
             return std::nullopt;
@@ -120,9 +550,13 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
         auto file_counter = progress.AddCounter("files");
         auto byte_counter =
             progress.AddCounter("bytes", hs.GetSize() * size_it->second.size());
+        if (size_it->second.size() > 1) {
+            return FindFileConcurrently(log, hs, file_counter, byte_counter);
+        }
         while (!size_it->second.empty()) {
-            std::filesystem::path p = std::move(size_it->second.back());
+            const FileList::FileId f = size_it->second.back();
             size_it->second.pop_back();
+            const std::filesystem::path p = file_list_.Path(f);
             try {
                 auto source = CreateFileSource(p);
                 SizeHasher hasher(create_hasher_());
@@ -134,8 +568,9 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
                     });
                     p_hs = hasher.Finish();
                 } else {
-                    inserted_path = content_store->StreamInsert(
-                        [&](StreamSink& content_sink) {
+                    inserted_path = content_store->StreamInsertHashed(
+                        [&](StreamSink& content_sink)
+                            -> std::optional<HashAndSize<256>> {
                             // Stream the file contents to both the hasher and
                             // the content store. We wait for the secondary
                             // transfer to finish iff the hash was the one we
@@ -159,19 +594,23 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
                                      },
                                  .secondary_progress =
                                      [](int /*num_bytes*/) {}});
-                            return p_hs == hs;  // keep the inserted content iff
-                                                // the hash matched
+                            // Keep the inserted content iff the hash
+                            // matched.
+                            if (p_hs != hs) {
+                                return std::nullopt;
+                            }
+                            return p_hs;
                         });
                 }
                 FRZ_ASSERT(p_hs.has_value());
-                auto [it, inserted] =
-                    files_by_hash_.insert({*p_hs, std::move(p)});
+                auto it = RememberHash(*p_hs, f);
                 if (p_hs == hs) {
                     if (size_it->second.empty()) {
                         files_by_size_.erase(size_it);
                     }
                     return FindFileResult{
-                        .path = inserted_path.value_or(it->second),
+                        .path = inserted_path.value_or(
+                            file_list_.Path(it->second)),
                         .already_inserted = inserted_path.has_value()};
                 }
             } catch (const Error& e) {
@@ -184,13 +623,89 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
         return std::nullopt;
     }
 
-    // Map from content hash+size to the path of a file with that hash+size.
-    absl::flat_hash_map<HashAndSize<HashBits>, std::filesystem::path>
+    // Like FindFile, but for when there are several candidate files of the
+    // requested size: hash them concurrently, and cancel the remaining work
+    // as soon as one of them matches. The hashes of the other candidates we
+    // finished are kept in `files_by_hash_`, and the candidates we didn't get
+    // to stay in `files_by_size_`. Never inserts into the content store,
+    // since that would mean copying every candidate. Candidates are started
+    // in the order they're laid out on disk.
+    std::optional<FindFileResult> FindFileConcurrently(
+        Log& log, const HashAndSize<HashBits>& hs,
+        ProgressLogCounter& file_counter, ProgressLogCounter& byte_counter) {
+        std::vector<FileList::FileId> candidates =
+            std::move(files_by_size_.at(hs.GetSize()));
+        files_by_size_.erase(hs.GetSize());
+
+        // Hashing is done concurrently; everything else, including all
+        // changes to our maps (and logging), is done while holding this
+        // mutex.
+        absl::Mutex mutex;
+        std::atomic<bool> found = false;
+        std::optional<std::filesystem::path> match;
+        std::vector<FileList::FileId> unhashed;
+        std::vector<std::filesystem::path> paths;
+        for (FileList::FileId f : candidates) {
+            paths.push_back(file_list_.Path(f));
+        }
+        WorkerPool pool(kNumHashThreads);
+        for (std::size_t i : DiskReadOrder(paths)) {
+            const FileList::FileId f = candidates[i];
+            if (found) {
+                absl::MutexLock ml(&mutex);
+                unhashed.push_back(f);
+                continue;
+            }
+            pool.Do([&, f, p = paths[i]] {
+                std::optional<HashAndSize<256>> p_hs;
+                try {
+                    p_hs = HashFileUnlessCancelled(
+                        p, create_hasher_(), found, [&](int num_bytes) {
+                            absl::MutexLock ml(&mutex);
+                            byte_counter.Increment(num_bytes);
+                        });
+                } catch (const Error& e) {
+                    absl::MutexLock ml(&mutex);
+                    log.Important("When reading %s: %s", p, e.what());
+                    file_counter.Increment(1);
+                    return;
+                }
+                absl::MutexLock ml(&mutex);
+                if (!p_hs.has_value()) {
+                    unhashed.push_back(f);  // cancelled
+                    return;
+                }
+                file_counter.Increment(1);
+                auto it = RememberHash(*p_hs, f);
+                if (*p_hs == hs && !match.has_value()) {
+                    match = file_list_.Path(it->second);
+                    found = true;
+                }
+            });
+        }
+        pool.Wait();
+        if (!unhashed.empty()) {
+            files_by_size_.insert({hs.GetSize(), std::move(unhashed)});
+        }
+        if (!match.has_value()) {
+            return std::nullopt;
+        }
+        return FindFileResult{.path = *std::move(match),
+                              .already_inserted = false};
+    }
+
+    // Every regular file in the directory tree. The maps below refer to
+    // files by their ids in this list, which is much more compact than
+    // keeping a path for each of them.
+    FileList file_list_;
+
+    // Map from content hash+size to a file with that hash+size.
+    absl::flat_hash_map<HashAndSize<HashBits>, FileList::FileId>
         files_by_hash_;
 
-    // Map from file size to vector of paths of files of that size. Only files
-    // not listed in `files_by_hash_` are listed here. Vectors are never empty.
-    absl::flat_hash_map<std::uintmax_t, std::vector<std::filesystem::path>>
+    // Map from file size to vector of files of that size. Only files not
+    // listed in `files_by_hash_` are listed here. Vectors are never empty.
+    absl::flat_hash_map<std::uintmax_t, std::vector<FileList::FileId>>
         files_by_size_;
 
     // Have we traversed the directory tree and populated files_by_size_? (We
@@ -202,16 +717,204 @@ class DirectoryContentSource final : public ContentSource<HashBits> {
     const bool read_only_;
     Streamer& streamer_;
     const std::function<std::unique_ptr<Hasher<256>>()> create_hasher_;
+    const std::function<std::optional<Fingerprint>(
+        const HashAndSize<HashBits>&)>
+        fingerprint_;
+
+    // The fingerprints of the candidate files we've looked at. `FindMany`
+    // computes them concurrently.
+    absl::Mutex candidate_fingerprints_mutex_;
+    absl::flat_hash_map<FileList::FileId, Fingerprint> candidate_fingerprints_
+        ABSL_GUARDED_BY(candidate_fingerprints_mutex_);
+
+    // The listing and hashes we save for next time, if any.
+    std::optional<SourceCache> cache_;
+};
+
+// A content source based on the index of another frz repository. Since the
+// index maps hashes straight to content files, finding a file costs a single
+// lookup, regardless of the size of the repository.
+template <int HashBits>
+class IndexContentSource final : public ContentSource<HashBits> {
+  public:
+    IndexContentSource(std::unique_ptr<HashIndex<HashBits>> index,
+                       bool read_only, Streamer& streamer)
+        : index_(std::move(index)),
+          read_only_(read_only),
+          streamer_(streamer) {}
+
+    std::optional<std::filesystem::path> Fetch(
+        Log& log, const HashAndSize<HashBits>& hs,
+        ContentStore& content_store) override try {
+        const std::optional<std::filesystem::path> path = index_->Lookup(hs);
+        if (!path.has_value()) {
+            return std::nullopt;
+        }
+
+        // Don't trust the index blindly when it's cheap not to.
+        std::error_code error;
+        if (!std::filesystem::is_regular_file(
+                std::filesystem::status(*path, error)) ||
+            !std::cmp_equal(std::filesystem::file_size(*path, error),
+                            hs.GetSize())) {
+            log.Info("Index entry for %s points to %s, which is missing or "
+                     "has the wrong size",
+                     hs.ToBase32(), *path);
+            return std::nullopt;
+        }
+        return read_only_ ? content_store.CopyInsert(*path, streamer_)
+                          : content_store.LinkInsert(*path, streamer_);
+    } catch (const Error& e) {
+        log.Important("When fetching %s: %s", hs.ToBase32(), e.what());
+        return std::nullopt;
+    }
+
+  private:
+    const std::unique_ptr<HashIndex<HashBits>> index_;
+    const bool read_only_;
+    Streamer& streamer_;
+};
+
+// A content source based on a tar archive, which is read from start to end
+// (or until everything we want has been found) once per request, and never
+// rewound. Since we can't go back for a member once we know its hash, every
+// member of a wanted size is streamed into the content store while it's
+// being hashed, and thrown away again if its hash isn't wanted after all.
+template <int HashBits>
+class TarContentSource final : public ContentSource<HashBits> {
+  public:
+    TarContentSource(
+        const std::filesystem::path& archive, Streamer& streamer,
+        std::function<std::unique_ptr<Hasher<256>>()> create_hasher)
+        : archive_(archive),
+          streamer_(streamer),
+          create_hasher_(std::move(create_hasher)) {}
+
+    std::optional<std::filesystem::path> Fetch(
+        Log& log, const HashAndSize<HashBits>& hs,
+        ContentStore& content_store) override {
+        std::optional<std::filesystem::path> result;
+        FetchMany(
+            log, std::span(&hs, 1), content_store,
+            [&](const HashAndSize<HashBits>&,
+                const std::filesystem::path& path) { result = path; },
+            nullptr);
+        return result;
+    }
+
+    void FetchMany(Log& log, std::span<const HashAndSize<HashBits>> wanted,
+                   ContentStore& content_store,
+                   std::function<void(const HashAndSize<HashBits>& hs,
+                                      const std::filesystem::path& path)>
+                       fetched,
+                   std::function<bool(const HashAndSize<HashBits>& hs)>
+                       still_wanted) override try {
+        absl::flat_hash_set<HashAndSize<HashBits>> unfetched(wanted.begin(),
+                                                             wanted.end());
+        absl::flat_hash_map<std::int64_t, int> num_wanted_by_size;
+        for (const HashAndSize<HashBits>& hs : unfetched) {
+            ++num_wanted_by_size[hs.GetSize()];
+        }
+        auto progress = log.Progress("Reading %s", archive_);
+        auto member_counter = progress.AddCounter("members");
+        auto byte_counter = progress.AddCounter("bytes hashed");
+        auto source = CreateFileSource(archive_);
+        TarReader reader(*source);
+        while (!unfetched.empty()) {
+            const std::optional<TarReader::Member> member = reader.Next();
+            if (!member.has_value()) {
+                break;
+            }
+            member_counter.Increment(1);
+            auto size_it = num_wanted_by_size.find(member->size);
+            if (!member->is_regular_file ||
+                size_it == num_wanted_by_size.end()) {
+                continue;  // `Next` skips the data
+            }
+            std::optional<HashAndSize<256>> hs;
+            const std::optional<std::filesystem::path> path =
+                content_store.StreamInsertHashed(
+                    [&](StreamSink& content_sink)
+                        -> std::optional<HashAndSize<256>> {
+                        SizeHasher hasher(create_hasher_());
+                        TeeSink sink(hasher, content_sink);
+                        streamer_.Stream(reader.Data(), sink,
+                                         [&](int num_bytes) {
+                                             byte_counter.Increment(num_bytes);
+                                         });
+                        hs = hasher.Finish();
+                        if (!unfetched.contains(*hs) ||
+                            (still_wanted != nullptr && !still_wanted(*hs))) {
+                            return std::nullopt;
+                        }
+                        return hs;
+                    });
+            if (path.has_value()) {
+                unfetched.erase(*hs);
+                if (--size_it->second == 0) {
+                    num_wanted_by_size.erase(size_it);
+                }
+                fetched(*hs, *path);
+            }
+        }
+    } catch (const Error& e) {
+        log.Important("When reading %s: %s", archive_, e.what());
+    }
+
+  private:
+    const std::filesystem::path archive_;
+    Streamer& streamer_;
+    const std::function<std::unique_ptr<Hasher<256>>()> create_hasher_;
 };
 
 }  // namespace
 
+template <int HashBits>
+void ContentSource<HashBits>::FetchMany(
+    Log& log, std::span<const HashAndSize<HashBits>> wanted,
+    ContentStore& content_store,
+    std::function<void(const HashAndSize<HashBits>& hs,
+                       const std::filesystem::path& path)>
+        fetched,
+    std::function<bool(const HashAndSize<HashBits>& hs)> still_wanted) {
+    for (const HashAndSize<HashBits>& hs : wanted) {
+        if (still_wanted != nullptr && !still_wanted(hs)) {
+            continue;
+        }
+        if (std::optional<std::filesystem::path> path =
+                Fetch(log, hs, content_store)) {
+            fetched(hs, *path);
+        }
+    }
+}
+
 template <int HashBits>
 std::unique_ptr<ContentSource<HashBits>> ContentSource<HashBits>::Create(
     const std::filesystem::path& dir, bool read_only, Streamer& streamer,
-    std::function<std::unique_ptr<Hasher<HashBits>>()> create_hasher) {
+    std::function<std::unique_ptr<Hasher<HashBits>>()> create_hasher,
+    std::function<std::optional<Fingerprint>(const HashAndSize<HashBits>&)>
+        fingerprint,
+    std::optional<std::filesystem::path> cache_file) {
     return std::make_unique<DirectoryContentSource<HashBits>>(
-        dir, read_only, streamer, std::move(create_hasher));
+        dir, read_only, streamer, std::move(create_hasher),
+        std::move(fingerprint), cache_file);
+}
+
+template <int HashBits>
+std::unique_ptr<ContentSource<HashBits>>
+ContentSource<HashBits>::CreateFromIndex(
+    std::unique_ptr<HashIndex<HashBits>> index, bool read_only,
+    Streamer& streamer) {
+    return std::make_unique<IndexContentSource<HashBits>>(std::move(index),
+                                                          read_only, streamer);
+}
+
+template <int HashBits>
+std::unique_ptr<ContentSource<HashBits>> ContentSource<HashBits>::CreateFromTar(
+    const std::filesystem::path& archive, Streamer& streamer,
+    std::function<std::unique_ptr<Hasher<HashBits>>()> create_hasher) {
+    return std::make_unique<TarContentSource<HashBits>>(
+        archive, streamer, std::move(create_hasher));
 }
 
 template class ContentSource<256>;
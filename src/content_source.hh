@@ -21,9 +21,12 @@
 #include <functional>
 #include <memory>
 #include <optional>
+#include <span>
 
 #include "content_store.hh"
+#include "fingerprint.hh"
 #include "hash.hh"
+#include "hash_index.hh"
 #include "hasher.hh"
 #include "log.hh"
 #include "stream.hh"
@@ -33,9 +36,35 @@ namespace frz {
 template <int HashBits>
 class ContentSource {
   public:
-    // Use the given directory as a content source.
+    // Use the given directory as a content source. If `fingerprint` is
+    // given, it's used to look up the fingerprints of the files we're asked
+    // for, so that large files whose fingerprints don't match needn't be
+    // hashed in full. If `cache_file` is given and the source is read-only,
+    // the file listing and the hashes we compute are saved there by
+    // `FetchMany`, and reused by the next content source for the same
+    // directory.
     static std::unique_ptr<ContentSource<HashBits>> Create(
         const std::filesystem::path& dir, bool read_only, Streamer& streamer,
+        std::function<std::unique_ptr<Hasher<HashBits>>()> create_hasher,
+        std::function<std::optional<Fingerprint>(const HashAndSize<HashBits>&)>
+            fingerprint = nullptr,
+        std::optional<std::filesystem::path> cache_file = std::nullopt);
+
+    // Use another frz repository as a content source, by looking up the
+    // files we're asked for in its index. Nothing is listed or hashed; the
+    // index is trusted to be correct. The files are copied into the content
+    // store if `read_only` is true, and hard linked (or copied, if that isn't
+    // possible) if it's false; the other repository keeps them either way.
+    static std::unique_ptr<ContentSource<HashBits>> CreateFromIndex(
+        std::unique_ptr<HashIndex<HashBits>> index, bool read_only,
+        Streamer& streamer);
+
+    // Use a tar archive as a content source. Each request makes a single
+    // sequential pass over the archive, without ever seeking, and hashes
+    // each member at most once; this suits archives on media where seeking
+    // is slow. The archive is never modified.
+    static std::unique_ptr<ContentSource<HashBits>> CreateFromTar(
+        const std::filesystem::path& archive, Streamer& streamer,
         std::function<std::unique_ptr<Hasher<HashBits>>()> create_hasher);
 
     virtual ~ContentSource() = default;
@@ -46,6 +75,31 @@ class ContentSource {
     virtual std::optional<std::filesystem::path> Fetch(
         Log& log, const HashAndSize<HashBits>& hs,
         ContentStore& content_store) = 0;
+
+    // Fetch as many as possible of the files in `wanted` from the content
+    // source, and put them in the given content store, calling `fetched` with
+    // the path of each inserted file. If `still_wanted` isn't null, it's
+    // called just before each file is inserted, and the file is skipped if it
+    // returns false; this lets other sources that are being read at the same
+    // time claim files first. Sources that can plan a single pass over their
+    // files for the whole request should override this; the default
+    // implementation just calls Fetch once per file.
+    virtual void FetchMany(
+        Log& log, std::span<const HashAndSize<HashBits>> wanted,
+        ContentStore& content_store,
+        std::function<void(const HashAndSize<HashBits>& hs,
+                           const std::filesystem::path& path)>
+            fetched,
+        std::function<bool(const HashAndSize<HashBits>& hs)> still_wanted);
+
+    // Fetch as many as possible of the files in `wanted`, as above.
+    void FetchMany(Log& log, std::span<const HashAndSize<HashBits>> wanted,
+                   ContentStore& content_store,
+                   std::function<void(const HashAndSize<HashBits>& hs,
+                                      const std::filesystem::path& path)>
+                       fetched) {
+        FetchMany(log, wanted, content_store, std::move(fetched), nullptr);
+    }
 };
 
 // Instantiated for `HashBits` == 256. Add more instantiations here if they are
@@ -0,0 +1,405 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "content_source.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "blake3_256_hasher.hh"
+#include "content_store.hh"
+#include "file_stream.hh"
+#include "filesystem_testing.hh"
+#include "fingerprint.hh"
+#include "hash.hh"
+#include "hash_index.hh"
+#include "hasher.hh"
+#include "log.hh"
+#include "stream.hh"
+
+namespace frz {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Optional;
+using ::testing::StrEq;
+
+// Return a string of 100 characters that's unique to `n`.
+std::string Content(int n) {
+    std::string s = std::to_string(n);
+    s.resize(100, '.');
+    return s;
+}
+
+// Return a tar archive (in the ustar format) of regular files with the given
+// contents.
+std::string TarArchive(const std::vector<std::string>& contents) {
+    std::string tar;
+    for (std::size_t i = 0; i < contents.size(); ++i) {
+        std::string header(512, '\0');
+        std::snprintf(&header[0], 100, "file%zu", i);
+        std::snprintf(&header[100], 8, "%07o", 0644);
+        std::snprintf(&header[124], 12, "%011zo", contents[i].size());
+        header[156] = '0';
+        std::fill_n(&header[148], 8, ' ');
+        unsigned checksum = 0;
+        for (char c : header) {
+            checksum += static_cast<unsigned char>(c);
+        }
+        std::snprintf(&header[148], 8, "%06o", checksum);
+        tar += header + contents[i];
+        tar.append((512 - contents[i].size() % 512) % 512, '\0');
+    }
+    tar.append(1024, '\0');
+    return tar;
+}
+
+HashAndSize<256> HashOf(const std::filesystem::path& file,
+                        Streamer& streamer) {
+    auto source = CreateFileSource(file);
+    SizeHasher hasher(CreateBlake3_256Hasher());
+    streamer.Stream(*source, hasher);
+    return hasher.Finish();
+}
+
+TEST(TestContentSource, ManyCandidatesOfTheSameSize) {
+    for (bool read_only : {false, true}) {
+        TempDir d;
+        for (int i = 0; i < 200; ++i) {
+            d.File("src/" + std::to_string(i), Content(i));
+        }
+        d.File("other", Content(17));
+        d.File("missing", Content(1000));
+        const std::unique_ptr<Streamer> streamer =
+            CreateSingleThreadedStreamer({.buffer_size = 16});
+        const HashAndSize<256> hs17 = HashOf(d.Path() / "other", *streamer);
+        const HashAndSize<256> hs1000 =
+            HashOf(d.Path() / "missing", *streamer);
+        std::unique_ptr<ContentStore> store =
+            ContentStore::Create(d.Path() / "store");
+        std::unique_ptr<ContentSource<256>> source =
+            ContentSource<256>::Create(d.Path() / "src", read_only, *streamer,
+                                       CreateBlake3_256Hasher);
+        Log log;
+
+        const std::optional<std::filesystem::path> p17 =
+            source->Fetch(log, hs17, *store);
+        ASSERT_TRUE(p17.has_value());
+        EXPECT_THAT(*p17, ReadContents(StrEq(Content(17))));
+        EXPECT_EQ(read_only, std::filesystem::exists(d.Path() / "src/17"));
+
+        // Fetching every other file works too, whether or not its hash was
+        // computed during the first search.
+        for (int i = 0; i < 200; i += 7) {
+            if (i == 17) {
+                continue;
+            }
+            const HashAndSize<256> hs =
+                HashOf(d.Path() / "src" / std::to_string(i), *streamer);
+            EXPECT_THAT(source->Fetch(log, hs, *store),
+                        Optional(ReadContents(StrEq(Content(i)))))
+                << i;
+        }
+        EXPECT_THAT(source->Fetch(log, hs1000, *store), Eq(std::nullopt));
+    }
+}
+
+TEST(TestContentSource, FetchMany) {
+    TempDir d;
+    for (int i = 0; i < 20; ++i) {
+        d.File("src/" + std::to_string(i % 4) + "/" + std::to_string(i),
+               std::string(i % 3 + 1, 'x') + std::to_string(i));
+    }
+    d.File("missing", "yy1");
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    std::vector<HashAndSize<256>> wanted = {
+        HashOf(d.Path() / "missing", *streamer)};
+    for (int i : {2, 5, 13, 19}) {
+        wanted.push_back(HashOf(
+            d.Path() / "src" / std::to_string(i % 4) / std::to_string(i),
+            *streamer));
+    }
+    const HashAndSize<256> hs7 = HashOf(d.Path() / "src/3/7", *streamer);
+    std::unique_ptr<ContentStore> store =
+        ContentStore::Create(d.Path() / "store");
+    std::unique_ptr<ContentSource<256>> source = ContentSource<256>::Create(
+        d.Path() / "src", /*read_only=*/true, *streamer,
+        CreateBlake3_256Hasher);
+    Log log;
+    std::vector<HashAndSize<256>> fetched;
+    auto on_fetched = [&](const HashAndSize<256>& hs,
+                          const std::filesystem::path& path) {
+        EXPECT_EQ(HashOf(path, *streamer), hs);
+        fetched.push_back(hs);
+    };
+    source->FetchMany(log, wanted, *store, on_fetched);
+    EXPECT_THAT(fetched, testing::UnorderedElementsAreArray(
+                             std::span(wanted).subspan(1)));
+
+    // Asking again for something we may or may not have hashed already.
+    fetched.clear();
+    source->FetchMany(log, std::span(&hs7, 1), *store, on_fetched);
+    EXPECT_THAT(fetched, testing::ElementsAre(hs7));
+}
+
+TEST(TestContentSource, FetchManyManyCandidatesOfTheSameSize) {
+    for (bool read_only : {false, true}) {
+        TempDir d;
+        for (int i = 0; i < 200; ++i) {
+            d.File("src/" + std::to_string(i), Content(i));
+        }
+        const std::unique_ptr<Streamer> streamer =
+            CreateSingleThreadedStreamer({.buffer_size = 16});
+        std::vector<HashAndSize<256>> wanted;
+        for (int i : {3, 77, 150}) {
+            wanted.push_back(
+                HashOf(d.Path() / "src" / std::to_string(i), *streamer));
+        }
+        std::vector<HashAndSize<256>> later;
+        for (int i = 0; i < 200; i += 9) {
+            later.push_back(
+                HashOf(d.Path() / "src" / std::to_string(i), *streamer));
+        }
+        std::unique_ptr<ContentStore> store =
+            ContentStore::Create(d.Path() / "store");
+        std::unique_ptr<ContentSource<256>> source =
+            ContentSource<256>::Create(d.Path() / "src", read_only, *streamer,
+                                       CreateBlake3_256Hasher);
+        Log log;
+        std::vector<HashAndSize<256>> fetched;
+        auto on_fetched = [&](const HashAndSize<256>& hs,
+                              const std::filesystem::path& path) {
+            EXPECT_EQ(HashOf(path, *streamer), hs);
+            fetched.push_back(hs);
+        };
+        source->FetchMany(log, wanted, *store, on_fetched);
+        EXPECT_THAT(fetched, testing::UnorderedElementsAreArray(wanted));
+
+        // The candidates that weren't hashed (or were hashed but not
+        // wanted) can still be fetched.
+        fetched.clear();
+        source->FetchMany(log, later, *store, on_fetched);
+        EXPECT_THAT(fetched, testing::UnorderedElementsAreArray(later));
+    }
+}
+
+TEST(TestContentSource, FetchManyStillWanted) {
+    for (bool read_only : {false, true}) {
+        TempDir d;
+        for (int i = 0; i < 6; ++i) {
+            d.File("src/" + std::to_string(i), std::string(i + 1, 'x'));
+        }
+        const std::unique_ptr<Streamer> streamer =
+            CreateSingleThreadedStreamer({.buffer_size = 16});
+        std::vector<HashAndSize<256>> wanted;
+        for (int i = 0; i < 6; ++i) {
+            wanted.push_back(HashOf(d.Path() / "src" / std::to_string(i),
+                                    *streamer));
+        }
+        std::unique_ptr<ContentStore> store =
+            ContentStore::Create(d.Path() / "store");
+        std::unique_ptr<ContentSource<256>> source =
+            ContentSource<256>::Create(d.Path() / "src", read_only, *streamer,
+                                       CreateBlake3_256Hasher);
+        Log log;
+        std::vector<HashAndSize<256>> fetched;
+        source->FetchMany(
+            log, wanted, *store,
+            [&](const HashAndSize<256>& hs, const std::filesystem::path& p) {
+                EXPECT_EQ(HashOf(p, *streamer), hs);
+                fetched.push_back(hs);
+            },
+            // Someone else got the odd-sized ones first.
+            [&](const HashAndSize<256>& hs) { return hs.GetSize() % 2 == 0; });
+        EXPECT_THAT(fetched, testing::UnorderedElementsAre(
+                                 wanted[1], wanted[3], wanted[5]));
+
+        // Files that weren't wanted after all are left where they were, and
+        // the store has no copies of them.
+        for (int i = 0; i < 6; ++i) {
+            EXPECT_EQ(
+                std::filesystem::exists(d.Path() / "src" / std::to_string(i)),
+                read_only || i % 2 == 0);
+        }
+        EXPECT_EQ(RecursiveListDirectory(d.Path() / "store").size(), 3u);
+    }
+}
+
+TEST(TestContentSource, FingerprintsRuleOutCandidates) {
+    TempDir d;
+    for (int i = 0; i < 3; ++i) {
+        d.File("src/" + std::to_string(i),
+               std::string(kMinFingerprintedSize, 'a' + i));
+    }
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 4096});
+    const HashAndSize<256> hs1 = HashOf(d.Path() / "src/1", *streamer);
+    const Fingerprint fp1 = ComputeFingerprint(
+        d.Path() / "src/1", hs1.GetSize(), *CreateBlake3_256Hasher());
+    std::unique_ptr<ContentStore> store =
+        ContentStore::Create(d.Path() / "store");
+    Log log;
+
+    // With the right fingerprint, the file is found.
+    EXPECT_THAT(ContentSource<256>::Create(
+                    d.Path() / "src", /*read_only=*/true, *streamer,
+                    CreateBlake3_256Hasher,
+                    [&](const HashAndSize<256>&) { return fp1; })
+                    ->Fetch(log, hs1, *store),
+                Optional(ReadContents(StrEq(std::string(
+                    kMinFingerprintedSize, 'b')))));
+
+    // A wrong fingerprint matches no candidate, so we fall back to hashing
+    // them all, and the file is still found, both one at a time and in a
+    // batch.
+    auto wrong = [&](const HashAndSize<256>&) { return hs1.GetHash(); };
+    EXPECT_THAT(ContentSource<256>::Create(d.Path() / "src", true, *streamer,
+                                           CreateBlake3_256Hasher, wrong)
+                    ->Fetch(log, hs1, *store),
+                Optional(ReadContents(StrEq(std::string(
+                    kMinFingerprintedSize, 'b')))));
+    int num_fetched = 0;
+    ContentSource<256>::Create(d.Path() / "src", true, *streamer,
+                               CreateBlake3_256Hasher, wrong)
+        ->FetchMany(log, std::span(&hs1, 1), *store,
+                    [&](const HashAndSize<256>&,
+                        const std::filesystem::path&) { ++num_fetched; });
+    EXPECT_EQ(num_fetched, 1);
+}
+
+TEST(TestContentSource, FromIndex) {
+    for (bool read_only : {false, true}) {
+        TempDir d;
+        d.File("content/a", "abc");
+        d.File("content/b", "defg");
+        const std::unique_ptr<Streamer> streamer =
+            CreateSingleThreadedStreamer({.buffer_size = 16});
+        const HashAndSize<256> hs_a = HashOf(d.Path() / "content/a", *streamer);
+        const HashAndSize<256> hs_b = HashOf(d.Path() / "content/b", *streamer);
+        std::unique_ptr<HashIndex<256>> index = CreateRamHashIndex();
+        index->Insert(hs_a, d.Path() / "content/a");
+        // An index entry that points to a file of the wrong size.
+        index->Insert(hs_b, d.Path() / "content/a");
+        std::unique_ptr<ContentStore> store =
+            ContentStore::Create(d.Path() / "store");
+        std::unique_ptr<ContentSource<256>> source =
+            ContentSource<256>::CreateFromIndex(std::move(index), read_only,
+                                                *streamer);
+        Log log;
+        EXPECT_THAT(source->Fetch(log, hs_a, *store),
+                    Optional(ReadContents(StrEq("abc"))));
+        EXPECT_THAT(source->Fetch(log, hs_b, *store), Eq(std::nullopt));
+        EXPECT_THAT(d.Path() / "content/a", ReadContents(StrEq("abc")));
+    }
+}
+
+TEST(TestContentSource, FromTar) {
+    TempDir d;
+    d.File("archive.tar",
+           TarArchive({"abc", "def", std::string(1000, 'x'), "ghi"}));
+    d.File("wanted/1", "def");
+    d.File("wanted/2", "ghi");
+    d.File("wanted/3", std::string(1000, 'x'));
+    d.File("wanted/4", "jkl");
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    std::vector<HashAndSize<256>> wanted;
+    for (int i = 1; i <= 4; ++i) {
+        wanted.push_back(
+            HashOf(d.Path() / "wanted" / std::to_string(i), *streamer));
+    }
+    std::unique_ptr<ContentStore> store =
+        ContentStore::Create(d.Path() / "store");
+    std::unique_ptr<ContentSource<256>> source =
+        ContentSource<256>::CreateFromTar(d.Path() / "archive.tar", *streamer,
+                                          CreateBlake3_256Hasher);
+    Log log;
+    std::vector<HashAndSize<256>> fetched;
+    source->FetchMany(log, wanted, *store,
+                      [&](const HashAndSize<256>& hs,
+                          const std::filesystem::path& path) {
+                          EXPECT_EQ(HashOf(path, *streamer), hs);
+                          fetched.push_back(hs);
+                      });
+    EXPECT_THAT(fetched, testing::ElementsAre(wanted[0], wanted[2], wanted[1]));
+
+    // Members that were hashed but not wanted were thrown away.
+    EXPECT_EQ(RecursiveListDirectory(d.Path() / "store").size(), 3);
+
+    // The archive can be read again.
+    EXPECT_THAT(source->Fetch(log, wanted[0], *store),
+                Optional(ReadContents(StrEq("def"))));
+}
+
+TEST(TestContentSource, CachedHashes) {
+    TempDir d;
+    for (int i = 0; i < 10; ++i) {
+        d.File("src/" + std::to_string(i), Content(i));
+        std::filesystem::last_write_time(
+            d.Path() / "src" / std::to_string(i),
+            std::filesystem::file_time_type::clock::now() -
+                std::chrono::hours(1));
+    }
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    const HashAndSize<256> hs3 = HashOf(d.Path() / "src/3", *streamer);
+    std::unique_ptr<ContentStore> store =
+        ContentStore::Create(d.Path() / "store");
+    Log log;
+    int num_hashed = 0;
+    auto counting_hasher = [&] {
+        ++num_hashed;
+        return CreateBlake3_256Hasher();
+    };
+    auto fetch = [&] {
+        std::vector<HashAndSize<256>> fetched;
+        ContentSource<256>::Create(d.Path() / "src", /*read_only=*/true,
+                                   *streamer, counting_hasher,
+                                   /*fingerprint=*/nullptr,
+                                   d.Path() / "cache")
+            ->FetchMany(log, std::span(&hs3, 1), *store,
+                        [&](const HashAndSize<256>& hs,
+                            const std::filesystem::path&) {
+                            fetched.push_back(hs);
+                        });
+        return fetched;
+    };
+
+    // The first time, we have to hash the candidates (in the order we listed
+    // them) until we find the right one.
+    EXPECT_THAT(fetch(), testing::ElementsAre(hs3));
+    EXPECT_GE(num_hashed, 1);
+    EXPECT_LE(num_hashed, 10);
+
+    // The second time, the cache tells us which file to pick.
+    num_hashed = 0;
+    EXPECT_THAT(fetch(), testing::ElementsAre(hs3));
+    EXPECT_EQ(num_hashed, 0);
+}
+
+}  // namespace
+}  // namespace frz
@@ -17,46 +17,208 @@
 #include "content_store.hh"
 
 #include <absl/random/random.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
 #include <filesystem>
 #include <memory>
+#include <optional>
 #include <string_view>
+#include <string>
 #include <system_error>
+#include <unistd.h>
+#include <vector>
 
 #include "assert.hh"
 #include "base32.hh"
+#include "dir_snapshot.hh"
 #include "exceptions.hh"
 #include "file_stream.hh"
 #include "filesystem_util.hh"
+#include "read_order.hh"
+#include "worker.hh"
 
 namespace frz {
 namespace {
 
+constexpr std::filesystem::perms kReadonlyPermissions =
+    std::filesystem::perms::owner_read | std::filesystem::perms::group_read |
+    std::filesystem::perms::others_read;
+
 class DiskContentStore final : public ContentStore {
   public:
-    DiskContentStore(const std::filesystem::path& content_dir)
-        : content_dir_(content_dir) {}
+    DiskContentStore(const std::filesystem::path& content_dir,
+                     std::optional<SymlinkLayout> hashed_layout)
+        : content_dir_(content_dir),
+          hashed_layout_(hashed_layout),
+          insert_dir_(hashed_layout.has_value() ? "incoming" : ""),
+          dirs_(content_dir),
+          tmpfile_supported_(HaveProcFds()) {}
 
     std::optional<std::filesystem::path> StreamInsert(
-        std::function<bool(StreamSink& sink)> stream_fun) override try {
+        std::function<bool(StreamSink& sink)> stream_fun) override {
+        return StreamInsertImpl(stream_fun, std::nullopt);
+    }
+
+    std::optional<std::filesystem::path> StreamInsertHashed(
+        std::function<std::optional<HashAndSize<256>>(StreamSink& sink)>
+            stream_fun) override {
+        std::optional<HashAndSize<256>> hs;
+        std::function<bool(StreamSink& sink)> keep = [&](StreamSink& sink) {
+            hs = stream_fun(sink);
+            return hs.has_value();
+        };
+        return StreamInsertImpl(keep, hs);
+    }
+
+    std::filesystem::path MoveInsert(const std::filesystem::path& source,
+                                     Streamer& streamer) override {
+        return LinkOrCopyInsert(source, streamer, /*keep_source=*/false);
+    }
+
+    std::filesystem::path LinkInsert(const std::filesystem::path& source,
+                                     Streamer& streamer) override {
+        return LinkOrCopyInsert(source, streamer, /*keep_source=*/true);
+    }
+
+    void ForEach(
+        std::function<void(const std::filesystem::directory_entry& dent,
+                           const std::filesystem::path& canonical_path)>
+            callback) const override {
+        if (!std::filesystem::exists(content_dir_)) {
+            return;
+        }
+        for (const std::filesystem::directory_entry& dent :
+             std::filesystem::recursive_directory_iterator(content_dir_)) {
+            if (!std::filesystem::is_regular_file(dent.symlink_status())) {
+                continue;
+            }
+            std::optional<std::filesystem::path> canonical_path =
+                CanonicalPath(dent.path());
+            FRZ_ASSERT(canonical_path.has_value());
+            callback(dent, *canonical_path);
+        }
+    }
+
+    void ForEachChanged(
+        std::function<void(const std::filesystem::directory_entry& dent,
+                           const std::filesystem::path& canonical_path)>
+            callback,
+        DirChangeTracker& tracker) const override {
+        if (!std::filesystem::exists(content_dir_)) {
+            return;
+        }
+        ForEachChangedInDir(callback, tracker, content_dir_);
+    }
+
+    std::optional<std::filesystem::path> CanonicalPath(
+        const std::filesystem::path& file) const override {
+        return RelativeSubtreePath(file, content_dir_);
+    }
+
+    std::optional<std::filesystem::path> HashedPath(
+        const HashAndSize<256>& hs) const override {
+        if (!hashed_layout_.has_value()) {
+            return std::nullopt;
+        }
+        return content_dir_ / SymlinkPath(hs.ToBase32(), *hashed_layout_);
+    }
+
+    std::filesystem::path MoveToHashedPath(
+        const std::filesystem::path& file,
+        const HashAndSize<256>& hs) override try {
+        const std::optional<std::filesystem::path> destination = HashedPath(hs);
+        if (!destination.has_value() ||
+            CanonicalPath(file) == CanonicalPath(*destination)) {
+            return file;
+        }
+        const std::optional<std::filesystem::path> canonical_file =
+            CanonicalPath(file);
+        FRZ_ASSERT(canonical_file.has_value());
+        const int dir_fd = dirs_.Get(
+            SymlinkPath(hs.ToBase32(), *hashed_layout_).parent_path());
+
+        if (!MoveNoReplace(file, dir_fd, destination->filename())) {
+            if (errno == EEXIST) {
+                // Probably a duplicate of `file`. Let the caller sort it out.
+                return file;
+            }
+            ThrowErrno("cannot move file", *destination);
+        }
+        RemoveEmptyParents(*canonical_file);
+        return *destination;
+    } catch (const std::filesystem::filesystem_error& e) {
+        throw Error(e.what());
+    }
+
+  private:
+    // Can we refer to open files through /proc/self/fd? Giving an anonymous
+    // file a name requires either that, or privileges that we probably lack.
+    static bool HaveProcFds() {
+        std::error_code ec;
+        return std::filesystem::is_directory("/proc/self/fd", ec);
+    }
+
+    // Create an anonymous, read-only file in the insert directory, and return
+    // its file descriptor. Return nullopt if the kernel or filesystem can't
+    // do that.
+    std::optional<int> OpenTmpFile() {
+#ifdef O_TMPFILE
+        if (!tmpfile_supported_) {
+            return std::nullopt;
+        }
+        const int fd = ::openat(dirs_.Get(insert_dir_), ".",
+                                O_TMPFILE | O_WRONLY | O_CLOEXEC,
+                                static_cast<mode_t>(kReadonlyPermissions));
+        if (fd != -1) {
+            return fd;
+        }
+        if (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL) {
+            // Not supported; don't ask again.
+            tmpfile_supported_ = false;
+            return std::nullopt;
+        }
+        ThrowErrno("cannot create temporary file", content_dir_ / insert_dir_);
+#else
+        return std::nullopt;
+#endif
+    }
+
+    // Stream a new file into the store, as described for `StreamInsert`. If
+    // the file is kept, and `hs` then has a value, it is the hash of the
+    // file, and we put the file at its hashed path if we can.
+    std::optional<std::filesystem::path> StreamInsertImpl(
+        std::function<bool(StreamSink& sink)>& stream_fun,
+        const std::optional<HashAndSize<256>>& hs) try {
+        if (const std::optional<int> fd = OpenTmpFile()) {
+            return StreamInsertTmpFile(*fd, stream_fun, hs);
+        }
         int depth = 0;
         while (true) {
-            const std::filesystem::path destination =
-                SuggestDestinationFilename(depth);
+            const Destination destination = SuggestDestination(depth);
             std::unique_ptr<StreamSink> sink;
             try {
-                sink = CreateFileSink(destination);
+                // The file is read-only from the start, so we don't have to
+                // change its permissions afterwards.
+                sink = CreateFileSinkAt(destination.dir_fd, destination.name,
+                                        kReadonlyPermissions);
             } catch (const FileExistsException&) {
                 // Collision; try another, longer, random path name.
                 continue;
             }
             const bool keep_file = stream_fun(*sink);
-            sink.reset();  // flush+close file before changing permissions or
-                           // removing
+            sink.reset();  // flush+close file before removing
             if (keep_file) {
-                RemoveWritePermissions(destination);
-                return destination;
+                return hs.has_value()
+                           ? MoveToHashedPath(destination.path, *hs)
+                           : destination.path;
             } else {
-                std::filesystem::remove(destination);
+                if (::unlinkat(destination.dir_fd, destination.name.c_str(),
+                               0) != 0) {
+                    ThrowErrno("cannot remove", destination.path);
+                }
                 return std::nullopt;
             }
         }
@@ -64,8 +226,69 @@ class DiskContentStore final : public ContentStore {
         throw Error(e.what());
     }
 
-    std::filesystem::path MoveInsert(const std::filesystem::path& source,
-                                     Streamer& streamer) override try {
+    // Stream into the anonymous file `fd`, and if `stream_fun` wants to keep
+    // it, link it into the store: at its hashed path if `hs` has a value by
+    // then, and otherwise under a new random name. A file we don't keep
+    // (even because we crash) simply vanishes when `fd` is closed, so there
+    // is nothing to clean up. Take ownership of `fd`.
+    std::optional<std::filesystem::path> StreamInsertTmpFile(
+        int fd, std::function<bool(StreamSink& sink)>& stream_fun,
+        const std::optional<HashAndSize<256>>& hs) {
+        std::optional<std::filesystem::path> result;
+        try {
+            const int sink_fd = ::dup(fd);
+            if (sink_fd == -1) {
+                ThrowErrno("cannot duplicate file descriptor",
+                           content_dir_ / insert_dir_);
+            }
+            std::unique_ptr<StreamSink> sink = CreateFileSinkForFd(sink_fd);
+            const bool keep_file = stream_fun(*sink);
+            sink.reset();  // flush+close before linking
+            if (keep_file) {
+                const std::string proc_path =
+                    "/proc/self/fd/" + std::to_string(fd);
+                if (hs.has_value() && hashed_layout_.has_value()) {
+                    const std::filesystem::path hashed =
+                        SymlinkPath(hs->ToBase32(), *hashed_layout_);
+                    if (::linkat(AT_FDCWD, proc_path.c_str(),
+                                 dirs_.Get(hashed.parent_path()),
+                                 hashed.filename().c_str(),
+                                 AT_SYMLINK_FOLLOW) == 0) {
+                        result = content_dir_ / hashed;
+                    } else if (errno != EEXIST) {
+                        ThrowErrno("cannot create hard link",
+                                   content_dir_ / hashed);
+                    }
+                    // If there's already a file at the hashed path, it's
+                    // probably a duplicate; let the caller sort it out.
+                }
+                int depth = 0;
+                while (!result.has_value()) {
+                    const Destination destination = SuggestDestination(depth);
+                    if (::linkat(AT_FDCWD, proc_path.c_str(),
+                                 destination.dir_fd, destination.name.c_str(),
+                                 AT_SYMLINK_FOLLOW) == 0) {
+                        result = destination.path;
+                    } else if (errno != EEXIST) {
+                        ThrowErrno("cannot create hard link",
+                                   destination.path);
+                    }
+                    // On collision, try another, longer, random path name.
+                }
+            }
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        return result;
+    }
+
+    // Insert a new hard link to `source` (or a copy, if that isn't possible),
+    // and unless `keep_source` is true, remove `source`.
+    std::filesystem::path LinkOrCopyInsert(const std::filesystem::path& source,
+                                           Streamer& streamer,
+                                           bool keep_source) try {
         if (std::filesystem::is_symlink(source)) {
             // We don't want to move either the symlink or its taget, because
             // neither is likely to be what the user expects; copy instead.
@@ -75,60 +298,111 @@ class DiskContentStore final : public ContentStore {
             std::filesystem::symlink_status(source)));
         int depth = 0;
         while (true) {
-            // Generate a destination filename, and attempt to move `source` to
-            // it. We can't use std::filesystem::rename(), because it
-            // overwrites the destination file if it already exists; instead,
-            // we create a new hardlink and unlink the old one.
-            const std::filesystem::path destination =
-                SuggestDestinationFilename(depth);
-            try {
-                std::filesystem::create_hard_link(source, destination);
-            } catch (const std::filesystem::filesystem_error& e) {
-                if (e.code() == std::errc::file_exists) {
+            // Generate a destination filename, and attempt to link or move
+            // `source` to it.
+            const Destination destination = SuggestDestination(depth);
+            if (keep_source
+                    ? ::linkat(AT_FDCWD, source.c_str(), destination.dir_fd,
+                               destination.name.c_str(), 0) != 0
+                    : !MoveNoReplace(source, destination.dir_fd,
+                                     destination.name)) {
+                if (errno == EEXIST) {
                     // Collision; try another, longer, random path name.
                     continue;
-                } else if (e.code() == std::errc::cross_device_link) {
+                } else if (errno == EXDEV) {
                     // Source and destination are on different filesystems; we
                     // need to copy instead of move.
-                    return CopyInsert(source, streamer);
+                    const std::filesystem::path copy =
+                        CopyInsert(source, streamer);
+                    if (!keep_source) {
+                        std::filesystem::remove(source);
+                    }
+                    return copy;
                 } else {
-                    // Unexpected error; re-throw.
-                    throw;
+                    ThrowErrno(keep_source ? "cannot create hard link"
+                                           : "cannot move file",
+                               destination.path);
                 }
             }
-            std::filesystem::remove(source);
-            RemoveWritePermissions(destination);
-            return destination;
+            RemoveWritePermissionsAt(destination.dir_fd, destination.name);
+            return destination.path;
         }
     } catch (const std::filesystem::filesystem_error& e) {
         throw Error(e.what());
     }
 
-    void ForEach(
+    // Move `source` to `name` in the directory `dir_fd`, unless something
+    // is already there. We can't use plain rename(), because it overwrites
+    // the destination; renameat2() can be told not to, but where it can't,
+    // we create a new hard link and unlink the old one instead. Return false
+    // (with `errno` set) on failure.
+    bool MoveNoReplace(const std::filesystem::path& source, int dir_fd,
+                       const std::filesystem::path& name) {
+#ifdef RENAME_NOREPLACE
+        if (rename_noreplace_supported_) {
+            if (::renameat2(AT_FDCWD, source.c_str(), dir_fd, name.c_str(),
+                            RENAME_NOREPLACE) == 0) {
+                return true;
+            }
+            if (errno != EINVAL && errno != ENOSYS) {
+                return false;
+            }
+            // Not supported by this kernel or filesystem; don't ask again.
+            rename_noreplace_supported_ = false;
+        }
+#endif
+        if (::linkat(AT_FDCWD, source.c_str(), dir_fd, name.c_str(), 0) !=
+            0) {
+            return false;
+        }
+        std::filesystem::remove(source);
+        return true;
+    }
+
+    // Remove the directory that `canonical_file` was in if it's now empty, and
+    // then its parent if that's now empty, and so on, up to but not including
+    // the root of the content store or the insert directory (which would
+    // just have to be created again for the next insert).
+    void RemoveEmptyParents(const std::filesystem::path& canonical_file) {
+        for (std::filesystem::path dir = canonical_file.parent_path();
+             !dir.empty() && dir != insert_dir_; dir = dir.parent_path()) {
+            if (::unlinkat(dirs_.Get(dir.parent_path()),
+                           dir.filename().c_str(), AT_REMOVEDIR) != 0) {
+                // Not empty (or already gone, or some other problem).
+                break;
+            }
+            dirs_.Forget(dir);
+        }
+    }
+
+    void ForEachChangedInDir(
         std::function<void(const std::filesystem::directory_entry& dent,
                            const std::filesystem::path& canonical_path)>
-            callback) const override {
-        if (!std::filesystem::exists(content_dir_)) {
+            callback,
+        DirChangeTracker& tracker, const std::filesystem::path& dir) const {
+        if (auto subdirs = tracker.Unchanged(dir)) {
+            for (const std::filesystem::path& subdir : *subdirs) {
+                ForEachChangedInDir(callback, tracker, subdir);
+            }
             return;
         }
+        DirChangeTracker::Listing listing;
         for (const std::filesystem::directory_entry& dent :
-             std::filesystem::recursive_directory_iterator(content_dir_)) {
-            if (!std::filesystem::is_regular_file(dent.symlink_status())) {
-                continue;
+             std::filesystem::directory_iterator(dir)) {
+            listing.Add(dent.path().filename().native());
+            const std::filesystem::file_status status = dent.symlink_status();
+            if (std::filesystem::is_directory(status)) {
+                ForEachChangedInDir(callback, tracker, dent.path());
+            } else if (std::filesystem::is_regular_file(status)) {
+                std::optional<std::filesystem::path> canonical_path =
+                    CanonicalPath(dent.path());
+                FRZ_ASSERT(canonical_path.has_value());
+                callback(dent, *canonical_path);
             }
-            std::optional<std::filesystem::path> canonical_path =
-                CanonicalPath(dent.path());
-            FRZ_ASSERT(canonical_path.has_value());
-            callback(dent, *canonical_path);
         }
+        tracker.Listed(dir, listing);
     }
 
-    std::optional<std::filesystem::path> CanonicalPath(
-        const std::filesystem::path& file) const override {
-        return RelativeSubtreePath(file, content_dir_);
-    }
-
-  private:
     template <int Low, int High>
     char RandomDigit() {
         static_assert(0 <= Low);
@@ -138,24 +412,33 @@ class DiskContentStore final : public ContentStore {
                                            High)];
     }
 
-    std::filesystem::path SuggestDestinationFilename(int& depth) {
+    // A place to put a new content file: the file `name` in the directory
+    // `dir_fd`, also known as `path`.
+    struct Destination {
+        int dir_fd;
+        std::string name;
+        std::filesystem::path path;
+    };
+    Destination SuggestDestination(int& depth) {
         // Generate a random destination directory name, and create it.
-        std::filesystem::path destination = content_dir_;
+        std::filesystem::path dir = insert_dir_;
         for (int i = 0; i < depth; ++i) {
             const char dirname[] = {RandomDigit<0, 15>(), RandomDigit<0, 31>()};
-            destination /= std::string_view(dirname, std::size(dirname));
+            dir /= std::string_view(dirname, std::size(dirname));
         }
-        std::filesystem::create_directories(destination);
+        const int dir_fd = dirs_.Get(dir);
 
         // Generate a random filename.
         const char filename[] = {RandomDigit<16, 31>(), RandomDigit<0, 31>()};
-        destination /= std::string_view(filename, std::size(filename));
+        const std::string name(filename, std::size(filename));
 
         // Increment `depth`, in case we are called again.
         if (depth < kMaxContentDepth) {
             ++depth;
         }
-        return destination;
+        return {.dir_fd = dir_fd,
+                .name = name,
+                .path = content_dir_ / dir / name};
     }
 
     // The maximum depth of the directory hierarchy we use when suggesting
@@ -163,11 +446,136 @@ class DiskContentStore final : public ContentStore {
     static constexpr int kMaxContentDepth = 4;
 
     const std::filesystem::path content_dir_;
+    const std::optional<SymlinkLayout> hashed_layout_;
+
+    // Where the insert functions put new files, relative to `content_dir_`.
+    // If we use hashed paths, new files stay here only until their hash is
+    // known, and we want to keep them out of the way of the hashed
+    // subdirectories.
+    const std::filesystem::path insert_dir_;
+
+    // Open directories in the content store, so that we don't have to look
+    // up (or create) the whole path for every file we insert.
+    DirFdCache dirs_;
+
+    // Should StreamInsert try to use anonymous files?
+    bool tmpfile_supported_;
+
+    // Should MoveNoReplace try renameat2()?
+    bool rename_noreplace_supported_ = true;
+
     absl::BitGen bitgen_;
 };
 
+// Two content stores, one for each tier, presented as one.
+class TieredContentStore final : public ContentStore {
+  public:
+    TieredContentStore(const std::filesystem::path& root,
+                       const std::filesystem::path& hot_dir,
+                       const std::filesystem::path& cold_dir,
+                       std::optional<SymlinkLayout> hashed_layout)
+        : root_(root),
+          hot_(ContentStore::Create(hot_dir, hashed_layout)),
+          cold_(ContentStore::Create(cold_dir)) {}
+
+    std::optional<std::filesystem::path> StreamInsert(
+        std::function<bool(StreamSink& sink)> stream_fun) override {
+        return hot_->StreamInsert(std::move(stream_fun));
+    }
+
+    std::optional<std::filesystem::path> StreamInsertHashed(
+        std::function<std::optional<HashAndSize<256>>(StreamSink& sink)>
+            stream_fun) override {
+        return hot_->StreamInsertHashed(std::move(stream_fun));
+    }
+
+    std::filesystem::path MoveInsert(const std::filesystem::path& source,
+                                     Streamer& streamer) override {
+        return hot_->MoveInsert(source, streamer);
+    }
+
+    std::filesystem::path LinkInsert(const std::filesystem::path& source,
+                                     Streamer& streamer) override {
+        return hot_->LinkInsert(source, streamer);
+    }
+
+    void ForEach(
+        std::function<void(const std::filesystem::directory_entry& dent,
+                           const std::filesystem::path& canonical_path)>
+            callback) const override {
+        for (const ContentStore* store : {hot_.get(), cold_.get()}) {
+            store->ForEach([&](const std::filesystem::directory_entry& dent,
+                               const std::filesystem::path&) {
+                callback(dent, *CanonicalPath(dent.path()));
+            });
+        }
+    }
+
+    void ForEachChanged(
+        std::function<void(const std::filesystem::directory_entry& dent,
+                           const std::filesystem::path& canonical_path)>
+            callback,
+        DirChangeTracker& tracker) const override {
+        for (const ContentStore* store : {hot_.get(), cold_.get()}) {
+            store->ForEachChanged(
+                [&](const std::filesystem::directory_entry& dent,
+                    const std::filesystem::path&) {
+                    callback(dent, *CanonicalPath(dent.path()));
+                },
+                tracker);
+        }
+    }
+
+    std::optional<std::filesystem::path> CanonicalPath(
+        const std::filesystem::path& file) const override {
+        if (!hot_->CanonicalPath(file).has_value() &&
+            !cold_->CanonicalPath(file).has_value()) {
+            return std::nullopt;
+        }
+        return RelativeSubtreePath(file, root_);
+    }
+
+    std::optional<std::filesystem::path> HashedPath(
+        const HashAndSize<256>& hs) const override {
+        return hot_->HashedPath(hs);
+    }
+
+    std::filesystem::path MoveToHashedPath(
+        const std::filesystem::path& file,
+        const HashAndSize<256>& hs) override {
+        return GetTier(file) == Tier::kHot ? hot_->MoveToHashedPath(file, hs)
+                                           : file;
+    }
+
+    Tier GetTier(const std::filesystem::path& file) const override {
+        return cold_->CanonicalPath(file).has_value() ? Tier::kCold
+                                                      : Tier::kHot;
+    }
+
+    std::filesystem::path LinkToTier(const std::filesystem::path& file,
+                                     Tier tier, Streamer& streamer) override {
+        if (GetTier(file) == tier) {
+            return file;
+        }
+        return (tier == Tier::kHot ? hot_ : cold_)->LinkInsert(file, streamer);
+    }
+
+  private:
+    const std::filesystem::path root_;
+    const std::unique_ptr<ContentStore> hot_;
+    const std::unique_ptr<ContentStore> cold_;
+};
+
 }  // namespace
 
+std::unique_ptr<ContentStore> ContentStore::CreateTiered(
+    const std::filesystem::path& root, const std::filesystem::path& hot_dir,
+    const std::filesystem::path& cold_dir,
+    std::optional<SymlinkLayout> hashed_layout) {
+    return std::make_unique<TieredContentStore>(root, hot_dir, cold_dir,
+                                                hashed_layout);
+}
+
 std::filesystem::path ContentStore::CopyInsert(
     const std::filesystem::path& source, Streamer& streamer) {
     std::optional<std::filesystem::path> path =
@@ -179,9 +587,44 @@ std::filesystem::path ContentStore::CopyInsert(
     return *path;
 }
 
+void ContentStore::ParallelForEach(
+    std::function<bool(const std::filesystem::directory_entry& dent,
+                       const std::filesystem::path& canonical_path)>
+        select,
+    std::function<void(const std::filesystem::directory_entry& dent,
+                       const std::filesystem::path& canonical_path)>
+        callback,
+    DirChangeTracker* tracker, int num_threads) const {
+    std::vector<std::filesystem::directory_entry> dents;
+    std::vector<std::filesystem::path> canonical_paths;
+    auto gather = [&](const std::filesystem::directory_entry& dent,
+                      const std::filesystem::path& canonical_path) {
+        if (select(dent, canonical_path)) {
+            dents.push_back(dent);
+            canonical_paths.push_back(canonical_path);
+        }
+    };
+    if (tracker == nullptr) {
+        ForEach(gather);
+    } else {
+        ForEachChanged(gather, *tracker);
+    }
+    std::vector<std::filesystem::path> paths;
+    paths.reserve(dents.size());
+    for (const std::filesystem::directory_entry& dent : dents) {
+        paths.push_back(dent.path());
+    }
+    WorkerPool pool(num_threads);
+    for (std::size_t i : DiskReadOrder(paths)) {
+        pool.Do([&, i] { callback(dents[i], canonical_paths[i]); });
+    }
+    pool.Wait();
+}
+
 std::unique_ptr<ContentStore> ContentStore::Create(
-    const std::filesystem::path& content_dir) {
-    return std::make_unique<DiskContentStore>(content_dir);
+    const std::filesystem::path& content_dir,
+    std::optional<SymlinkLayout> hashed_layout) {
+    return std::make_unique<DiskContentStore>(content_dir, hashed_layout);
 }
 
 }  // namespace frz
@@ -22,6 +22,9 @@
 #include <memory>
 #include <optional>
 
+#include "base32.hh"
+#include "dir_snapshot.hh"
+#include "hash.hh"
 #include "stream.hh"
 
 namespace frz {
@@ -29,9 +32,24 @@ namespace frz {
 class ContentStore {
   public:
     // Use the given directory as a content store. The directory need not
-    // exist; it will be created if necessary.
+    // exist; it will be created if necessary. If `hashed_layout` is nullopt,
+    // content files get random names; otherwise, they are put at paths derived
+    // from their hashes, with the given fan-out (see `HashedPath`). Either
+    // way, files with any other names are still accepted as content files.
     static std::unique_ptr<ContentStore> Create(
-        const std::filesystem::path& content_dir);
+        const std::filesystem::path& content_dir,
+        std::optional<SymlinkLayout> hashed_layout = std::nullopt);
+
+    // Create a content store with two tiers: new files go to the hot tier in
+    // `hot_dir` (which might be on an SSD), and `LinkToTier` moves them to
+    // and from the cold tier in `cold_dir` (which might be on a large, slow
+    // disk). The hot tier uses `hashed_layout` as in `Create`; the cold tier
+    // always uses random names. Canonical paths are relative to `root`,
+    // which must contain both directories.
+    static std::unique_ptr<ContentStore> CreateTiered(
+        const std::filesystem::path& root, const std::filesystem::path& hot_dir,
+        const std::filesystem::path& cold_dir,
+        std::optional<SymlinkLayout> hashed_layout);
 
     virtual ~ContentStore() = default;
 
@@ -43,6 +61,15 @@ class ContentStore {
     virtual std::optional<std::filesystem::path> StreamInsert(
         std::function<bool(StreamSink& sink)> stream_fun) = 0;
 
+    // Like `StreamInsert`, but `stream_fun` returns the hash of what it
+    // streamed if the new file is to be kept, and nullopt if not. If the
+    // content store uses hashed paths, the new file is then put directly at
+    // its hashed path (unless there's already a file there, as with
+    // `MoveToHashedPath`).
+    virtual std::optional<std::filesystem::path> StreamInsertHashed(
+        std::function<std::optional<HashAndSize<256>>(StreamSink& sink)>
+            stream_fun) = 0;
+
     // Copy the given file into the content store. Return the new path.
     std::filesystem::path CopyInsert(const std::filesystem::path& source,
                                      Streamer& streamer);
@@ -53,6 +80,12 @@ class ContentStore {
     virtual std::filesystem::path MoveInsert(
         const std::filesystem::path& source, Streamer& streamer) = 0;
 
+    // Like `MoveInsert`, but leave `source` where it is: the content store
+    // gets a new hard link to it (which means that `source` loses its write
+    // permissions too), or a copy if that isn't possible.
+    virtual std::filesystem::path LinkInsert(
+        const std::filesystem::path& source, Streamer& streamer) = 0;
+
     // Iterate over all regular files in the content store. The callback is
     // given two handles to each content file: `dent`, a directory entry whose
     // path is either absolute or relative to the current working directory,
@@ -63,11 +96,72 @@ class ContentStore {
                            const std::filesystem::path& canonical_path)>
             callback) const = 0;
 
+    // Like `ForEach`, but skip content files in directories that `tracker`
+    // says haven't changed since the last time.
+    virtual void ForEachChanged(
+        std::function<void(const std::filesystem::directory_entry& dent,
+                           const std::filesystem::path& canonical_path)>
+            callback,
+        DirChangeTracker& tracker) const = 0;
+
+    // Like `ForEachChanged` (or `ForEach`, if `tracker` is null), but call
+    // `callback` concurrently from `num_threads` worker threads, and only for
+    // the files that `select` returns true for. The store is walked, and
+    // `select` called, by the calling thread, which is the only one that uses
+    // `tracker`. The selected files are then handed to `callback` in the
+    // order their data is laid out on disk (see `DiskReadOrder`), so that
+    // reading them doesn't make a rotating disk seek back and forth. Return
+    // when all callbacks have finished; if any of them threw an exception,
+    // rethrow the first one.
+    void ParallelForEach(
+        std::function<bool(const std::filesystem::directory_entry& dent,
+                           const std::filesystem::path& canonical_path)>
+            select,
+        std::function<void(const std::filesystem::directory_entry& dent,
+                           const std::filesystem::path& canonical_path)>
+            callback,
+        DirChangeTracker* tracker, int num_threads) const;
+
     // Given a path `file`: if it belongs to the content store, return it in
     // canonical form relative to the root directory of the content store; if
     // it doesn't belong to the content store, return nullopt.
     virtual std::optional<std::filesystem::path> CanonicalPath(
         const std::filesystem::path& file) const = 0;
+
+    // If the content store puts files at paths derived from their hashes,
+    // return the path where the content file with the given hash belongs
+    // (whether or not there is a file there). Otherwise, return nullopt.
+    virtual std::optional<std::filesystem::path> HashedPath(
+        const HashAndSize<256>& hs) const = 0;
+
+    // If the content store puts files at paths derived from their hashes,
+    // move `file` (which must belong to the content store, and have the hash
+    // `hs`) to its hashed path, unless there is already a file there. Return
+    // the path of the file afterwards.
+    //
+    // The insert functions don't know the hash of the file they're inserting,
+    // so they put it in a temporary location; call this function once the
+    // hash is known.
+    virtual std::filesystem::path MoveToHashedPath(
+        const std::filesystem::path& file, const HashAndSize<256>& hs) = 0;
+
+    // Which tier is `file` (which must belong to the content store) in?
+    // Stores with just one tier have only a hot tier.
+    enum class Tier { kHot, kCold };
+    virtual Tier GetTier(const std::filesystem::path& /*file*/) const {
+        return Tier::kHot;
+    }
+
+    // Unless `file` (which must belong to the content store) is already in
+    // the given tier, give that tier a new hard link to it, or a copy if the
+    // tiers are on different filesystems. `file` is left where it is, so
+    // that the caller can make sure the new file is safe before removing
+    // it. Return the path of the new file (or `file`).
+    virtual std::filesystem::path LinkToTier(const std::filesystem::path& file,
+                                             Tier /*tier*/,
+                                             Streamer& /*streamer*/) {
+        return file;
+    }
 };
 
 }  // namespace frz
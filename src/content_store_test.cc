@@ -16,10 +16,21 @@
 
 #include "content_store.hh"
 
+#include <array>
+#include <cstddef>
+#include <filesystem>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
 
+#include "base32.hh"
 #include "filesystem_testing.hh"
+#include "filesystem_util.hh"
+#include "hash.hh"
+#include "stream.hh"
 
 namespace frz {
 namespace {
@@ -39,5 +50,198 @@ TEST(TestContentStore, CanonicalPath) {
                 Optional(Eq("baz/kk")));
 }
 
+TEST(TestContentStore, HashedPaths) {
+    TempDir d;
+    const HashAndSize<256> hs(Hash<256>(std::array<std::byte, 32>{}), 17);
+    std::unique_ptr<ContentStore> random =
+        ContentStore::Create(d.Path() / "cs");
+    EXPECT_THAT(random->HashedPath(hs), Eq(std::nullopt));
+
+    std::unique_ptr<ContentStore> hashed = ContentStore::Create(
+        d.Path() / "cs", SymlinkLayout{.subdirs = 1, .subdir_digits = 3});
+    const std::filesystem::path expected_path =
+        d.Path() / "cs" /
+        SymlinkPath(hs.ToBase32(), {.subdirs = 1, .subdir_digits = 3});
+    EXPECT_THAT(hashed->HashedPath(hs), Optional(Eq(expected_path)));
+
+    // New files start out somewhere else, and are moved into place once we
+    // know their hash.
+    d.File("file", "foo");
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    const std::filesystem::path inserted =
+        hashed->CopyInsert(d.Path() / "file", *streamer);
+    EXPECT_NE(inserted, expected_path);
+    EXPECT_EQ(hashed->MoveToHashedPath(inserted, hs), expected_path);
+    EXPECT_THAT(expected_path, ReadContents(Eq("foo")));
+    EXPECT_THAT(inserted, IsNotFound());
+    EXPECT_EQ(hashed->MoveToHashedPath(expected_path, hs), expected_path);
+
+    // If the hashed path is taken, the file stays where it is.
+    const std::filesystem::path duplicate =
+        hashed->CopyInsert(d.Path() / "file", *streamer);
+    EXPECT_EQ(hashed->MoveToHashedPath(duplicate, hs), duplicate);
+
+    // Random stores never move anything.
+    EXPECT_EQ(random->MoveToHashedPath(duplicate, hs), duplicate);
+}
+
+TEST(TestContentStore, StreamInsertHashed) {
+    TempDir d;
+    const HashAndSize<256> hs(Hash<256>(std::array<std::byte, 32>{}), 3);
+    const SymlinkLayout layout = {.subdirs = 1, .subdir_digits = 3};
+    std::unique_ptr<ContentStore> hashed =
+        ContentStore::Create(d.Path() / "cs", layout);
+    const std::filesystem::path expected_path =
+        d.Path() / "cs" / SymlinkPath(hs.ToBase32(), layout);
+    auto insert = [&](ContentStore& cs) {
+        return cs.StreamInsertHashed(
+            [&](StreamSink& sink) -> std::optional<HashAndSize<256>> {
+                sink.AddBytes(std::as_bytes(std::span("foo", 3)));
+                return hs;
+            });
+    };
+
+    // Once the hash is known, the file goes straight to its hashed path, and
+    // the insert directory is left behind for the next insert.
+    EXPECT_THAT(insert(*hashed), Optional(Eq(expected_path)));
+    EXPECT_THAT(expected_path, ReadContents(Eq("foo")));
+    EXPECT_TRUE(IsReadonly(std::filesystem::symlink_status(expected_path)));
+    EXPECT_EQ(RecursiveListDirectory(d.Path() / "cs").size(), 1u);
+
+    // If the hashed path is taken, the file goes somewhere else.
+    const std::optional<std::filesystem::path> duplicate = insert(*hashed);
+    ASSERT_TRUE(duplicate.has_value());
+    EXPECT_NE(*duplicate, expected_path);
+    EXPECT_THAT(*duplicate, ReadContents(Eq("foo")));
+
+    // Files we don't want to keep are removed.
+    EXPECT_THAT(hashed->StreamInsertHashed([](StreamSink&) {
+        return std::optional<HashAndSize<256>>();
+    }),
+                Eq(std::nullopt));
+    EXPECT_EQ(RecursiveListDirectory(d.Path() / "cs").size(), 2u);
+
+    // Random stores ignore the hash.
+    std::unique_ptr<ContentStore> random =
+        ContentStore::Create(d.Path() / "random");
+    const std::optional<std::filesystem::path> p = insert(*random);
+    ASSERT_TRUE(p.has_value());
+    EXPECT_THAT(*p, ReadContents(Eq("foo")));
+}
+
+TEST(TestContentStore, ManyInserts) {
+    TempDir d;
+    std::unique_ptr<ContentStore> cs = ContentStore::Create(d.Path() / "cs");
+    d.File("file", "foo");
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+
+    // Enough files to fill several directories, so that new directories have
+    // to be created (and cached) along the way.
+    for (int i = 0; i < 3000; ++i) {
+        const std::filesystem::path p =
+            cs->CopyInsert(d.Path() / "file", *streamer);
+        EXPECT_THAT(p, ReadContents(Eq("foo")));
+        EXPECT_TRUE(IsReadonly(std::filesystem::symlink_status(p)));
+    }
+    EXPECT_EQ(RecursiveListDirectory(d.Path() / "cs").size(), 3000u);
+
+    // Files we don't want to keep are removed.
+    EXPECT_THAT(cs->StreamInsert([](StreamSink&) { return false; }),
+                Eq(std::nullopt));
+    EXPECT_EQ(RecursiveListDirectory(d.Path() / "cs").size(), 3000u);
+
+    // Moved files lose their write permissions.
+    d.File("movable", "bar");
+    const std::filesystem::path moved =
+        cs->MoveInsert(d.Path() / "movable", *streamer);
+    EXPECT_THAT(d.Path() / "movable", IsNotFound());
+    EXPECT_THAT(moved, ReadContents(Eq("bar")));
+    EXPECT_TRUE(IsReadonly(std::filesystem::symlink_status(moved)));
+}
+
+TEST(TestContentStore, AbandonedStreamInsertsLeaveNoFiles) {
+    TempDir d;
+    auto insert = [](ContentStore& cs) {
+        EXPECT_THAT(cs.StreamInsert([](StreamSink& sink) {
+            sink.AddBytes(std::as_bytes(std::span("abandoned", 9)));
+            return false;
+        }),
+                    Eq(std::nullopt));
+        const std::optional<std::filesystem::path> kept =
+            cs.StreamInsert([](StreamSink& sink) {
+                sink.AddBytes(std::as_bytes(std::span("kept", 4)));
+                return true;
+            });
+        ASSERT_TRUE(kept.has_value());
+        EXPECT_THAT(*kept, ReadContents(Eq("kept")));
+        EXPECT_TRUE(IsReadonly(std::filesystem::symlink_status(*kept)));
+    };
+    insert(*ContentStore::Create(d.Path() / "random"));
+    insert(*ContentStore::Create(
+        d.Path() / "hashed", SymlinkLayout{.subdirs = 1, .subdir_digits = 2}));
+    std::vector<std::filesystem::path> files;
+    for (const std::filesystem::directory_entry& dent :
+         std::filesystem::recursive_directory_iterator(d.Path())) {
+        if (dent.is_regular_file()) {
+            files.push_back(dent.path());
+        }
+    }
+    EXPECT_EQ(files.size(), 2u);
+}
+
+TEST(TestContentStore, LinkInsertKeepsSource) {
+    TempDir d;
+    std::unique_ptr<ContentStore> cs = ContentStore::Create(d.Path() / "cs");
+    d.File("file", "foo");
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    const std::filesystem::path linked =
+        cs->LinkInsert(d.Path() / "file", *streamer);
+    EXPECT_THAT(linked, ReadContents(Eq("foo")));
+    EXPECT_THAT(d.Path() / "file", ReadContents(Eq("foo")));
+    EXPECT_TRUE(std::filesystem::equivalent(linked, d.Path() / "file"));
+    EXPECT_TRUE(IsReadonly(std::filesystem::symlink_status(linked)));
+}
+
+TEST(TestContentStore, TieredStore) {
+    TempDir d;
+    std::unique_ptr<ContentStore> cs = ContentStore::CreateTiered(
+        d.Path(), d.Path() / "hot", d.Path() / "cold", std::nullopt);
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    d.File("file", "foo");
+    const std::filesystem::path hot =
+        cs->CopyInsert(d.Path() / "file", *streamer);
+    EXPECT_EQ(cs->GetTier(hot), ContentStore::Tier::kHot);
+    EXPECT_THAT(cs->CanonicalPath(hot), Optional(Eq(hot.lexically_relative(
+                                            d.Path()))));
+
+    const std::filesystem::path cold =
+        cs->LinkToTier(hot, ContentStore::Tier::kCold, *streamer);
+    EXPECT_EQ(cs->GetTier(cold), ContentStore::Tier::kCold);
+    EXPECT_THAT(RelativeSubtreePath(cold, d.Path() / "cold"),
+                Optional(testing::_));
+    EXPECT_THAT(cold, ReadContents(Eq("foo")));
+    EXPECT_THAT(hot, ReadContents(Eq("foo")));  // left for the caller
+    EXPECT_EQ(cs->LinkToTier(cold, ContentStore::Tier::kCold, *streamer),
+              cold);
+    std::filesystem::remove(hot);
+
+    // Both tiers are listed.
+    d.File("file2", "bar");
+    cs->CopyInsert(d.Path() / "file2", *streamer);
+    std::vector<std::filesystem::path> listed;
+    cs->ForEach([&](const std::filesystem::directory_entry& dent,
+                    const std::filesystem::path& canonical_path) {
+        EXPECT_THAT(cs->CanonicalPath(dent.path()),
+                    Optional(Eq(canonical_path)));
+        listed.push_back(dent.path());
+    });
+    EXPECT_EQ(listed.size(), 2);
+    EXPECT_THAT(listed, testing::Contains(cold));
+}
+
 }  // namespace
 }  // namespace frz
@@ -0,0 +1,268 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "dir_snapshot.hh"
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <system_error>
+#include <time.h>
+#include <vector>
+
+#include "assert.hh"
+#include "exceptions.hh"
+
+namespace frz {
+
+namespace {
+
+// The first line of a snapshot file. Change the number if the format changes;
+// old snapshots will then be ignored.
+constexpr std::string_view kHeader = "frz-dir-snapshot 4";
+
+// After the header line, each directory is a record of five 8-byte integers
+// (mtime, inode, number of entries, name hash sum, and listing time), the
+// length of the key (also 8 bytes), and the key itself.
+constexpr int kNumRecordInts = 6;
+
+// Longer keys mean that the file is corrupt.
+constexpr std::uint64_t kMaxKeySize = 1 << 20;
+
+// Directories modified less than this long before we look at them may be
+// modified again without their mtime changing, since filesystem timestamps
+// have limited resolution. We don't trust the recorded state of such
+// directories.
+constexpr std::int64_t kRacyWindowNs = 2'000'000'000;
+
+// Recorded mtime for directories we don't trust. Never matches a real mtime.
+constexpr std::int64_t kRacyMtimeNs = -1;
+
+std::int64_t TimespecNs(const struct timespec& ts) {
+    return std::int64_t{ts.tv_sec} * 1'000'000'000 + ts.tv_nsec;
+}
+
+std::string ParentKey(const std::string& key) {
+    const std::string::size_type slash = key.rfind('/');
+    return slash == std::string::npos ? "" : key.substr(0, slash);
+}
+
+DirSnapshot::DirState StatDir(const std::filesystem::path& dir) {
+    struct stat st;
+    if (::lstat(dir.c_str(), &st) != 0) {
+        throw std::filesystem::filesystem_error(
+            "cannot stat directory", dir,
+            std::error_code(errno, std::generic_category()));
+    }
+    DirSnapshot::DirState state;
+    state.mtime_ns = TimespecNs(st.st_mtim);
+    state.inode = st.st_ino;
+    return state;
+}
+
+// A hash of a directory entry name that stays the same between runs (FNV-1a,
+// followed by the SplitMix64 finalizer to spread the bits).
+std::uint64_t NameHash(std::string_view name) {
+    std::uint64_t h = 0xcbf29ce484222325;
+    for (char c : name) {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+    }
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+}
+
+void PutUint64(std::string& out, std::uint64_t x) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<char>(x >> (8 * i)));
+    }
+}
+
+std::uint64_t GetUint64(const char* bytes) {
+    std::uint64_t x = 0;
+    for (int i = 0; i < 8; ++i) {
+        x |= std::uint64_t{static_cast<unsigned char>(bytes[i])} << (8 * i);
+    }
+    return x;
+}
+
+// The current time. File timestamps come from the kernel's coarse clock, so
+// compare them with CLOCK_REALTIME_COARSE rather than CLOCK_REALTIME.
+std::int64_t NowNs(clockid_t clock) {
+    struct timespec ts;
+    FRZ_CHECK_EQ(::clock_gettime(clock, &ts), 0);
+    return TimespecNs(ts);
+}
+
+}  // namespace
+
+std::optional<DirSnapshot> DirSnapshot::Load(
+    const std::filesystem::path& file) {
+    std::ifstream in(file, std::ios::binary);
+    std::string line;
+    if (!std::getline(in, line) || line != kHeader) {
+        return std::nullopt;
+    }
+    DirSnapshot snapshot;
+    std::array<char, 8 * kNumRecordInts> ints;
+    while (in.read(ints.data(), ints.size())) {
+        DirState state;
+        state.mtime_ns = static_cast<std::int64_t>(GetUint64(&ints[0]));
+        state.inode = GetUint64(&ints[8]);
+        state.num_entries = static_cast<std::int64_t>(GetUint64(&ints[16]));
+        state.name_hash_sum = GetUint64(&ints[24]);
+        state.listed_ns = static_cast<std::int64_t>(GetUint64(&ints[32]));
+        const std::uint64_t key_size = GetUint64(&ints[40]);
+        if (key_size > kMaxKeySize) {
+            return std::nullopt;
+        }
+        std::string key(key_size, '\0');
+        if (!in.read(key.data(), key.size())) {
+            return std::nullopt;
+        }
+        snapshot.Set(key, state);
+    }
+    if (!in.eof() || in.gcount() != 0) {
+        return std::nullopt;
+    }
+    return snapshot;
+}
+
+void DirSnapshot::Save(const std::filesystem::path& file) const {
+    std::filesystem::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out << kHeader << '\n';
+        std::string record;
+        for (const auto& [key, state] : dirs_) {
+            record.clear();
+            PutUint64(record, state.mtime_ns);
+            PutUint64(record, state.inode);
+            PutUint64(record, state.num_entries);
+            PutUint64(record, state.name_hash_sum);
+            PutUint64(record, state.listed_ns);
+            PutUint64(record, key.size());
+            record += key;
+            out.write(record.data(), record.size());
+        }
+        out.close();
+        if (!out) {
+            throw Error("Failed to write %s", tmp);
+        }
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+const DirSnapshot::DirState* DirSnapshot::Find(const std::string& key) const {
+    auto it = dirs_.find(key);
+    return it == dirs_.end() ? nullptr : &it->second;
+}
+
+const std::vector<std::string>& DirSnapshot::Subdirs(
+    const std::string& key) const {
+    static const std::vector<std::string> kNoSubdirs;
+    auto it = subdirs_.find(key);
+    return it == subdirs_.end() ? kNoSubdirs : it->second;
+}
+
+void DirSnapshot::Set(const std::string& key, const DirState& state) {
+    const bool inserted = dirs_.insert_or_assign(key, state).second;
+    if (inserted && !key.empty()) {
+        subdirs_[ParentKey(key)].push_back(key);
+    }
+}
+
+DirChangeTracker::DirChangeTracker(const std::filesystem::path& root,
+                                   const DirSnapshot* previous,
+                                   DirSnapshot& next)
+    : root_(root), previous_(previous), next_(next) {}
+
+std::optional<std::vector<std::filesystem::path>> DirChangeTracker::Unchanged(
+    const std::filesystem::path& dir) {
+    const std::string key = Key(dir);
+    const DirSnapshot::DirState current = StatDir(dir);
+    const DirSnapshot::DirState* const old =
+        previous_ == nullptr ? nullptr : previous_->Find(key);
+    if (old == nullptr || old->mtime_ns != current.mtime_ns ||
+        old->inode != current.inode) {
+        DirSnapshot::DirState recorded = current;
+        if (current.mtime_ns > NowNs(CLOCK_REALTIME) - kRacyWindowNs) {
+            recorded.mtime_ns = kRacyMtimeNs;
+        }
+        recorded.listed_ns = NowNs(CLOCK_REALTIME_COARSE);
+        pending_.insert_or_assign(key, recorded);
+        return std::nullopt;
+    }
+    next_.Set(key, *old);
+    std::vector<std::filesystem::path> subdirs;
+    for (const std::string& subdir_key : previous_->Subdirs(key)) {
+        subdirs.push_back(root_ / subdir_key);
+    }
+    return subdirs;
+}
+
+void DirChangeTracker::Listing::Add(std::string_view name) {
+    names_.emplace_back(name);
+    name_hash_sum_ += NameHash(name);
+}
+
+void DirChangeTracker::Listed(const std::filesystem::path& dir,
+                              const Listing& listing) {
+    const std::string key = Key(dir);
+    auto it = pending_.find(key);
+    FRZ_ASSERT(it != pending_.end());
+    DirSnapshot::DirState state = it->second;
+    pending_.erase(it);
+    state.num_entries = std::ssize(listing.names_);
+    state.name_hash_sum = listing.name_hash_sum_;
+    const DirSnapshot::DirState* const old =
+        previous_ == nullptr ? nullptr : previous_->Find(key);
+    if (old != nullptr && (old->num_entries != state.num_entries ||
+                           old->name_hash_sum != state.name_hash_sum)) {
+        // Some names have changed. Unless there are fewer of them, look for
+        // the ones that were there last time.
+        std::int64_t num_old_entries = 0;
+        std::uint64_t old_name_hash_sum = 0;
+        if (old->num_entries < state.num_entries) {
+            for (const std::string& name : listing.names_) {
+                struct stat st;
+                if (::lstat((dir / name).c_str(), &st) == 0 &&
+                    TimespecNs(st.st_ctim) < old->listed_ns) {
+                    ++num_old_entries;
+                    old_name_hash_sum += NameHash(name);
+                }
+            }
+        }
+        if (num_old_entries != old->num_entries ||
+            old_name_hash_sum != old->name_hash_sum) {
+            shrunk_ = true;
+        }
+    }
+    next_.Set(key, state);
+}
+
+std::string DirChangeTracker::Key(const std::filesystem::path& dir) const {
+    const std::filesystem::path relative = dir.lexically_relative(root_);
+    return relative == "." ? "" : relative.generic_string();
+}
+
+}  // namespace frz
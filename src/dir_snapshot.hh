@@ -0,0 +1,135 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_DIR_SNAPSHOT_HH_
+#define FRZ_DIR_SNAPSHOT_HH_
+
+#include <absl/container/flat_hash_map.h>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace frz {
+
+// Metadata for a set of directories, which can be saved to a file and later
+// compared to the current state of the filesystem to find out which
+// directories have changed in the meantime. Adding, removing, or renaming a
+// directory entry always updates the directory's mtime, so a directory whose
+// mtime and inode number are unchanged still has the same entries.
+class DirSnapshot final {
+  public:
+    struct DirState {
+        std::int64_t mtime_ns = 0;
+        std::uint64_t inode = 0;
+        std::int64_t num_entries = 0;
+
+        // The sum of the hashes of the entry names. If the directory has as
+        // many entries as before, but a different sum, some entries have
+        // been replaced by others.
+        std::uint64_t name_hash_sum = 0;
+
+        // When we started listing the directory. Entries with an earlier
+        // ctime were most likely among the ones we listed.
+        std::int64_t listed_ns = 0;
+    };
+
+    // Read a snapshot from the given file. Return nullopt if the file doesn't
+    // exist or can't be parsed.
+    static std::optional<DirSnapshot> Load(const std::filesystem::path& file);
+
+    // Atomically replace the given file with this snapshot.
+    void Save(const std::filesystem::path& file) const;
+
+    // Return the recorded state for the given directory, or null if we have
+    // none. The key is a path in generic format, relative to whatever root
+    // directory the creator of the snapshot chose; the root itself is "".
+    const DirState* Find(const std::string& key) const;
+
+    // Return the keys of all recorded directories whose parent is `key`.
+    const std::vector<std::string>& Subdirs(const std::string& key) const;
+
+    // Record the state of a directory.
+    void Set(const std::string& key, const DirState& state);
+
+  private:
+    absl::flat_hash_map<std::string, DirState> dirs_;
+    absl::flat_hash_map<std::string, std::vector<std::string>> subdirs_;
+};
+
+// Helper for walking a directory tree, skipping directories that haven't
+// changed since the previous snapshot, and recording a new snapshot as we go.
+// For each directory, the walker first calls `Unchanged`; if that returns a
+// list of subdirectories, the walker should visit them but needn't list the
+// directory itself. Otherwise, the walker should list the directory as usual,
+// adding the name of each entry to a `Listing`, and then call `Listed`.
+class DirChangeTracker final {
+  public:
+    // The entries of a directory, as seen by a walker that lists it.
+    class Listing final {
+      public:
+        void Add(std::string_view name);
+
+      private:
+        friend class DirChangeTracker;
+        std::vector<std::string> names_;
+        std::uint64_t name_hash_sum_ = 0;
+    };
+
+    // Paths are recorded relative to `root`. If `previous` is null, every
+    // directory is considered changed. `previous` and `next` may not be
+    // destroyed before the tracker.
+    DirChangeTracker(const std::filesystem::path& root,
+                     const DirSnapshot* previous, DirSnapshot& next);
+
+    // If `dir` looks exactly like it did in the previous snapshot, copy its
+    // state to the new snapshot and return the subdirectories it had then.
+    // Otherwise, return nullopt.
+    std::optional<std::vector<std::filesystem::path>> Unchanged(
+        const std::filesystem::path& dir);
+
+    // Record that `dir`, for which `Unchanged` returned nullopt, had the
+    // entries in `listing` when we listed it.
+    void Listed(const std::filesystem::path& dir, const Listing& listing);
+
+    // Did any of the directories we listed lose entries since the previous
+    // snapshot? Adding, linking, or renaming a file updates its ctime, so the
+    // entries with a ctime from before the previous listing should add up to
+    // what we listed then. A file whose ctime has changed for some other
+    // reason can only make us report a removal that didn't happen.
+    bool Shrunk() const { return shrunk_; }
+
+  private:
+    std::string Key(const std::filesystem::path& dir) const;
+
+    const std::filesystem::path root_;
+    const DirSnapshot* const previous_;
+    DirSnapshot& next_;
+
+    // Directories for which `Unchanged` has been called, but not yet
+    // `Listed`, and their state at the time of the `Unchanged` call. We
+    // record that state rather than the state after listing, so that any
+    // modifications made while we were busy will be noticed next time.
+    absl::flat_hash_map<std::string, DirSnapshot::DirState> pending_;
+
+    bool shrunk_ = false;
+};
+
+}  // namespace frz
+
+#endif  // FRZ_DIR_SNAPSHOT_HH_
@@ -0,0 +1,200 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "dir_snapshot.hh"
+
+#include <chrono>
+#include <filesystem>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "filesystem_testing.hh"
+
+namespace frz {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+// Pretend that the given directory was last modified an hour ago, so that it
+// isn't considered too recently modified to be trusted.
+void Backdate(const std::filesystem::path& dir) {
+    std::filesystem::last_write_time(
+        dir, std::filesystem::file_time_type::clock::now() -
+                 std::chrono::hours(1));
+}
+
+// Walk the directory tree rooted at `dir` the way a real user of
+// DirChangeTracker would, and append the directories that we had to list to
+// `listed`.
+void Walk(DirChangeTracker& tracker, const std::filesystem::path& dir,
+          std::vector<std::filesystem::path>& listed) {
+    if (auto subdirs = tracker.Unchanged(dir)) {
+        for (const std::filesystem::path& subdir : *subdirs) {
+            Walk(tracker, subdir, listed);
+        }
+        return;
+    }
+    listed.push_back(dir);
+    DirChangeTracker::Listing listing;
+    for (const std::filesystem::directory_entry& dent :
+         std::filesystem::directory_iterator(dir)) {
+        listing.Add(dent.path().filename().native());
+        if (dent.is_directory()) {
+            Walk(tracker, dent.path(), listed);
+        }
+    }
+    tracker.Listed(dir, listing);
+}
+
+TEST(TestDirSnapshot, SaveAndLoad) {
+    TempDir d;
+    DirSnapshot snapshot;
+    snapshot.Set("", {.mtime_ns = 1,
+                      .inode = 2,
+                      .num_entries = 3,
+                      .name_hash_sum = 4,
+                      .listed_ns = 5});
+    snapshot.Set("a b", {.mtime_ns = 6,
+                         .inode = 7,
+                         .num_entries = 8,
+                         .name_hash_sum = 9,
+                         .listed_ns = 10});
+    snapshot.Set(std::string("a b/c\nd\0", 8), {.mtime_ns = -1,
+                                                 .inode = 11,
+                                                 .num_entries = 12,
+                                                 .name_hash_sum = ~0ull,
+                                                 .listed_ns = 13});
+    snapshot.Save(d.Path() / "snapshot");
+
+    std::optional<DirSnapshot> loaded =
+        DirSnapshot::Load(d.Path() / "snapshot");
+    ASSERT_TRUE(loaded.has_value());
+    const std::string key("a b/c\nd\0", 8);
+    ASSERT_NE(loaded->Find(key), nullptr);
+    EXPECT_EQ(loaded->Find(key)->mtime_ns, -1);
+    EXPECT_EQ(loaded->Find(key)->inode, 11);
+    EXPECT_EQ(loaded->Find(key)->num_entries, 12);
+    EXPECT_EQ(loaded->Find(key)->name_hash_sum, ~0ull);
+    EXPECT_EQ(loaded->Find(key)->listed_ns, 13);
+    EXPECT_EQ(loaded->Find("x"), nullptr);
+    EXPECT_THAT(loaded->Subdirs(""), ElementsAre("a b"));
+    EXPECT_THAT(loaded->Subdirs("a b"), ElementsAre(key));
+    EXPECT_THAT(loaded->Subdirs(key), IsEmpty());
+}
+
+TEST(TestDirSnapshot, LoadMissingOrCorrupt) {
+    TempDir d;
+    EXPECT_FALSE(DirSnapshot::Load(d.Path() / "missing").has_value());
+    d.File("truncated", "frz-dir-snapshot 4\n1234567");
+    EXPECT_FALSE(DirSnapshot::Load(d.Path() / "truncated").has_value());
+    d.File("wrong-version", "frz-dir-snapshot 3\n");
+    EXPECT_FALSE(DirSnapshot::Load(d.Path() / "wrong-version").has_value());
+}
+
+TEST(TestDirChangeTracker, SkipsUnchangedDirectories) {
+    TempDir d;
+    d.Dir("a/b");
+    d.Dir("c");
+    for (const char* dir : {"a/b", "a", "c", ""}) {
+        Backdate(d.Path() / dir);
+    }
+
+    // Without a previous snapshot, we have to list everything.
+    DirSnapshot first;
+    DirChangeTracker t1(d.Path(), nullptr, first);
+    std::vector<std::filesystem::path> listed;
+    Walk(t1, d.Path(), listed);
+    EXPECT_EQ(listed.size(), 4);
+    EXPECT_FALSE(t1.Shrunk());
+
+    // Add a file to a/b.
+    d.File("a/b/file", "x");
+    DirSnapshot second;
+    DirChangeTracker t2(d.Path(), &first, second);
+    listed.clear();
+    Walk(t2, d.Path(), listed);
+    EXPECT_THAT(listed, ElementsAre(d.Path() / "a/b"));
+    EXPECT_FALSE(t2.Shrunk());
+
+    // a/b was modified just now, so it can't be trusted yet.
+    DirSnapshot third;
+    DirChangeTracker t3(d.Path(), &second, third);
+    listed.clear();
+    Walk(t3, d.Path(), listed);
+    EXPECT_THAT(listed, ElementsAre(d.Path() / "a/b"));
+
+    // Remove a directory.
+    d.Remove("c");
+    DirSnapshot fourth;
+    DirChangeTracker t4(d.Path(), &first, fourth);
+    listed.clear();
+    Walk(t4, d.Path(), listed);
+    EXPECT_THAT(listed, ElementsAre(d.Path(), d.Path() / "a/b"));
+    EXPECT_TRUE(t4.Shrunk());
+    EXPECT_THAT(fourth.Subdirs(""), ElementsAre("a"));
+}
+
+TEST(TestDirChangeTracker, NoticesRemovedEntries) {
+    struct Change {
+        std::vector<std::string> remove;
+        std::vector<std::string> add;
+        bool shrunk;
+    };
+    for (const Change& change : {
+             // Only additions.
+             Change{.remove = {}, .add = {"x", "y", "z"}, .shrunk = false},
+             // Only removals.
+             Change{.remove = {"a", "c"}, .add = {}, .shrunk = true},
+             // One file replaced by another; the count stays the same.
+             Change{.remove = {"a"}, .add = {"x"}, .shrunk = true},
+             // One file removed, but even more added.
+             Change{.remove = {"a"}, .add = {"x", "y"}, .shrunk = true},
+         }) {
+        TempDir d;
+        for (const char* name : {"a", "b", "c"}) {
+            d.File(name, "");
+        }
+        Backdate(d.Path());
+
+        // The files' ctimes must be earlier than the time we list them.
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        DirSnapshot first;
+        DirChangeTracker t1(d.Path(), nullptr, first);
+        std::vector<std::filesystem::path> listed;
+        Walk(t1, d.Path(), listed);
+
+        for (const std::string& name : change.remove) {
+            d.Remove(name);
+        }
+        for (const std::string& name : change.add) {
+            d.File(name, "");
+        }
+        DirSnapshot second;
+        DirChangeTracker t2(d.Path(), &first, second);
+        listed.clear();
+        Walk(t2, d.Path(), listed);
+        EXPECT_THAT(listed, ElementsAre(d.Path()));
+        EXPECT_EQ(t2.Shrunk(), change.shrunk);
+    }
+}
+
+}  // namespace
+}  // namespace frz
@@ -0,0 +1,89 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "file_list.hh"
+
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "assert.hh"
+
+namespace frz {
+
+namespace {
+
+// Name number `i` of a list of back-to-back names.
+std::string_view Name(const std::string& names,
+                      const std::vector<std::uint64_t>& starts,
+                      std::int64_t i) {
+    const std::uint64_t start = starts[i];
+    const std::uint64_t end =
+        i + 1 < std::ssize(starts) ? starts[i + 1] : names.size();
+    return std::string_view(names).substr(start, end - start);
+}
+
+}  // namespace
+
+FileList::DirId FileList::AddDir(DirId parent, std::string_view name) {
+    FRZ_ASSERT_GE(parent, kNoDir);
+    FRZ_ASSERT_LT(parent, std::ssize(dir_parents_));
+    FRZ_CHECK_LT(std::ssize(dir_parents_), std::numeric_limits<DirId>::max());
+    dir_parents_.push_back(parent);
+    dir_name_starts_.push_back(dir_names_.size());
+    dir_names_.append(name);
+    return std::ssize(dir_parents_) - 1;
+}
+
+FileList::FileId FileList::AddFile(DirId dir, std::string_view name) {
+    FRZ_ASSERT_GE(dir, 0);
+    FRZ_ASSERT_LT(dir, std::ssize(dir_parents_));
+    FRZ_CHECK_LT(std::ssize(file_dirs_), std::numeric_limits<FileId>::max());
+    file_dirs_.push_back(dir);
+    file_name_starts_.push_back(file_names_.size());
+    file_names_.append(name);
+    return std::ssize(file_dirs_) - 1;
+}
+
+std::filesystem::path FileList::Path(FileId file) const {
+    FRZ_ASSERT_GE(file, 0);
+    FRZ_ASSERT_LT(file, std::ssize(file_dirs_));
+    std::vector<std::string_view> components = {
+        Name(file_names_, file_name_starts_, file)};
+    for (DirId dir = file_dirs_[file]; dir != kNoDir;
+         dir = dir_parents_[dir]) {
+        components.push_back(Name(dir_names_, dir_name_starts_, dir));
+    }
+    std::string path;
+    for (auto it = components.rbegin(); it != components.rend(); ++it) {
+        if (!path.empty() && path.back() != '/') {
+            path += '/';
+        }
+        path += *it;
+    }
+    return path;
+}
+
+std::string_view FileList::FileName(FileId file) const {
+    FRZ_ASSERT_GE(file, 0);
+    FRZ_ASSERT_LT(file, std::ssize(file_dirs_));
+    return Name(file_names_, file_name_starts_, file);
+}
+
+}  // namespace frz
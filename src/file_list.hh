@@ -0,0 +1,73 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_FILE_LIST_HH_
+#define FRZ_FILE_LIST_HH_
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace frz {
+
+// A compact list of file paths. Instead of storing each path in full, we
+// store each directory and each file as a name and the id of the directory
+// it's in; the names are stored back to back in one big string per kind.
+// This takes a small fraction of the memory that a vector of
+// `std::filesystem::path`s would, and a small fraction of the allocations.
+// Full paths are put together on demand.
+class FileList final {
+  public:
+    using DirId = std::int32_t;
+    using FileId = std::int32_t;
+
+    // The parent of directories that aren't in any other directory.
+    static constexpr DirId kNoDir = -1;
+
+    // Add a directory named `name` in the directory `parent`. If `parent` is
+    // `kNoDir`, `name` is the whole path of the directory; otherwise, it may
+    // be a single file name or a relative path of several.
+    DirId AddDir(DirId parent, std::string_view name);
+
+    // Add a file named `name` in the directory `dir`.
+    FileId AddFile(DirId dir, std::string_view name);
+
+    // The full path of a file.
+    std::filesystem::path Path(FileId file) const;
+
+    // The name of a file, as given to `AddFile`.
+    std::string_view FileName(FileId file) const;
+
+    std::int64_t NumFiles() const { return std::ssize(file_dirs_); }
+
+  private:
+    // Directories: the parent of each, and where its name starts in
+    // `dir_names_`. Each name ends where the next one starts.
+    std::vector<DirId> dir_parents_;
+    std::vector<std::uint64_t> dir_name_starts_;
+    std::string dir_names_;
+
+    // Files: likewise.
+    std::vector<DirId> file_dirs_;
+    std::vector<std::uint64_t> file_name_starts_;
+    std::string file_names_;
+};
+
+}  // namespace frz
+
+#endif  // FRZ_FILE_LIST_HH_
@@ -0,0 +1,47 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "file_list.hh"
+
+#include <filesystem>
+#include <gtest/gtest.h>
+
+namespace frz {
+namespace {
+
+TEST(TestFileList, Paths) {
+    FileList list;
+    const FileList::DirId root = list.AddDir(FileList::kNoDir, "/some/root");
+    const FileList::DirId a = list.AddDir(root, "a");
+    const FileList::FileId f1 = list.AddFile(root, "f1");
+    const FileList::DirId b = list.AddDir(a, "b");
+    const FileList::FileId f2 = list.AddFile(b, "f2");
+    const FileList::FileId f3 = list.AddFile(a, "f3");
+    const FileList::DirId other = list.AddDir(FileList::kNoDir, "/");
+    const FileList::FileId f4 = list.AddFile(other, "f4");
+    const FileList::DirId c = list.AddDir(other, "c/d");
+    const FileList::FileId f5 = list.AddFile(c, "");
+
+    EXPECT_EQ(list.NumFiles(), 5);
+    EXPECT_EQ(list.Path(f1), std::filesystem::path("/some/root/f1"));
+    EXPECT_EQ(list.Path(f2), std::filesystem::path("/some/root/a/b/f2"));
+    EXPECT_EQ(list.Path(f3), std::filesystem::path("/some/root/a/f3"));
+    EXPECT_EQ(list.Path(f4), std::filesystem::path("/f4"));
+    EXPECT_EQ(list.Path(f5), std::filesystem::path("/c/d/"));
+}
+
+}  // namespace
+}  // namespace frz
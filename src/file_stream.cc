@@ -16,7 +16,10 @@
 
 #include "file_stream.hh"
 
+#include <cerrno>
 #include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "assert.hh"
 #include "exceptions.hh"
@@ -75,6 +78,29 @@ class FileStreamSource final : public StreamSource {
     std::FILE* const file_;
 };
 
+// Create the new file `name` in `dir_fd` for writing, and return it as a FILE*.
+// Throw `FileExistsException` if the file already exists.
+std::FILE* CreateFileAt(int dir_fd, const std::filesystem::path& name,
+                        std::filesystem::perms perms) {
+    const int fd =
+        ::openat(dir_fd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                 static_cast<mode_t>(perms));
+    if (fd == -1) {
+        if (errno == EEXIST) {
+            throw FileExistsException();
+        } else {
+            throw ErrnoError();
+        }
+    }
+    std::FILE* const file = ::fdopen(fd, "wb");
+    if (file == nullptr) {
+        const Error error = ErrnoError();
+        ::close(fd);
+        throw error;
+    }
+    return file;
+}
+
 class FileStreamSink final : public StreamSink {
   public:
     FileStreamSink(const std::filesystem::path& path)
@@ -88,6 +114,11 @@ class FileStreamSink final : public StreamSink {
         }
     }
 
+    // Take ownership of an open file.
+    explicit FileStreamSink(std::FILE* file) : file_(file) {
+        FRZ_ASSERT(file_ != nullptr);
+    }
+
     ~FileStreamSink() override {
         if (file_ != nullptr) {
             std::fclose(file_);
@@ -117,4 +148,20 @@ std::unique_ptr<StreamSink> CreateFileSink(const std::filesystem::path& path) {
     return std::make_unique<FileStreamSink>(path);
 }
 
+std::unique_ptr<StreamSink> CreateFileSinkAt(int dir_fd,
+                                             const std::filesystem::path& name,
+                                             std::filesystem::perms perms) {
+    return std::make_unique<FileStreamSink>(CreateFileAt(dir_fd, name, perms));
+}
+
+std::unique_ptr<StreamSink> CreateFileSinkForFd(int fd) {
+    std::FILE* const file = ::fdopen(fd, "wb");
+    if (file == nullptr) {
+        const Error error = ErrnoError();
+        ::close(fd);
+        throw error;
+    }
+    return std::make_unique<FileStreamSink>(file);
+}
+
 }  // namespace frz
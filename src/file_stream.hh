@@ -32,6 +32,18 @@ std::unique_ptr<StreamSource> CreateFileSource(
 // `FileExistsException` if the file already exists.
 std::unique_ptr<StreamSink> CreateFileSink(const std::filesystem::path& path);
 
+// Like `CreateFileSink`, but create the file `name` in the directory `dir_fd`
+// (see openat(2)), with the given permissions (minus the umask). Since the
+// permissions only apply to future opens, a read-only file can be created and
+// written to in one step.
+std::unique_ptr<StreamSink> CreateFileSinkAt(int dir_fd,
+                                             const std::filesystem::path& name,
+                                             std::filesystem::perms perms);
+
+// Create a StreamSink that writes bytes to the open file descriptor `fd`,
+// and closes it when the sink is destroyed.
+std::unique_ptr<StreamSink> CreateFileSinkForFd(int fd);
+
 }  // namespace frz
 
 #endif  // FRZ_FILE_STREAM_HH_
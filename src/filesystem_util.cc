@@ -17,9 +17,15 @@
 #include "filesystem_util.hh"
 
 #include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
 #include <filesystem>
 #include <iostream>
 #include <optional>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
 
 namespace frz {
 namespace {
@@ -63,4 +69,92 @@ void RemoveWritePermissions(const std::filesystem::path path) {
                                      std::filesystem::perm_options::nofollow);
 }
 
+void RemoveWritePermissionsAt(int dir_fd, const std::filesystem::path& name) {
+    struct stat st;
+    if (::fstatat(dir_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        ThrowErrno("cannot stat", name);
+    }
+    const mode_t mode = st.st_mode & 07777 &
+                        ~static_cast<mode_t>(kAllWritePermissions);
+    if (mode == (st.st_mode & 07777)) {
+        return;  // already read-only; spare the filesystem a metadata update
+    }
+    if (::fchmodat(dir_fd, name.c_str(), mode, 0) != 0) {
+        ThrowErrno("cannot change permissions", name);
+    }
+}
+
+void ThrowErrno(const char* what, const std::filesystem::path& path) {
+    throw std::filesystem::filesystem_error(
+        what, path, std::error_code(errno, std::generic_category()));
+}
+
+DirFdCache::DirFdCache(const std::filesystem::path& root) : root_(root) {}
+
+DirFdCache::~DirFdCache() {
+    Clear();
+    if (root_fd_ != -1) {
+        ::close(root_fd_);
+    }
+}
+
+int DirFdCache::Get(const std::filesystem::path& relative_dir) {
+    if (relative_dir.empty() || relative_dir == ".") {
+        if (root_fd_ == -1) {
+            // The root may be a symlink to a directory (e.g. on another
+            // filesystem), which create_directories() would reject.
+            if (!std::filesystem::is_directory(root_)) {
+                std::filesystem::create_directories(root_);
+            }
+            root_fd_ = ::open(root_.c_str(),
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (root_fd_ == -1) {
+                ThrowErrno("cannot open directory", root_);
+            }
+        }
+        return root_fd_;
+    }
+    if (auto it = fds_.find(relative_dir.native()); it != fds_.end()) {
+        return it->second;
+    }
+    if (std::ssize(fds_) >= kMaxCachedFds) {
+        // Since we do this before asking for the parent, the parent's file
+        // descriptor will stay valid until we're done with it.
+        Clear();
+    }
+    const int parent_fd = Get(relative_dir.parent_path());
+    const std::filesystem::path name = relative_dir.filename();
+    if (::mkdirat(parent_fd, name.c_str(), 0777) != 0 && errno != EEXIST) {
+        ThrowErrno("cannot create directory", root_ / relative_dir);
+    }
+    const int fd = ::openat(parent_fd, name.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        ThrowErrno("cannot open directory", root_ / relative_dir);
+    }
+    fds_.emplace(relative_dir.native(), fd);
+    return fd;
+}
+
+void DirFdCache::Forget(const std::filesystem::path& relative_dir) {
+    const std::string& dir = relative_dir.native();
+    absl::erase_if(fds_, [&](const auto& entry) {
+        const auto& [path, fd] = entry;
+        if (path == dir ||
+            (path.starts_with(dir) && path.size() > dir.size() &&
+             path[dir.size()] == '/')) {
+            ::close(fd);
+            return true;
+        }
+        return false;
+    });
+}
+
+void DirFdCache::Clear() {
+    for (const auto& [path, fd] : fds_) {
+        ::close(fd);
+    }
+    fds_.clear();
+}
+
 }  // namespace frz
@@ -17,8 +17,10 @@
 #ifndef FRZ_FILESYSTEM_UTIL_HH_
 #define FRZ_FILESYSTEM_UTIL_HH_
 
+#include <absl/container/flat_hash_map.h>
 #include <filesystem>
 #include <optional>
+#include <string>
 
 namespace frz {
 
@@ -40,6 +42,48 @@ bool IsReadonly(const std::filesystem::file_status& status);
 // Remove all write permissions from `path`.
 void RemoveWritePermissions(const std::filesystem::path path);
 
+// Remove all write permissions from the file `name` in the directory `dir_fd`.
+void RemoveWritePermissionsAt(int dir_fd, const std::filesystem::path& name);
+
+// Throw a std::filesystem::filesystem_error for the current value of `errno`.
+[[noreturn]] void ThrowErrno(const char* what,
+                             const std::filesystem::path& path);
+
+// Open file descriptors for directories under a root directory, so that files
+// in them can be created with `openat` and friends without the kernel having
+// to look up the whole path every time. Directories are created as needed.
+// Not thread safe.
+class DirFdCache final {
+  public:
+    // The root directory need not exist; it's created on first use.
+    explicit DirFdCache(const std::filesystem::path& root);
+    ~DirFdCache();
+    DirFdCache(const DirFdCache&) = delete;
+    DirFdCache& operator=(const DirFdCache&) = delete;
+
+    // Return a file descriptor for the directory `relative_dir` (relative to
+    // the root directory; "" and "." mean the root itself), creating it and
+    // any missing parents. The file descriptor remains owned by the cache, and
+    // is valid until the next call to `Get` or `Forget`.
+    int Get(const std::filesystem::path& relative_dir);
+
+    // Close any file descriptors for `relative_dir` and its subdirectories.
+    // Call this after removing a directory, so that `Get` will create it
+    // again if asked.
+    void Forget(const std::filesystem::path& relative_dir);
+
+  private:
+    // We close all cached file descriptors when there are this many, so as to
+    // not run out of them.
+    static constexpr int kMaxCachedFds = 256;
+
+    void Clear();
+
+    const std::filesystem::path root_;
+    int root_fd_ = -1;
+    absl::flat_hash_map<std::string, int> fds_;
+};
+
 }  // namespace frz
 
 #endif  // FRZ_FILESYSTEM_UTIL_HH_
@@ -0,0 +1,176 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "fingerprint.hh"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#include "exceptions.hh"
+#include "file_stream.hh"
+#include "hash.hh"
+#include "hasher.hh"
+#include "stream.hh"
+
+namespace frz {
+
+namespace {
+
+// Size (8 bytes), hash (32 bytes), and fingerprint (32 bytes).
+constexpr int kHashOffset = 8;
+constexpr int kFingerprintOffset = kHashOffset + 32;
+constexpr int kRecordSize = kFingerprintOffset + 32;
+
+// Feed `num_bytes` bytes of `source`, starting at `pos`, to `hasher`.
+void HashRange(StreamSource& source, std::int64_t pos, std::int64_t num_bytes,
+               Hasher<256>& hasher) {
+    std::vector<std::byte> buffer(num_bytes);
+    source.SetPosition(pos);
+    const FillBufferFromStreamResult r = FillBufferFromStream(source, buffer);
+    if (r.num_bytes != num_bytes) {
+        throw Error("File shrank while being fingerprinted");
+    }
+    hasher.AddBytes(buffer);
+}
+
+}  // namespace
+
+Fingerprint ComputeFingerprint(const std::filesystem::path& file,
+                               std::int64_t size, Hasher<256>& hasher) {
+    auto source = CreateFileSource(file);
+    const std::int64_t head = std::min(size, kFingerprintBytes);
+    HashRange(*source, 0, head, hasher);
+    const std::int64_t tail_start = std::max(head, size - kFingerprintBytes);
+    HashRange(*source, tail_start, size - tail_start, hasher);
+    return hasher.Finish();
+}
+
+void FingerprintSink::AddBytes(std::span<const std::byte> buffer) {
+    const std::size_t num_head_bytes = std::min(
+        buffer.size(), static_cast<std::size_t>(kFingerprintBytes) -
+                           head_.size());
+    head_.insert(head_.end(), buffer.begin(), buffer.begin() + num_head_bytes);
+    buffer = buffer.subspan(num_head_bytes);
+    if (std::ssize(buffer) >= kFingerprintBytes) {
+        tail_.assign(buffer.end() - kFingerprintBytes, buffer.end());
+        return;
+    }
+    tail_.insert(tail_.end(), buffer.begin(), buffer.end());
+
+    // Drop the bytes that can no longer be part of the tail, but not one
+    // buffer at a time, since that would make this quadratic.
+    if (std::ssize(tail_) > 2 * kFingerprintBytes) {
+        tail_.erase(tail_.begin(), tail_.end() - kFingerprintBytes);
+    }
+}
+
+Fingerprint FingerprintSink::Finish(Hasher<256>& hasher) const {
+    hasher.AddBytes(head_);
+    hasher.AddBytes(std::span(tail_).last(
+        std::min(tail_.size(), static_cast<std::size_t>(kFingerprintBytes))));
+    return hasher.Finish();
+}
+
+std::optional<Fingerprint> FingerprintStore::Lookup(
+    const HashAndSize<256>& hs) {
+    Load();
+    auto it = fingerprints_.find(hs);
+    if (it == fingerprints_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void FingerprintStore::Add(const HashAndSize<256>& hs,
+                           const Fingerprint& fingerprint) {
+    Load();
+    if (!fingerprints_.insert({hs, fingerprint}).second) {
+        return;
+    }
+    std::array<std::byte, kRecordSize> record;
+    const auto size = static_cast<std::uint64_t>(hs.GetSize());
+    for (int i = 0; i < kHashOffset; ++i) {
+        record[i] = static_cast<std::byte>(size >> (8 * i));
+    }
+    std::ranges::copy(hs.GetHash().Bytes(), record.begin() + kHashOffset);
+    std::ranges::copy(fingerprint.Bytes(),
+                      record.begin() + kFingerprintOffset);
+
+    // Each record is appended with a single write, so that concurrent
+    // writers can't interleave their records.
+    const int fd = open(file_.c_str(),
+                        O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        throw Error("Could not open %s: %s", file_.string(),
+                    std::strerror(errno));
+    }
+    const ssize_t n = write(fd, record.data(), record.size());
+    const int write_errno = errno;
+    close(fd);
+    if (n != kRecordSize) {
+        throw Error("Could not write to %s: %s", file_.string(),
+                    std::strerror(n < 0 ? write_errno : EIO));
+    }
+}
+
+void FingerprintStore::Load() {
+    if (loaded_) {
+        return;
+    }
+    loaded_ = true;
+    std::ifstream in(file_, std::ios::binary);
+    std::array<char, kRecordSize> record;
+    std::int64_t num_records = 0;
+    while (in.read(record.data(), record.size())) {
+        ++num_records;
+        const auto bytes = std::as_bytes(std::span(record));
+        std::uint64_t size = 0;
+        for (int i = 0; i < kHashOffset; ++i) {
+            size |= static_cast<std::uint64_t>(bytes[i]) << (8 * i);
+        }
+        const HashAndSize<256> hs(
+            Hash<256>(bytes.subspan<kHashOffset, 32>()),
+            static_cast<std::int64_t>(size));
+        fingerprints_.insert(
+            {hs, Fingerprint(bytes.subspan<kFingerprintOffset, 32>())});
+    }
+
+    // A crash in the middle of an append leaves a torn record at the end.
+    // Cut it off, or every record appended after it would be misaligned.
+    if (in.gcount() > 0) {
+        in.close();
+        std::error_code ec;
+        std::filesystem::resize_file(file_, num_records * kRecordSize, ec);
+        if (ec) {
+            throw Error("Could not truncate %s: %s", file_.string(),
+                        ec.message());
+        }
+    }
+}
+
+}  // namespace frz
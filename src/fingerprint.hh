@@ -0,0 +1,92 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_FINGERPRINT_HH_
+#define FRZ_FINGERPRINT_HH_
+
+#include <absl/container/flat_hash_map.h>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "hash.hh"
+#include "hasher.hh"
+#include "stream.hh"
+
+namespace frz {
+
+// A fingerprint is the hash of just the first and last kFingerprintBytes of a
+// file. Files with different fingerprints have different content, so when
+// looking for a large file, it's much cheaper to compare fingerprints first
+// than to hash every candidate in full.
+using Fingerprint = Hash<256>;
+inline constexpr std::int64_t kFingerprintBytes = 64 * 1024;
+
+// Smaller files aren't worth fingerprinting, since hashing them in full is
+// cheap anyway.
+inline constexpr std::int64_t kMinFingerprintedSize = 1024 * 1024;
+
+// Compute the fingerprint of `file`, which must be `size` bytes long.
+Fingerprint ComputeFingerprint(const std::filesystem::path& file,
+                               std::int64_t size, Hasher<256>& hasher);
+
+// A StreamSink that remembers just enough of the bytes streamed to it to
+// compute their fingerprint, so that a file can be fingerprinted in the same
+// pass that hashes it in full.
+class FingerprintSink final : public StreamSink {
+  public:
+    void AddBytes(std::span<const std::byte> buffer) override;
+
+    // Return the fingerprint of the bytes added so far, as `ComputeFingerprint`
+    // would have computed it for a file with those contents.
+    Fingerprint Finish(Hasher<256>& hasher) const;
+
+  private:
+    // The first kFingerprintBytes bytes, and (at least) the last
+    // kFingerprintBytes of the bytes after those.
+    std::vector<std::byte> head_;
+    std::vector<std::byte> tail_;
+};
+
+// The fingerprints of content files, keyed by their hash+size, stored in an
+// append-only file of fixed-size records. Since the fingerprint is recorded
+// when content is added, it stays known after the content itself is lost,
+// which is exactly when we need it. Not thread safe.
+class FingerprintStore final {
+  public:
+    explicit FingerprintStore(const std::filesystem::path& file)
+        : file_(file) {}
+
+    // Return the fingerprint of the given content, if we have one.
+    std::optional<Fingerprint> Lookup(const HashAndSize<256>& hs);
+
+    // Record the fingerprint of the given content.
+    void Add(const HashAndSize<256>& hs, const Fingerprint& fingerprint);
+
+  private:
+    // Read the file, unless we already have.
+    void Load();
+
+    const std::filesystem::path file_;
+    bool loaded_ = false;
+    absl::flat_hash_map<HashAndSize<256>, Fingerprint> fingerprints_;
+};
+
+}  // namespace frz
+
+#endif  // FRZ_FINGERPRINT_HH_
@@ -0,0 +1,119 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "fingerprint.hh"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <span>
+#include <string>
+
+#include "blake3_256_hasher.hh"
+#include "filesystem_testing.hh"
+#include "hash.hh"
+
+namespace frz {
+namespace {
+
+Fingerprint FingerprintOf(const std::filesystem::path& file) {
+    return ComputeFingerprint(file, std::filesystem::file_size(file),
+                              *CreateBlake3_256Hasher());
+}
+
+HashAndSize<256> TestHash(int n) {
+    std::array<std::byte, 32> bytes = {};
+    bytes[0] = static_cast<std::byte>(n);
+    return HashAndSize<256>(Hash<256>(bytes), 1000 + n);
+}
+
+TEST(TestFingerprint, OnlyHeadAndTailMatter) {
+    TempDir d;
+    const std::string head(kFingerprintBytes, 'h');
+    const std::string tail(kFingerprintBytes, 't');
+    d.File("a", head + std::string(1000, 'a') + tail);
+    d.File("b", head + std::string(1000, 'b') + tail);
+    d.File("c", head + std::string(1000, 'a') + "x" + tail.substr(1));
+    EXPECT_EQ(FingerprintOf(d.Path() / "a"), FingerprintOf(d.Path() / "b"));
+    EXPECT_NE(FingerprintOf(d.Path() / "a"), FingerprintOf(d.Path() / "c"));
+
+    // Small files are fingerprinted in full.
+    d.File("small1", "abc");
+    d.File("small2", "abd");
+    EXPECT_NE(FingerprintOf(d.Path() / "small1"),
+              FingerprintOf(d.Path() / "small2"));
+}
+
+TEST(TestFingerprint, StoreSurvivesReopeningAndTornRecords) {
+    TempDir d;
+    const std::filesystem::path file = d.Path() / "fingerprints";
+    const Fingerprint fp1 = TestHash(1).GetHash();
+    const Fingerprint fp2 = TestHash(2).GetHash();
+    {
+        FingerprintStore store(file);
+        EXPECT_EQ(store.Lookup(TestHash(1)), std::nullopt);
+        store.Add(TestHash(1), fp1);
+        store.Add(TestHash(2), fp2);
+        EXPECT_EQ(store.Lookup(TestHash(1)), fp1);
+    }
+
+    // A crash in the middle of an append leaves a partial record. It's cut
+    // off, so that records appended after it can be read back.
+    std::filesystem::resize_file(file,
+                                 std::filesystem::file_size(file) + 10);
+    const Fingerprint fp3 = TestHash(3).GetHash();
+    {
+        FingerprintStore store(file);
+        EXPECT_EQ(store.Lookup(TestHash(1)), fp1);
+        EXPECT_EQ(store.Lookup(TestHash(2)), fp2);
+        EXPECT_EQ(store.Lookup(TestHash(3)), std::nullopt);
+        store.Add(TestHash(3), fp3);
+    }
+    FingerprintStore store(file);
+    EXPECT_EQ(store.Lookup(TestHash(1)), fp1);
+    EXPECT_EQ(store.Lookup(TestHash(2)), fp2);
+    EXPECT_EQ(store.Lookup(TestHash(3)), fp3);
+}
+
+TEST(TestFingerprint, SinkMatchesComputeFingerprint) {
+    TempDir d;
+    for (std::int64_t size :
+         {std::int64_t{0}, std::int64_t{100}, kFingerprintBytes,
+          kFingerprintBytes + 1, 2 * kFingerprintBytes - 1,
+          5 * kFingerprintBytes + 17}) {
+        std::string content(size, '\0');
+        for (std::int64_t i = 0; i < size; ++i) {
+            content[i] = static_cast<char>(i * 7 + i / 1000);
+        }
+        d.File("file", content);
+        for (int buffer_size : {1000, 100000}) {
+            FingerprintSink sink;
+            for (std::int64_t pos = 0; pos < size; pos += buffer_size) {
+                sink.AddBytes(std::as_bytes(std::span(content).subspan(
+                    pos, std::min<std::int64_t>(buffer_size, size - pos))));
+            }
+            EXPECT_EQ(sink.Finish(*CreateBlake3_256Hasher()),
+                      FingerprintOf(d.Path() / "file"))
+                << size << " " << buffer_size;
+        }
+    }
+}
+
+}  // namespace
+}  // namespace frz
@@ -16,26 +16,62 @@
 
 #include "frz_repository.hh"
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
 #include <absl/container/node_hash_map.h>
+#include <absl/synchronization/mutex.h>
+#include <cerrno>
+#include <cstddef>
+#include <ctime>
+#include <exception>
 #include <filesystem>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <system_error>
 #include <utility>
+#include <vector>
 
 #include "assert.hh"
+#include "base32.hh"
 #include "content_source.hh"
 #include "content_store.hh"
+#include "dir_snapshot.hh"
 #include "exceptions.hh"
 #include "file_stream.hh"
 #include "filesystem_util.hh"
+#include "fingerprint.hh"
 #include "hash_index.hh"
 #include "hasher.hh"
 #include "log.hh"
+#include "peer.hh"
+#include "read_order.hh"
+#include "repository_config.hh"
 #include "stream.hh"
+#include "sync_batch.hh"
+#include "worker.hh"
 
 namespace frz {
 namespace {
 
+// The number of content files that `repair --fast` probes concurrently. On
+// spinning disks, more outstanding requests let the I/O scheduler order the
+// seeks better; on SSDs, they keep the device's queues full.
+constexpr int kNumProbeThreads = 32;
+
+// In durable mode, the maximum number of newly stored content files to sync
+// in one go, and the number of them to sync concurrently.
+constexpr int kMaxCommitBatchSize = 1000;
+constexpr int kNumSyncThreads = 16;
+
+// The size of the read buffer used by each of the threads that hash content
+// files in `repair`.
+constexpr int kCheckBufferSize = 256 * 1024;
+
 bool IsFrzRootDirectory(const std::filesystem::directory_entry& dent) {
     return std::filesystem::is_directory(dent.symlink_status()) &&
            std::filesystem::is_directory(
@@ -46,16 +82,58 @@ bool IsFrzRootDirectory(const std::filesystem::path& dir) {
     return IsFrzRootDirectory(std::filesystem::directory_entry(dir));
 }
 
+// Group content sources into lanes by the device they're on, so that sources
+// on different devices can be read at the same time while sources on the
+// same device take turns. Return the indices of the sources in each lane, in
+// their original order. Each peer, and each source we can't stat, gets a
+// lane of its own.
+std::vector<std::vector<int>> GroupSourcesByDevice(
+    std::span<const Frz::ContentSource> sources) {
+    std::vector<std::vector<int>> lanes;
+    absl::flat_hash_map<dev_t, int> lane_by_device;
+    for (int i = 0; i < std::ssize(sources); ++i) {
+        struct stat st;
+        if (sources[i].peer.has_value() ||
+            stat(sources[i].path.c_str(), &st) != 0) {
+            lanes.push_back({i});
+            continue;
+        }
+        auto [it, inserted] =
+            lane_by_device.try_emplace(st.st_dev, std::ssize(lanes));
+        if (inserted) {
+            lanes.emplace_back();
+        }
+        lanes[it->second].push_back(i);
+    }
+    return lanes;
+}
+
+// Remove `dir` and every directory below it that doesn't contain any files.
+void RemoveEmptyDirs(const std::filesystem::path& dir) {
+    std::error_code error;
+    for (const auto& dent : std::filesystem::directory_iterator(dir, error)) {
+        if (dent.is_directory(error) && !dent.is_symlink(error)) {
+            RemoveEmptyDirs(dent.path());
+        }
+    }
+    std::filesystem::remove(dir, error);  // fails if not empty
+}
+
 class FrzRepository final {
   public:
     FrzRepository(const std::filesystem::path& path, Streamer& streamer,
                   std::function<std::unique_ptr<Hasher<256>>()> create_hasher,
                   std::string hash_name)
         : path_(path),
-          hash_index_(CreateDiskHashIndex(path / ".frz" / hash_name)),
-          content_store_(ContentStore::Create(path / ".frz" / "content")),
+          config_(RepositoryConfig::Load(path / ".frz" / "config")),
+          hash_index_(CreateDiskHashIndex(path / ".frz" / hash_name,
+                                          config_.index_layout,
+                                          config_.previous_index_layout)),
+          content_store_(CreateContentStore(path, config_)),
           unused_content_store_(
               ContentStore::Create(path / ".frz" / "unused-content")),
+          fingerprints_(path / ".frz" / (hash_name + "-fingerprints")),
+          content_batch_(path / ".frz" / "content", kNumSyncThreads),
           streamer_(streamer),
           create_hasher_(std::move(create_hasher)),
           hash_name_(std::move(hash_name)) {}
@@ -68,36 +146,138 @@ class FrzRepository final {
         }
         FRZ_ASSERT(std::filesystem::is_regular_file(
             std::filesystem::symlink_status(file)));
+        if (OnOtherFilesystem(file)) {
+            return AddFileByCopy(file);
+        }
         auto source = CreateFileSource(file);
         SizeHasher hasher(create_hasher_());
-        streamer_.Stream(*source, hasher);
+        FingerprintSink fingerprint;
+        TeeSink tee(hasher, fingerprint);
+        streamer_.Stream(*source, tee);
         HashAndSize<256> hs = hasher.Finish();
         const std::string base32 = hs.ToBase32();
+        if (config_.durable) {
+            return AddFileDurably(file, hs, fingerprint);
+        }
         const std::filesystem::path file2 = TempFilename(file, base32);
         std::filesystem::rename(file, file2);
         std::filesystem::create_symlink(SymlinkTarget(base32), file);
         const std::filesystem::path content_path =
-            content_store_->MoveInsert(file2, streamer_);
+            content_store_->MoveToHashedPath(
+                content_store_->MoveInsert(file2, streamer_), hs);
         const bool inserted = hash_index_->Insert(hs, content_path);
-        if (!inserted) {
+        if (inserted) {
+            RecordFingerprint(hs, content_path, &fingerprint);
+        } else {
             unused_content_store_->MoveInsert(content_path, streamer_);
         }
         return inserted ? Frz::AddResult::kNewFile
                         : Frz::AddResult::kDuplicateFile;
     }
 
+    // In durable mode, sync the content that has been stored since the last
+    // commit, and then create the index symlinks and user file symlinks that
+    // point to it.
+    void Commit() {
+        if (pending_index_entries_.empty() && pending_user_files_.empty()) {
+            return;
+        }
+        content_batch_.Sync();
+        for (const HashIndexEntry<256>& entry : pending_index_entries_) {
+            if (!hash_index_->Insert(entry.hs, entry.path)) {
+                // Someone else indexed the same content since we looked.
+                unused_content_store_->MoveInsert(entry.path, streamer_);
+            }
+        }
+        for (const PendingUserFile& f : pending_user_files_) {
+            const std::string base32 = f.hs.ToBase32();
+            if (f.duplicate) {
+                // We already have this content, so the user file just needs to
+                // be moved out of the way.
+                const std::filesystem::path file2 =
+                    TempFilename(f.file, base32);
+                std::filesystem::rename(f.file, file2);
+                std::filesystem::create_symlink(SymlinkTarget(base32), f.file);
+                unused_content_store_->MoveInsert(file2, streamer_);
+            } else {
+                // The content store has a hard link to (or a copy of) the
+                // user file, so we can just replace it.
+                ReplaceWithSymlink(f.file, base32);
+            }
+        }
+        pending_index_entries_.clear();
+        pending_hashes_.clear();
+        pending_user_files_.clear();
+    }
+
     Frz::FillResult Fill(Log& log,
                          std::vector<Frz::ContentSource> content_sources) {
-        auto r = FetchMissingContent(log, std::move(content_sources));
+        auto r = FetchMissingContent(log, std::move(content_sources),
+                                     /*worktree_tracker=*/nullptr);
+        Commit();
         return {.num_fetched = r.num_fetched,
                 .num_still_missing = r.num_still_missing};
     }
 
     Frz::RepairResult Repair(Log& log, bool verify_all_hashes,
+                             bool incremental, int num_check_threads,
                              std::vector<Frz::ContentSource> content_sources) {
-        auto r1 = CheckIndexSymlinks(log, verify_all_hashes);
-        auto r2 = CheckContentFiles(log, r1.indexed_content_files);
-        auto r3 = FetchMissingContent(log, std::move(content_sources));
+        // The snapshot describes the repository as it was during the last
+        // successful repair. Remove it before we change anything, so that if
+        // we fail, the next repair will be a full one.
+        const std::filesystem::path snapshot_path =
+            path_ / ".frz" / "repair-snapshot";
+        const std::optional<DirSnapshot> previous =
+            incremental ? DirSnapshot::Load(snapshot_path) : std::nullopt;
+        std::filesystem::remove(snapshot_path);
+        const DirSnapshot* const prev =
+            previous.has_value() ? &*previous : nullptr;
+        DirSnapshot next;
+
+        DirChangeTracker index_tracker(path_, prev, next);
+        auto r1 = CheckIndexSymlinks(log, verify_all_hashes, &index_tracker);
+
+        // If the index has lost entries, the content files they pointed to
+        // may need new index symlinks, and user files may be missing their
+        // content, even in directories that haven't changed; so we have to
+        // look at all of them.
+        const bool index_lost_entries =
+            r1.num_bad_index_symlinks > 0 || index_tracker.Shrunk();
+        bool checked_whole_index = prev == nullptr;
+        if (index_lost_entries && !checked_whole_index) {
+            // Content files are trusted to be indexed only if we saw their
+            // index symlinks, so we need to see all of them; otherwise,
+            // every file behind an unchanged index directory gets rehashed.
+            log.Info("The index has lost entries; checking all of it.");
+            auto r1_full = CheckIndexSymlinks(log, verify_all_hashes, nullptr);
+            r1_full.num_bad_index_symlinks += r1.num_bad_index_symlinks;
+            r1 = std::move(r1_full);
+            checked_whole_index = true;
+        }
+        DirChangeTracker content_tracker(
+            path_, index_lost_entries ? nullptr : prev, next);
+        auto r2 = CheckContentFiles(log, r1.indexed_content_files,
+                                    content_tracker, num_check_threads);
+        if (content_tracker.Shrunk() && !checked_whole_index) {
+            // Content files have been removed since the last repair, so
+            // index symlinks in directories we skipped may point to them.
+            // Check all of them.
+            log.Info(
+                "Content files have been removed; checking the whole index.");
+            auto r1_full = CheckIndexSymlinks(log, verify_all_hashes, nullptr);
+            r1.num_good_index_symlinks = r1_full.num_good_index_symlinks;
+            r1.num_bad_index_symlinks += r1_full.num_bad_index_symlinks;
+        }
+        DirChangeTracker worktree_tracker(
+            path_,
+            index_lost_entries || content_tracker.Shrunk() ? nullptr : prev,
+            next);
+        auto r3 = FetchMissingContent(log, std::move(content_sources),
+                                      &worktree_tracker);
+        Commit();
+        if (r3.num_still_missing == 0) {
+            next.Save(snapshot_path);
+        }
         return {.num_good_index_symlinks = r1.num_good_index_symlinks,
                 .num_bad_index_symlinks = r1.num_bad_index_symlinks,
                 .num_missing_index_symlinks = r2.num_missing_index_symlinks,
@@ -106,7 +286,409 @@ class FrzRepository final {
                 .num_still_missing = r3.num_still_missing};
     }
 
+    Frz::MigrateResult Migrate(Log& log, const Frz::MigrateOptions& options) {
+        Frz::MigrateResult result;
+        if (options.index_layout.has_value()) {
+            MigrateIndex(log, *options.index_layout, result);
+        }
+        if (options.change_content_layout) {
+            MigrateContent(log, options.content_layout, result);
+        }
+        return result;
+    }
+
+    Frz::TierResult Tier(Log& log) {
+        if (!config_.cold_min_size.has_value()) {
+            throw Error(
+                "The repository has no cold tier (set tier.cold-min-size in "
+                ".frz/config)");
+        }
+        const std::int64_t min_size = *config_.cold_min_size;
+        const std::time_t cutoff =
+            std::time(nullptr) -
+            std::time_t{config_.cold_min_idle_days} * 24 * 60 * 60;
+
+        // Content directories are about to change, so the snapshot is of no
+        // use.
+        std::filesystem::remove(path_ / ".frz" / "repair-snapshot");
+
+        // Each file is linked or copied to its new tier, and its index
+        // symlink is pointed there before the old file is removed, so the
+        // index never lacks an entry for it. In durable mode, the new file
+        // is synced first.
+        Frz::TierResult result;
+        SyncBatch batch(path_ / ".frz", /*num_threads=*/1);
+        auto progress = log.Progress("Moving content files between tiers");
+        auto file_counter = progress.AddCounter("files");
+        hash_index_->Scrub(log, [&](const HashAndSize<256>& hs,
+                                    const std::filesystem::path& content_path) {
+            file_counter.Increment(1);
+            struct stat st;
+            if (!content_store_->CanonicalPath(content_path).has_value() ||
+                ::lstat(content_path.c_str(), &st) != 0 ||
+                !S_ISREG(st.st_mode)) {
+                return true;  // Broken; leave it for repair.
+            }
+
+            // A content file's ctime is (roughly) when it was added to the
+            // content store. Its atime is of no use, since `repair --fast`
+            // reads the first byte of every content file.
+            ContentStore::Tier tier = content_store_->GetTier(content_path);
+            if (hs.GetSize() < min_size) {
+                tier = ContentStore::Tier::kHot;
+            } else if (st.st_ctime <= cutoff) {
+                tier = ContentStore::Tier::kCold;
+            }
+            std::filesystem::path new_path =
+                content_store_->LinkToTier(content_path, tier, streamer_);
+            if (new_path == content_path) {
+                return true;
+            }
+            if (tier == ContentStore::Tier::kHot) {
+                new_path = content_store_->MoveToHashedPath(new_path, hs);
+            }
+            if (!std::filesystem::equivalent(new_path, content_path)) {
+                // The tiers are on different filesystems, so this is a copy;
+                // make sure it's intact before we let go of the original.
+                SizeHasher hasher(create_hasher_());
+                streamer_.Stream(*CreateFileSource(new_path), hasher);
+                if (hasher.Finish() != hs) {
+                    log.Important("Copy of %s to %s is corrupt; not moving it",
+                                  content_path.string(), new_path.string());
+                    std::filesystem::remove(new_path);
+                    return true;
+                }
+            }
+            if (config_.durable) {
+                batch.Add(new_path);
+                batch.Sync();
+            }
+            hash_index_->Replace(hs, new_path);
+            std::filesystem::remove(content_path);
+            if (tier == ContentStore::Tier::kCold) {
+                ++result.num_moved_to_cold;
+            } else {
+                ++result.num_moved_to_hot;
+            }
+            return true;
+        });
+        return result;
+    }
+
+    void Serve(Log& log, const Frz::ServeOptions& options) {
+        auto lookup = [this](const HashAndSize<256>& hs) {
+            return hash_index_->Lookup(hs);
+        };
+        if (!options.socket.has_value()) {
+            ServePeer(options.read_fd, options.write_fd, lookup, streamer_);
+            return;
+        }
+        log.Important("Serving %s on %s", path_.string(),
+                      options.socket->string());
+        ListenForPeers(*options.socket, [&](int fd) {
+            // One misbehaving peer shouldn't stop us from serving the next.
+            try {
+                ServePeer(fd, fd, lookup, streamer_);
+            } catch (const Error& e) {
+                log.Important("When serving a peer: %s", e.what());
+            }
+        });
+    }
+
   private:
+    // Is `file` on another filesystem than the content store, so that it
+    // can't be hard linked into it?
+    bool OnOtherFilesystem(const std::filesystem::path& file) {
+        if (!content_device_.has_value()) {
+            struct stat st;
+            const std::filesystem::path content_dir = path_ / ".frz/content";
+            if (::stat(content_dir.c_str(), &st) == 0) {
+                content_device_ = st.st_dev;
+            } else if (errno == ENOENT) {
+                // Not created yet, so there's nothing to compare with.
+                return false;
+            } else {
+                ThrowErrno("cannot stat", content_dir);
+            }
+        }
+        struct stat st;
+        if (::lstat(file.c_str(), &st) != 0) {
+            ThrowErrno("cannot stat", file);
+        }
+        return st.st_dev != *content_device_;
+    }
+
+    // Like `AddFile`, for a file on another filesystem than the content
+    // store. Since the file has to be copied anyway, hash it while copying
+    // it, so that it's read only once.
+    Frz::AddResult AddFileByCopy(const std::filesystem::path& file) {
+        SizeHasher hasher(create_hasher_());
+        FingerprintSink fingerprint;
+        TeeSink hash_tee(hasher, fingerprint);
+        std::optional<HashAndSize<256>> hs;
+        const std::optional<std::filesystem::path> copy =
+            content_store_->StreamInsertHashed(
+                [&](StreamSink& sink) -> std::optional<HashAndSize<256>> {
+                    TeeSink tee(hash_tee, sink);
+                    streamer_.Stream(*CreateFileSource(file), tee);
+                    hs = hasher.Finish();
+
+                    // In durable mode, a duplicate's user file is moved to
+                    // the unused-content store at commit time, so we don't
+                    // need the copy.
+                    if (config_.durable && IsDuplicate(*hs)) {
+                        return std::nullopt;
+                    }
+                    return hs;
+                });
+        FRZ_ASSERT(hs.has_value());
+        if (config_.durable) {
+            return AddFileDurably(file, *hs, fingerprint, copy);
+        }
+        const std::filesystem::path content_path =
+            content_store_->MoveToHashedPath(*copy, *hs);
+        const bool inserted = hash_index_->Insert(*hs, content_path);
+        if (inserted) {
+            RecordFingerprint(*hs, content_path, &fingerprint);
+        } else {
+            unused_content_store_->MoveInsert(content_path, streamer_);
+        }
+        ReplaceWithSymlink(file, hs->ToBase32());
+        return inserted ? Frz::AddResult::kNewFile
+                        : Frz::AddResult::kDuplicateFile;
+    }
+
+    // Is the given content already indexed, or waiting to be?
+    bool IsDuplicate(const HashAndSize<256>& hs) const {
+        return pending_hashes_.contains(hs) || hash_index_->Contains(hs);
+    }
+
+    // The durable-mode version of `AddFile`. The user file is left alone for
+    // now, and the content store gets a hard link to it (or `copy`, if the
+    // caller has already copied it); then, once the content has been synced
+    // to disk, `Commit` indexes it and replaces the user file with a
+    // symlink. If we crash before that, the user file is still there, and
+    // `repair` will index the content file.
+    Frz::AddResult AddFileDurably(
+        const std::filesystem::path& file, const HashAndSize<256>& hs,
+        const FingerprintSink& fingerprint,
+        std::optional<std::filesystem::path> copy = std::nullopt) {
+        const bool duplicate = IsDuplicate(hs);
+        if (!duplicate) {
+            IndexNewContent(
+                hs,
+                content_store_->MoveToHashedPath(
+                    copy.has_value()
+                        ? *copy
+                        : content_store_->LinkInsert(file, streamer_),
+                    hs),
+                &fingerprint);
+        }
+        pending_user_files_.push_back(
+            {.file = file, .hs = hs, .duplicate = duplicate});
+        if (std::ssize(pending_user_files_) >= kMaxCommitBatchSize) {
+            Commit();
+        }
+        return duplicate ? Frz::AddResult::kDuplicateFile
+                         : Frz::AddResult::kNewFile;
+    }
+
+    // Index `content_path`, which we just put in the content store. In
+    // durable mode, this waits until the next commit; the caller should
+    // make sure that there is one. `fingerprint` is as for
+    // `RecordFingerprint`.
+    void IndexNewContent(const HashAndSize<256>& hs,
+                         const std::filesystem::path& content_path,
+                         const FingerprintSink* fingerprint = nullptr) {
+        RecordFingerprint(hs, content_path, fingerprint);
+        if (!config_.durable) {
+            const bool inserted = hash_index_->Insert(hs, content_path);
+            FRZ_ASSERT(inserted);
+            return;
+        }
+        content_batch_.Add(content_path);
+        pending_index_entries_.push_back({.hs = hs, .path = content_path});
+        pending_hashes_.insert(hs);
+        if (content_batch_.size() >= kMaxCommitBatchSize) {
+            Commit();
+        }
+    }
+
+    // Remember the fingerprint of `content_path`, which has hash+size `hs`,
+    // so that we can find the content more cheaply if it's ever lost. If
+    // `fingerprint` is non-null, it was fed the content as it was hashed,
+    // and the file needn't be read again. Fingerprints are only an
+    // optimization, so failing to record one isn't an error.
+    void RecordFingerprint(const HashAndSize<256>& hs,
+                           const std::filesystem::path& content_path,
+                           const FingerprintSink* fingerprint = nullptr) {
+        if (!NeedsFingerprint(hs)) {
+            return;
+        }
+        try {
+            fingerprints_.Add(
+                hs, fingerprint != nullptr
+                        ? fingerprint->Finish(*create_hasher_())
+                        : ComputeFingerprint(content_path, hs.GetSize(),
+                                             *create_hasher_()));
+        } catch (const Error&) {
+            // The content can still be found without it.
+        }
+    }
+
+    // Is the content with hash+size `hs` large enough to be fingerprinted,
+    // and we don't have its fingerprint yet?
+    bool NeedsFingerprint(const HashAndSize<256>& hs) {
+        if (hs.GetSize() < kMinFingerprintedSize) {
+            return false;
+        }
+        try {
+            return !fingerprints_.Lookup(hs).has_value();
+        } catch (const Error&) {
+            return false;  // we won't be able to record it anyway
+        }
+    }
+
+    // Hash the content file at `path`, which is indexed as `indexed_hs`. If
+    // it has that hash but no recorded fingerprint (as for content indexed
+    // before fingerprints were recorded), record its fingerprint, computed
+    // in the same pass.
+    HashAndSize<256> HashIndexedContentFile(const std::filesystem::path& path,
+                                            const HashAndSize<256>& indexed_hs) {
+        auto source = CreateFileSource(path);
+        SizeHasher hasher(create_hasher_());
+        if (!NeedsFingerprint(indexed_hs)) {
+            streamer_.Stream(*source, hasher);
+            return hasher.Finish();
+        }
+        FingerprintSink fingerprint;
+        TeeSink tee(hasher, fingerprint);
+        streamer_.Stream(*source, tee);
+        const HashAndSize<256> hs = hasher.Finish();
+        if (hs == indexed_hs) {
+            RecordFingerprint(hs, path, &fingerprint);
+        }
+        return hs;
+    }
+
+    // Atomically replace `file` with a symlink to the index entry for
+    // `base32`.
+    void ReplaceWithSymlink(const std::filesystem::path& file,
+                            std::string_view base32) {
+        const std::filesystem::path tmp = TempFilename(file, base32);
+        std::filesystem::create_symlink(SymlinkTarget(base32), tmp);
+        std::filesystem::rename(tmp, file);
+    }
+
+    void MigrateIndex(Log& log, SymlinkLayout index_layout,
+                      Frz::MigrateResult& result) {
+        if (!IsValidSymlinkLayout(index_layout)) {
+            throw Error(
+                "Unsupported index layout (%d levels of %d-digit "
+                "subdirectories)",
+                index_layout.subdirs, index_layout.subdir_digits);
+        }
+        if (config_.previous_index_layout.has_value()) {
+            if (config_.index_layout != index_layout) {
+                throw Error(
+                    "An unfinished index migration to %d levels of %d-digit "
+                    "subdirectories is in progress; finish it first",
+                    config_.index_layout.subdirs,
+                    config_.index_layout.subdir_digits);
+            }
+            log.Info("Resuming unfinished index migration.");
+        } else if (config_.index_layout == index_layout) {
+            log.Info("The index already has the requested layout.");
+            return;
+        } else {
+            // From now on, everyone creates index symlinks in the new layout,
+            // but looks for them in both.
+            RepositoryConfig config = config_;
+            config.previous_index_layout = config.index_layout;
+            config.index_layout = index_layout;
+            SetConfig(config);
+        }
+
+        // Every index directory is about to change, so the snapshot is of no
+        // use.
+        std::filesystem::remove(path_ / ".frz" / "repair-snapshot");
+
+        // Give every index symlink a twin in the new layout, then make the
+        // user files point to the twins, and only then remove the old index
+        // symlinks. That way, all user files remain valid the whole time.
+        const std::filesystem::path index_dir = path_ / ".frz" / hash_name_;
+        const SymlinkLayout old_layout = *config_.previous_index_layout;
+        {
+            auto progress = log.Progress("Creating index links in new layout");
+            result.num_index_symlinks = ConvertDiskHashIndexLayout(
+                index_dir, old_layout, index_layout, /*remove_old=*/false);
+        }
+        {
+            auto progress = log.Progress("Updating user file links");
+            auto symlink_counter = progress.AddCounter("links");
+            ReferencedContent referenced;
+            ListReferencedContent(referenced, symlink_counter,
+                                  /*tracker=*/nullptr, /*relink=*/true,
+                                  std::filesystem::directory_entry(path_), 0);
+            result.num_updated_symlinks = referenced.num_relinked;
+        }
+        {
+            auto progress = log.Progress("Removing index links in old layout");
+            ConvertDiskHashIndexLayout(index_dir, old_layout, index_layout,
+                                       /*remove_old=*/true);
+        }
+        RepositoryConfig config = config_;
+        config.previous_index_layout.reset();
+        SetConfig(config);
+    }
+
+    void MigrateContent(Log& log, std::optional<SymlinkLayout> content_layout,
+                        Frz::MigrateResult& result) {
+        if (content_layout.has_value() &&
+            !IsValidSymlinkLayout(*content_layout)) {
+            throw Error(
+                "Unsupported content layout (%d levels of %d-digit "
+                "subdirectories)",
+                content_layout->subdirs, content_layout->subdir_digits);
+        }
+        if (config_.content_layout != content_layout) {
+            RepositoryConfig config = config_;
+            config.content_layout = content_layout;
+            SetConfig(config);
+        }
+        if (!content_layout.has_value()) {
+            // Random names don't care where the files are, so there's nothing
+            // to move.
+            return;
+        }
+
+        // Content directories are about to change, so the snapshot is of no
+        // use.
+        std::filesystem::remove(path_ / ".frz" / "repair-snapshot");
+
+        // Move every indexed content file to its hashed path, and re-point
+        // its index entry right away, so that an interrupted migration leaves
+        // at most one entry dangling.
+        auto progress = log.Progress("Moving content files to hashed paths");
+        auto file_counter = progress.AddCounter("files");
+        hash_index_->Scrub(log, [&](const HashAndSize<256>& hs,
+                                    const std::filesystem::path& content_path) {
+            file_counter.Increment(1);
+            if (!content_store_->CanonicalPath(content_path).has_value() ||
+                !std::filesystem::is_regular_file(
+                    std::filesystem::symlink_status(content_path))) {
+                return true;  // Broken; leave it for repair.
+            }
+            const std::filesystem::path new_path =
+                content_store_->MoveToHashedPath(content_path, hs);
+            if (new_path != content_path) {
+                hash_index_->Replace(hs, new_path);
+                ++result.num_moved_content_files;
+            }
+            return true;
+        });
+    }
+
     void CreateHashdirSymlink(const std::filesystem::path& dir,
                               int subdir_levels) {
         FRZ_ASSERT(std::filesystem::is_directory(
@@ -146,13 +728,78 @@ class FrzRepository final {
     }
 
     std::filesystem::path SymlinkTarget(std::string_view base32) {
-        return std::filesystem::path(".frz") / hash_name_ / SymlinkPath(base32);
+        return std::filesystem::path(".frz") / hash_name_ /
+               SymlinkPath(base32, config_.index_layout);
+    }
+
+    // Replace the config, and recreate the index and content store to match
+    // it.
+    void SetConfig(const RepositoryConfig& config) {
+        config.Save(path_ / ".frz" / "config");
+        config_ = config;
+        hash_index_ =
+            CreateDiskHashIndex(path_ / ".frz" / hash_name_,
+                                config_.index_layout,
+                                config_.previous_index_layout);
+        content_store_ = CreateContentStore(path_, config_);
+    }
+
+    // Create the content store described by `config` for the repository at
+    // `path`.
+    static std::unique_ptr<ContentStore> CreateContentStore(
+        const std::filesystem::path& path, const RepositoryConfig& config) {
+        if (config.cold_min_size.has_value()) {
+            return ContentStore::CreateTiered(
+                path / ".frz", path / ".frz" / "content",
+                path / ".frz" / "cold-content", config.content_layout);
+        }
+        return ContentStore::Create(path / ".frz" / "content",
+                                    config.content_layout);
+    }
+
+    // What we found out about a content file without reading all of it.
+    struct ContentProbe {
+        bool is_regular_file = false;
+        std::uintmax_t file_size = 0;
+
+        // The number of bytes we managed to read from the start of the file
+        // (0 or 1), if we tried.
+        std::size_t num_first_bytes = 0;
+
+        // If opening or reading the file failed, the exception.
+        std::exception_ptr error;
+
+        // The hash of the file, if we computed it.
+        std::optional<HashAndSize<256>> hs;
+    };
+    static ContentProbe ProbeContentFile(const std::filesystem::path& path,
+                                         bool read_first_byte) {
+        ContentProbe probe;
+        std::filesystem::directory_entry dent(path);
+        probe.is_regular_file = dent.is_regular_file();
+        if (!probe.is_regular_file) {
+            return probe;
+        }
+        probe.file_size = dent.file_size();
+        if (read_first_byte) {
+            try {
+                auto source = CreateFileSource(path);
+                std::byte first_byte;
+                probe.num_first_bytes =
+                    FillBufferFromStream(*source, std::span(&first_byte, 1))
+                        .num_bytes;
+            } catch (const Error&) {
+                probe.error = std::current_exception();
+            }
+        }
+        return probe;
     }
 
     // Check all index symlinks in the frz repository, keeping the good ones
     // and removing the bad ones. If `verify_all_hashes` is true, recompute
     // content hashes; if false, trust that content files still have the
-    // correct hash.
+    // correct hash. If `tracker` is non-null, skip index directories that
+    // haven't changed since the last repair.
     struct CheckIndexSymlinksResult {
         // The number of index symlinks that point to good content. (We kept
         // these.)
@@ -167,13 +814,64 @@ class FrzRepository final {
         absl::flat_hash_set<std::string> indexed_content_files;
     };
     CheckIndexSymlinksResult CheckIndexSymlinks(Log& log,
-                                                bool verify_all_hashes) {
+                                                bool verify_all_hashes,
+                                                DirChangeTracker* tracker) {
         CheckIndexSymlinksResult result;
         auto progress = log.Progress("Checking index links and content files");
         auto symlink_counter = progress.AddCounter("links");
         auto content_file_counter = progress.AddCounter("files");
-        hash_index_->Scrub(log, [&](const HashAndSize<256>& hs,
-                                    const std::filesystem::path& content_path) {
+
+        // Unless we're going to hash everything anyway, probing each content
+        // file is dominated by waiting for the disk, so we probe a whole batch
+        // of them concurrently before checking them. If we are going to hash
+        // everything, we hash the whole batch up front instead, in the order
+        // the files are laid out on disk.
+        std::optional<WorkerPool> probe_pool;
+        if (!verify_all_hashes) {
+            probe_pool.emplace(kNumProbeThreads);
+        }
+        absl::flat_hash_map<std::string, ContentProbe> probes;
+        auto prefetch = [&](std::span<const HashIndexEntry<256>> entries) {
+            probes.clear();
+            if (verify_all_hashes) {
+                std::vector<std::filesystem::path> paths;
+                for (const HashIndexEntry<256>& entry : entries) {
+                    paths.push_back(entry.path);
+                }
+                for (std::size_t i : DiskReadOrder(paths)) {
+                    ContentProbe probe =
+                        ProbeContentFile(paths[i], /*read_first_byte=*/false);
+                    if (probe.is_regular_file &&
+                        std::cmp_equal(probe.file_size,
+                                       entries[i].hs.GetSize())) {
+                        try {
+                            probe.hs =
+                                HashIndexedContentFile(paths[i], entries[i].hs);
+                        } catch (const Error&) {
+                            probe.error = std::current_exception();
+                        }
+                    }
+                    probes.insert_or_assign(paths[i].native(),
+                                            std::move(probe));
+                }
+                return;
+            }
+            std::vector<ContentProbe> batch_probes(entries.size());
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                probe_pool->Do([&, i] {
+                    batch_probes[i] = ProbeContentFile(
+                        entries[i].path, /*read_first_byte=*/true);
+                });
+            }
+            probe_pool->Wait();
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                probes.insert_or_assign(entries[i].path.native(),
+                                        std::move(batch_probes[i]));
+            }
+        };
+
+        auto is_good = [&](const HashAndSize<256>& hs,
+                           const std::filesystem::path& content_path) {
             symlink_counter.Increment(1);
             std::optional<std::filesystem::path> canonical_content_path;
             try {
@@ -187,8 +885,15 @@ class FrzRepository final {
                     ++result.num_bad_index_symlinks;
                     return false;
                 }
-                std::filesystem::directory_entry dent(content_path);
-                if (!dent.is_regular_file()) {
+                ContentProbe probe;
+                if (auto it = probes.find(content_path.native());
+                    it != probes.end()) {
+                    probe = std::move(it->second);
+                } else {
+                    probe = ProbeContentFile(
+                        content_path, /*read_first_byte=*/!verify_all_hashes);
+                }
+                if (!probe.is_regular_file) {
                     log.Info(
                         "Removing %s from the index because it points to %s, "
                         "which doesn't exist or isn't regular file.",
@@ -196,21 +901,24 @@ class FrzRepository final {
                     ++result.num_bad_index_symlinks;
                     return false;
                 }
-                if (std::cmp_not_equal(dent.file_size(), hs.GetSize())) {
+                if (std::cmp_not_equal(probe.file_size, hs.GetSize())) {
                     log.Info(
                         "Removing %s from the index because it points to %s, "
                         "which has the wrong size (expected %d, actual %d).",
                         hs.ToBase32(), *canonical_content_path, hs.GetSize(),
-                        dent.file_size());
+                        probe.file_size);
                     ++result.num_bad_index_symlinks;
                     return false;
                 }
-                auto source = CreateFileSource(content_path);
-                content_file_counter.Increment(1);
                 if (verify_all_hashes) {
-                    SizeHasher hasher(create_hasher_());
-                    streamer_.Stream(*source, hasher);
-                    HashAndSize<256> actual_hs = hasher.Finish();
+                    if (probe.error) {
+                        std::rethrow_exception(probe.error);
+                    }
+                    content_file_counter.Increment(1);
+                    if (!probe.hs.has_value()) {
+                        probe.hs = HashIndexedContentFile(content_path, hs);
+                    }
+                    const HashAndSize<256> actual_hs = *probe.hs;
                     if (actual_hs != hs) {
                         log.Info(
                             "Removing %s from the index because it points to "
@@ -221,10 +929,11 @@ class FrzRepository final {
                         return false;
                     }
                 } else {
-                    std::byte first_byte;
-                    auto r = FillBufferFromStream(*source,
-                                                  std::span(&first_byte, 1));
-                    if (r.num_bytes == 0 && hs.GetSize() >= 1) {
+                    if (probe.error) {
+                        std::rethrow_exception(probe.error);
+                    }
+                    content_file_counter.Increment(1);
+                    if (probe.num_first_bytes == 0 && hs.GetSize() >= 1) {
                         log.Info(
                             "Removing %s from the index because it points to "
                             "%s; reading the first byte immediately hit "
@@ -233,7 +942,7 @@ class FrzRepository final {
                         ++result.num_bad_index_symlinks;
                         return false;
                     }
-                    if (r.num_bytes == 1 && hs.GetSize() < 1) {
+                    if (probe.num_first_bytes == 1 && hs.GetSize() < 1) {
                         log.Info(
                             "Removing %s from the index because it points to "
                             "%s; it's supposed to be an empty file, but "
@@ -255,14 +964,16 @@ class FrzRepository final {
             result.indexed_content_files.insert(
                 canonical_content_path->native());
             return true;  // Keep in index.
-        });
+        };
+        hash_index_->ScrubBatched(log, is_good, prefetch, tracker);
         return result;
     }
 
     // Check all content files in the frz repository, adding index symlinks for
     // content files that don't have them, and moving duplicate content files
     // to unused-content/. As an optimization, the files in
-    // `indexed_content_files` are trusted to have index symlinks.
+    // `indexed_content_files` are trusted to have index symlinks, and content
+    // directories that `tracker` says are unchanged are skipped.
     struct CheckContentFilesResult {
         // The number of content files that didn't have index symlinks. (Now
         // they do.)
@@ -275,38 +986,83 @@ class FrzRepository final {
     };
     CheckContentFilesResult CheckContentFiles(
         Log& log,
-        const absl::flat_hash_set<std::string>& indexed_content_files) {
+        const absl::flat_hash_set<std::string>& indexed_content_files,
+        DirChangeTracker& tracker, int num_threads) {
         CheckContentFilesResult result;
         auto progress = log.Progress("Checking orphaned content files");
         auto file_counter = progress.AddCounter("files");
         auto byte_counter = progress.AddCounter("bytes");
-        content_store_->ForEach([&](const std::filesystem::directory_entry&
-                                        dent,
-                                    const std::filesystem::path&
-                                        canonical_path) {
+
+        // The files are checked concurrently. Reading and hashing them is
+        // what takes time; everything else, including all changes to the
+        // index and the content stores (and logging), is done while holding
+        // this mutex.
+        absl::Mutex mutex;
+
+        // Files we've just moved to their hashed paths, and indexed. We may
+        // come across them again.
+        absl::flat_hash_set<std::string> placed_content_files;
+
+        // Decide which files need hashing while walking the store, so that
+        // those can then be read in the order they're laid out on disk.
+        auto select = [&](const std::filesystem::directory_entry& dent,
+                          const std::filesystem::path& canonical_path) {
             if (!IsReadonly(dent.status())) {
-                log.Info("Removing write permissions from %s.", canonical_path);
+                log.Info("Removing write permissions from %s.",
+                         canonical_path);
                 RemoveWritePermissions(dent);
             }
-            if (indexed_content_files.contains(canonical_path.native())) {
-                // We trust that this content file is already properly indexed.
-                return;
+            // We trust that indexed content files are properly indexed.
+            return !indexed_content_files.contains(canonical_path.native());
+        };
+
+        content_store_->ParallelForEach(select, [&](const std::filesystem::
+                                                        directory_entry& dent,
+                                                    const std::filesystem::path&
+                                                        canonical_path) {
+            {
+                absl::MutexLock ml(&mutex);
+                if (placed_content_files.contains(canonical_path.native())) {
+                    return;  // just indexed by us
+                }
             }
             auto source = CreateFileSource(dent);
             SizeHasher hasher(create_hasher_());
-            streamer_.Stream(*source, hasher, [&](int num_bytes) {
-                byte_counter.Increment(num_bytes);
-            });
+            FingerprintSink fingerprint;
+            TeeSink tee(hasher, fingerprint);
+            CreateSingleThreadedStreamer({.buffer_size = kCheckBufferSize})
+                ->Stream(*source, tee, [&](int num_bytes) {
+                    absl::MutexLock ml(&mutex);
+                    byte_counter.Increment(num_bytes);
+                });
             const HashAndSize<256> hs = hasher.Finish();
-            const bool inserted = hash_index_->Insert(hs, dent);
+
+            absl::MutexLock ml(&mutex);
+            if (IndexPointsTo(hs, canonical_path)) {
+                // The index symlink is in a directory we skipped because it
+                // hadn't changed.
+                file_counter.Increment(1);
+                return;
+            }
+
+            // Move the file to its hashed path (if the content store uses
+            // them) before indexing it, since the index can't be updated
+            // afterwards.
+            const std::filesystem::path content_path =
+                content_store_->MoveToHashedPath(dent.path(), hs);
+            const bool inserted = hash_index_->Insert(hs, content_path);
             if (inserted) {
+                RecordFingerprint(hs, content_path, &fingerprint);
+                const std::filesystem::path new_canonical_path =
+                    *content_store_->CanonicalPath(content_path);
                 log.Info(
                     "Adding %s to the index, pointing to %s (content was "
                     "already present, but not indexed).",
-                    hs.ToBase32(), canonical_path);
+                    hs.ToBase32(), new_canonical_path);
+                placed_content_files.insert(new_canonical_path.native());
                 ++result.num_missing_index_symlinks;
             } else {
-                unused_content_store_->MoveInsert(dent, streamer_);
+                unused_content_store_->MoveInsert(content_path, streamer_);
                 log.Info(
                     "Moving duplicate content file %s to unused-content/ (hash "
                     "%s).",
@@ -314,10 +1070,20 @@ class FrzRepository final {
                 ++result.num_duplicate_content_files;
             }
             file_counter.Increment(1);
-        });
+        }, &tracker, num_threads);
         return result;
     }
 
+    // Does the index entry for `hs` point to the content file with the given
+    // canonical path?
+    bool IndexPointsTo(const HashAndSize<256>& hs,
+                       const std::filesystem::path& canonical_path) const {
+        const std::optional<std::filesystem::path> indexed =
+            hash_index_->Lookup(hs);
+        return indexed.has_value() &&
+               content_store_->CanonicalPath(*indexed) == canonical_path;
+    }
+
     // Fetch any missing content for the frz repository. `move_sources` lists
     // directories that we may move files from, and `copy_sources` lists
     // directories that we may only copy files from.
@@ -329,11 +1095,31 @@ class FrzRepository final {
         std::int64_t num_still_missing = 0;
     };
     FetchMissingContentResult FetchMissingContent(
-        Log& log, std::vector<Frz::ContentSource> content_sources) {
-        FetchMissingContentResult result;
-        auto progress =
-            log.Progress("Checking that referenced content is present");
-        auto symlink_counter = progress.AddCounter("links");
+        Log& log, std::vector<Frz::ContentSource> content_sources,
+        DirChangeTracker* worktree_tracker) {
+        // First, collect the set of hashes referenced by the worktree, so
+        // that we can ask the index about all of them at once. This lets the
+        // index look them up in an order that's efficient for it, instead of
+        // in whatever order the worktree happens to list them.
+        ReferencedContent referenced;
+        {
+            auto progress =
+                log.Progress("Checking that referenced content is present");
+            auto symlink_counter = progress.AddCounter("links");
+            // While an index migration is in progress, the index symlinks in
+            // the new layout may not all exist yet, so leave user files alone.
+            ListReferencedContent(
+                referenced, symlink_counter, worktree_tracker,
+                /*relink=*/!config_.previous_index_layout.has_value(),
+                std::filesystem::directory_entry(path_), 0);
+        }
+        std::vector<HashAndSize<256>> hashes;
+        hashes.reserve(referenced.num_links.size());
+        for (const auto& [hs, num_links] : referenced.num_links) {
+            hashes.push_back(hs);
+        }
+        const std::vector<HashAndSize<256>> missing =
+            hash_index_->FindMissing(std::move(hashes));
 
         // Prefer .frs/unused-content to any sources specified by the user.
         std::filesystem::path unused_content_path =
@@ -341,40 +1127,345 @@ class FrzRepository final {
         if (std::filesystem::exists(unused_content_path)) {
             content_sources.insert(
                 content_sources.begin(),
-                {.path = unused_content_path, .read_only = false});
+                {.path = unused_content_path,
+                 .read_only = false,
+                 .cache_file = std::nullopt,
+                 .peer = std::nullopt});
+        }
+
+        // Sources on different devices are read concurrently (see
+        // `FetchConcurrently`), each lane with a streamer of its own.
+        const std::vector<std::vector<int>> lanes =
+            GroupSourcesByDevice(content_sources);
+        const bool concurrent = lanes.size() > 1;
+        std::vector<std::unique_ptr<Streamer>> lane_streamers;
+        std::vector<Streamer*> source_streamers(content_sources.size(),
+                                                &streamer_);
+        if (concurrent) {
+            for (const std::vector<int>& lane : lanes) {
+                lane_streamers.push_back(CreateSingleThreadedStreamer(
+                    {.buffer_size = kCheckBufferSize}));
+                for (int i : lane) {
+                    source_streamers[i] = lane_streamers.back().get();
+                }
+            }
         }
+
+        // Guards everything the sources share while they run concurrently.
+        absl::Mutex mutex;
+
         std::vector<std::unique_ptr<ContentSource<256>>> sources;
-        for (const auto& s : content_sources) {
+        for (std::size_t i = 0; i < content_sources.size(); ++i) {
+            const Frz::ContentSource& s = content_sources[i];
+            Streamer& streamer = *source_streamers[i];
+            if (s.peer.has_value()) {
+                sources.push_back(CreatePeerContentSource(
+                    PeerConnection::Connect(*s.peer), streamer,
+                    create_hasher_));
+                continue;
+            }
+            if (IsFrzRootDirectory(s.path) &&
+                std::filesystem::is_directory(s.path / ".frz" / hash_name_)) {
+                // Another repository; its index knows where everything is.
+                const RepositoryConfig config =
+                    RepositoryConfig::Load(s.path / ".frz" / "config");
+                sources.push_back(ContentSource<256>::CreateFromIndex(
+                    CreateDiskHashIndex(s.path / ".frz" / hash_name_,
+                                        config.index_layout,
+                                        config.previous_index_layout),
+                    s.read_only, streamer));
+                continue;
+            }
+            if (std::filesystem::is_regular_file(s.path)) {
+                // A tar archive, which we only ever read.
+                sources.push_back(ContentSource<256>::CreateFromTar(
+                    s.path, streamer, create_hasher_));
+                continue;
+            }
             sources.push_back(ContentSource<256>::Create(
-                s.path, s.read_only, streamer_, create_hasher_));
+                s.path, s.read_only, streamer, create_hasher_,
+                [this, &mutex](const HashAndSize<256>& hs) {
+                    absl::MutexLock ml(&mutex);
+                    return fingerprints_.Lookup(hs);
+                },
+                s.cache_file));
+        }
+
+        // Then, fetch the content that the index doesn't have. Each source
+        // is asked for everything that's still missing at once, so that it
+        // can plan a single pass over its files.
+        FetchMissingContentResult result;
+        std::int64_t num_missing_bytes = 0;
+        for (const HashAndSize<256>& hs : missing) {
+            num_missing_bytes += hs.GetSize();
+        }
+        auto progress = log.Progress("Fetching missing content");
+        auto file_counter =
+            progress.AddCounter("files", std::ssize(missing));
+        auto byte_counter = progress.AddCounter("bytes", num_missing_bytes);
+        absl::flat_hash_set<HashAndSize<256>> fetched;
+        auto mark_fetched = [&](const HashAndSize<256>& hs) {
+            const bool inserted = fetched.insert(hs).second;
+            FRZ_ASSERT(inserted);
+            file_counter.Increment(1);
+            byte_counter.Increment(hs.GetSize());
+        };
+        std::vector<HashAndSize<256>> wanted;
+        for (const HashAndSize<256>& hs : missing) {
+            if (const std::optional<std::filesystem::path> hashed_path =
+                    content_store_->HashedPath(hs);
+                hashed_path.has_value()) {
+                // The content may be right where it belongs, and just not
+                // indexed. But the file at the hashed path could also be
+                // anything, so make sure it has the right hash.
+                if (std::filesystem::is_regular_file(
+                        std::filesystem::symlink_status(*hashed_path))) {
+                    std::optional<HashAndSize<256>> actual_hs;
+                    FingerprintSink fingerprint;
+                    try {
+                        auto source = CreateFileSource(*hashed_path);
+                        SizeHasher hasher(create_hasher_());
+                        TeeSink tee(hasher, fingerprint);
+                        streamer_.Stream(*source, tee);
+                        actual_hs = hasher.Finish();
+                    } catch (const Error& e) {
+                        log.Important("When reading %s: %s", *hashed_path,
+                                      e.what());
+                    }
+                    if (actual_hs == hs) {
+                        log.Info("Found %s in the content store, but not the "
+                                 "index.",
+                                 hs.ToBase32());
+                        const bool inserted =
+                            hash_index_->Insert(hs, *hashed_path);
+                        FRZ_ASSERT(inserted);
+                        RecordFingerprint(hs, *hashed_path, &fingerprint);
+                        mark_fetched(hs);
+                        continue;
+                    }
+                    if (actual_hs.has_value()) {
+                        // Make room for the right content.
+                        log.Info("Moving %s to unused-content, since it "
+                                 "doesn't have the hash its path says.",
+                                 *hashed_path);
+                        unused_content_store_->MoveInsert(*hashed_path,
+                                                          streamer_);
+                    }
+                }
+            }
+            wanted.push_back(hs);
+        }
+        if (concurrent) {
+            if (!wanted.empty()) {
+                FetchConcurrently(log, sources, content_sources, lanes,
+                                  wanted, mutex, fetched, mark_fetched);
+                std::erase_if(wanted, [&](const HashAndSize<256>& hs) {
+                    return fetched.contains(hs);
+                });
+            }
+        } else {
+            for (const auto& s : sources) {
+                if (wanted.empty()) {
+                    break;
+                }
+                s->FetchMany(log, wanted, *content_store_,
+                             [&](const HashAndSize<256>& hs,
+                                 const std::filesystem::path& content_path) {
+                                 IndexNewContent(
+                                     hs, content_store_->MoveToHashedPath(
+                                             content_path, hs));
+                                 mark_fetched(hs);
+                             });
+                std::erase_if(wanted, [&](const HashAndSize<256>& hs) {
+                    return fetched.contains(hs);
+                });
+            }
+        }
+        result.num_fetched = std::ssize(fetched);
+        for (const HashAndSize<256>& hs : wanted) {
+            // Count every symlink that still lacks content.
+            result.num_still_missing += referenced.num_links.at(hs);
         }
-        FetchMissingContentDir(result, log, symlink_counter, sources,
-                               std::filesystem::directory_entry(path_), 0);
         return result;
     }
 
-    void FetchMissingContentDir(
-        FetchMissingContentResult& result, Log& log,
-        ProgressLogCounter& symlink_counter,
-        std::span<const std::unique_ptr<ContentSource<256>>> sources,
-        const std::filesystem::directory_entry& dir, const int subdir_levels) {
+    // Fetch `wanted` from `sources`, which are grouped in `lanes` (see
+    // `GroupSourcesByDevice`). The lanes run concurrently, each reading its
+    // sources one at a time and putting what they fetch in a staging store
+    // of its own; nothing a source fetches is asked of another source that
+    // starts later. Sources that come first in `sources` are preferred: a
+    // file is moved from staging to the content store only once every
+    // source before the one that fetched it has finished without fetching
+    // it, and copies that lose out are thrown away (or, if they were moved
+    // from their source, put in unused-content). Call `mark_fetched` for
+    // every file that's kept. `mutex` guards `fetched` and everything else
+    // in this repository.
+    void FetchConcurrently(
+        Log& log, std::span<const std::unique_ptr<ContentSource<256>>> sources,
+        std::span<const Frz::ContentSource> source_specs,
+        std::span<const std::vector<int>> lanes,
+        std::span<const HashAndSize<256>> wanted, absl::Mutex& mutex,
+        const absl::flat_hash_set<HashAndSize<256>>& fetched,
+        const std::function<void(const HashAndSize<256>& hs)>& mark_fetched) {
+        const std::filesystem::path staging_dir =
+            path_ / ".frz" / "content" / "fetching";
+
+        // Files that are waiting for more preferred sources to finish, and
+        // the source each of them came from.
+        struct Staged {
+            int source;
+            std::filesystem::path path;
+        };
+        absl::flat_hash_map<HashAndSize<256>, Staged> staged;
+
+        // The sources that have finished, and the first one that hasn't.
+        std::vector<bool> done(sources.size(), false);
+        int first_not_done = 0;
+
+        auto keep = [&](const HashAndSize<256>& hs,
+                        const std::filesystem::path& path) {
+            IndexNewContent(hs, content_store_->MoveToHashedPath(
+                                    content_store_->MoveInsert(path, streamer_),
+                                    hs));
+            mark_fetched(hs);
+        };
+        auto discard = [&](int source, const std::filesystem::path& path) {
+            if (source_specs[source].read_only) {
+                std::filesystem::remove(path);
+            } else {
+                unused_content_store_->MoveInsert(path, streamer_);
+            }
+        };
+        auto still_wanted = [&](int source, const HashAndSize<256>& hs) {
+            absl::MutexLock ml(&mutex);
+            auto it = staged.find(hs);
+            return !fetched.contains(hs) &&
+                   (it == staged.end() || it->second.source > source);
+        };
+        auto on_fetched = [&](int source, const HashAndSize<256>& hs,
+                              const std::filesystem::path& path) {
+            absl::MutexLock ml(&mutex);
+            auto it = staged.find(hs);
+            if (fetched.contains(hs) ||
+                (it != staged.end() && it->second.source < source)) {
+                // Someone we prefer beat us to it.
+                discard(source, path);
+            } else if (first_not_done < source) {
+                // Someone we prefer may still come up with it.
+                if (it != staged.end()) {
+                    discard(it->second.source, it->second.path);
+                    it->second = {.source = source, .path = path};
+                } else {
+                    staged.insert({hs, {.source = source, .path = path}});
+                }
+            } else {
+                if (it != staged.end()) {
+                    discard(it->second.source, it->second.path);
+                    staged.erase(it);
+                }
+                keep(hs, path);
+            }
+        };
+        auto on_done = [&](int source) {
+            absl::MutexLock ml(&mutex);
+            done[source] = true;
+            while (first_not_done < std::ssize(done) && done[first_not_done]) {
+                ++first_not_done;
+            }
+            for (auto it = staged.begin(); it != staged.end();) {
+                if (it->second.source <= first_not_done) {
+                    keep(it->first, it->second.path);
+                    staged.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+        };
+
+        WorkerPool pool(std::ssize(lanes));
+        for (std::size_t lane = 0; lane < lanes.size(); ++lane) {
+            pool.Do([&, lane] {
+                const std::unique_ptr<ContentStore> staging =
+                    ContentStore::Create(staging_dir / std::to_string(lane));
+                Log lane_log([&](std::string_view line) {
+                    absl::MutexLock ml(&mutex);
+                    log.Info(line);
+                });
+                for (int source : lanes[lane]) {
+                    std::vector<HashAndSize<256>> source_wanted;
+                    for (const HashAndSize<256>& hs : wanted) {
+                        if (still_wanted(source, hs)) {
+                            source_wanted.push_back(hs);
+                        }
+                    }
+                    if (!source_wanted.empty()) {
+                        sources[source]->FetchMany(
+                            lane_log, source_wanted, *staging,
+                            [&](const HashAndSize<256>& hs,
+                                const std::filesystem::path& path) {
+                                on_fetched(source, hs, path);
+                            },
+                            [&](const HashAndSize<256>& hs) {
+                                return still_wanted(source, hs);
+                            });
+                    }
+                    on_done(source);
+                }
+            });
+        }
+        pool.Wait();
+        FRZ_ASSERT(staged.empty());
+        RemoveEmptyDirs(staging_dir);
+    }
+
+    // Recursively list the content hashes referenced by our symlinks in `dir`,
+    // and count the number of symlinks for each of them. Create any missing
+    // .frz symlinks along the way, and if `relink` is true, update symlinks
+    // that point into an old index layout. If `tracker` is non-null, skip
+    // directories that haven't changed since the last repair.
+    struct ReferencedContent {
+        absl::flat_hash_map<HashAndSize<256>, std::int64_t> num_links;
+
+        // The number of symlinks we updated to the current index layout.
+        std::int64_t num_relinked = 0;
+    };
+    void ListReferencedContent(ReferencedContent& referenced,
+                               ProgressLogCounter& symlink_counter,
+                               DirChangeTracker* tracker, bool relink,
+                               const std::filesystem::directory_entry& dir,
+                               const int subdir_levels) {
         if (IsFrzRootDirectory(dir) && subdir_levels > 0) {
             // Ignore other repos.
             return;
         }
+        if (tracker != nullptr) {
+            if (auto subdirs = tracker->Unchanged(dir)) {
+                for (const std::filesystem::path& subdir : *subdirs) {
+                    ListReferencedContent(
+                        referenced, symlink_counter, tracker, relink,
+                        std::filesystem::directory_entry(subdir),
+                        subdir_levels + 1);
+                }
+                return;
+            }
+        }
         bool good_hashdir_symlink = false;
+        DirChangeTracker::Listing listing;
         for (const std::filesystem::directory_entry& dent :
              std::filesystem::directory_iterator(dir)) {
+            listing.Add(dent.path().filename().native());
             if (dent.path().filename() == ".frz") {
                 // Ignore our own .frz directory and our .frz symlinks.
             } else if (std::filesystem::is_directory(dent.symlink_status())) {
-                FetchMissingContentDir(result, log, symlink_counter, sources,
-                                       dent, subdir_levels + 1);
+                ListReferencedContent(referenced, symlink_counter, tracker,
+                                      relink, dent, subdir_levels + 1);
             } else if (dent.is_symlink()) {
                 // Try parsing the symlink target as a base-32 content hash; if
                 // this fails, it isn't one of our symlinks, so ignore it.
-                const std::optional<std::string> base32 = PathBase32(
-                    hash_name_, std::filesystem::read_symlink(dent.path()));
+                const std::filesystem::path target =
+                    std::filesystem::read_symlink(dent.path());
+                const std::optional<std::string> base32 =
+                    PathBase32(hash_name_, target);
                 if (!base32.has_value()) {
                     continue;
                 }
@@ -386,39 +1477,50 @@ class FrzRepository final {
 
                 // This is one of our symlinks!
                 symlink_counter.Increment(1);
+                ++referenced.num_links[*hs];
+                if (relink && target != SymlinkTarget(*base32)) {
+                    // Atomically replace it with a symlink that points into
+                    // the current index layout.
+                    ReplaceWithSymlink(dent.path(), *base32);
+                    ++referenced.num_relinked;
+                }
 
-                // Make sure that the .frz symlink exists in this directory...
+                // Make sure that the .frz symlink exists in this directory.
                 if (!good_hashdir_symlink) {
                     CreateHashdirSymlink(dir.path(), subdir_levels);
                     good_hashdir_symlink = true;
                 }
-
-                // ...and fetch the content if we don't already have it.
-                if (!hash_index_->Contains(*hs)) {
-                    bool fetched = false;
-                    for (const auto& s : sources) {
-                        const std::optional<std::filesystem::path>
-                            content_path = s->Fetch(log, *hs, *content_store_);
-                        if (content_path.has_value()) {
-                            fetched = hash_index_->Insert(*hs, *content_path);
-                            FRZ_ASSERT(fetched);
-                            break;
-                        }
-                    }
-                    if (fetched) {
-                        ++result.num_fetched;
-                    } else {
-                        ++result.num_still_missing;
-                    }
-                }
             }
         }
+        if (tracker != nullptr) {
+            tracker->Listed(dir.path(), listing);
+        }
     }
 
     const std::filesystem::path path_;
-    const std::unique_ptr<HashIndex<256>> hash_index_;
-    const std::unique_ptr<ContentStore> content_store_;
+    RepositoryConfig config_;
+    std::unique_ptr<HashIndex<256>> hash_index_;
+    std::unique_ptr<ContentStore> content_store_;
     const std::unique_ptr<ContentStore> unused_content_store_;
+
+    // The fingerprints of large content files, recorded as they're indexed.
+    FingerprintStore fingerprints_;
+
+    // The st_dev of the content store directory, once it exists.
+    std::optional<dev_t> content_device_;
+
+    // In durable mode, the content files we've stored but not yet committed,
+    // and the index entries and user files that are waiting for them.
+    SyncBatch content_batch_;
+    std::vector<HashIndexEntry<256>> pending_index_entries_;
+    absl::flat_hash_set<HashAndSize<256>> pending_hashes_;
+    struct PendingUserFile {
+        std::filesystem::path file;
+        HashAndSize<256> hs;
+        bool duplicate;  // content is already indexed, or pending
+    };
+    std::vector<PendingUserFile> pending_user_files_;
+
     Streamer& streamer_;
     const std::function<std::unique_ptr<Hasher<256>>()> create_hasher_;
     const std::string hash_name_;
@@ -446,11 +1548,35 @@ class FrzRepositoryCache final : public Frz {
     }
 
     RepairResult Repair(Log& log, const std::filesystem::path& path,
-                        bool verify_all_hashes,
+                        bool verify_all_hashes, bool incremental,
+                        int num_check_threads,
                         std::vector<ContentSource> content_sources) override {
         const FrzRepositoryRef& f = GetFrzRootDirectory(path);
-        return f.repo->Repair(log, verify_all_hashes,
-                              std::move(content_sources));
+        return f.repo->Repair(log, verify_all_hashes, incremental,
+                              num_check_threads, std::move(content_sources));
+    }
+
+    MigrateResult Migrate(Log& log, const std::filesystem::path& path,
+                          const MigrateOptions& options) override {
+        const FrzRepositoryRef& f = GetFrzRootDirectory(path);
+        return f.repo->Migrate(log, options);
+    }
+
+    TierResult Tier(Log& log, const std::filesystem::path& path) override {
+        const FrzRepositoryRef& f = GetFrzRootDirectory(path);
+        return f.repo->Tier(log);
+    }
+
+    void Serve(Log& log, const std::filesystem::path& path,
+               const ServeOptions& options) override {
+        const FrzRepositoryRef& f = GetFrzRootDirectory(path);
+        f.repo->Serve(log, options);
+    }
+
+    void Commit() override {
+        for (auto& [path, f] : repos_) {
+            f.repo->Commit();
+        }
     }
 
   private:
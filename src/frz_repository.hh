@@ -17,11 +17,15 @@
 #ifndef FRZ_REPOSITORY_HH_
 #define FRZ_REPOSITORY_HH_
 
+#include <cstdint>
 #include <filesystem>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 
+#include "base32.hh"
 #include "hasher.hh"
 #include "log.hh"
 #include "stream.hh"
@@ -36,6 +40,15 @@ class Frz {
     struct ContentSource {
         std::filesystem::path path;
         bool read_only;
+
+        // If set, remember the source's file listing and hashes in this
+        // file, so that the next fill from the same source is faster. Only
+        // used for read-only sources.
+        std::optional<std::filesystem::path> cache_file;
+
+        // If set, fetch from the `frz serve` peer at this address (see
+        // `PeerConnection::Connect`) instead of from `path`.
+        std::optional<std::string> peer;
     };
 
     static std::unique_ptr<Frz> Create(
@@ -56,6 +69,13 @@ class Frz {
     };
     virtual AddResult AddFile(const std::filesystem::path& file) = 0;
 
+    // If the repository is in durable mode (see `RepositoryConfig`), `AddFile`
+    // only stores the content, and leaves the file itself alone until the
+    // content has been synced to disk together with that of many other files.
+    // Call this function after the last `AddFile` to finish the job.
+    // (`Fill` and `Repair` commit on their own before returning.)
+    virtual void Commit() = 0;
+
     // Identify and attempt to fill missing content in the frz repository that
     // owns `path`. `content_sources` lists directories that we may copy or
     // move files from.
@@ -71,7 +91,10 @@ class Frz {
 
     // Fix problems with the frz repository that owns `path`. In case content
     // is missing, `content_sources` lists directories that we may copy or move
-    // files from.
+    // files from. If `incremental` is true, only look at directories that
+    // have changed since the last successful repair. Up to
+    // `num_check_threads` content files without index symlinks are hashed
+    // concurrently.
     struct RepairResult {
         // The number of index symlinks that point to good content. (We kept
         // these.)
@@ -97,8 +120,63 @@ class Frz {
         std::int64_t num_still_missing = 0;
     };
     virtual RepairResult Repair(Log& log, const std::filesystem::path& path,
-                                bool verify_all_hashes,
+                                bool verify_all_hashes, bool incremental,
+                                int num_check_threads,
                                 std::vector<ContentSource> content_sources) = 0;
+
+    // Change the on-disk layout of the frz repository that owns `path`. If
+    // `index_layout` is set, convert the index to that layout, and update all
+    // user files to point into the new layout. If `change_content_layout` is
+    // set, switch the content store to hash-derived paths with the fan-out
+    // given by `content_layout` (and move existing content files there), or
+    // to random paths if `content_layout` is nullopt. The repository remains
+    // usable throughout, and if the conversion is interrupted, calling this
+    // function again with the same options resumes it.
+    struct MigrateOptions {
+        std::optional<SymlinkLayout> index_layout;
+        bool change_content_layout = false;
+        std::optional<SymlinkLayout> content_layout;
+    };
+    struct MigrateResult {
+        // The number of index symlinks converted to the new layout.
+        std::int64_t num_index_symlinks = 0;
+
+        // The number of user file symlinks that were updated to point into
+        // the new layout.
+        std::int64_t num_updated_symlinks = 0;
+
+        // The number of content files moved to their hashed paths.
+        std::int64_t num_moved_content_files = 0;
+    };
+    virtual MigrateResult Migrate(Log& log, const std::filesystem::path& path,
+                                  const MigrateOptions& options) = 0;
+
+    // Move content files of the frz repository that owns `path` between its
+    // hot and cold tiers: files that are large enough and haven't been added
+    // recently go to the cold tier, and files that are now too small to be
+    // there go back to the hot tier. Throw an Error if the repository isn't
+    // configured with a cold tier.
+    struct TierResult {
+        // The number of content files moved to the cold tier.
+        std::int64_t num_moved_to_cold = 0;
+
+        // The number of content files moved back to the hot tier.
+        std::int64_t num_moved_to_hot = 0;
+    };
+    virtual TierResult Tier(Log& log, const std::filesystem::path& path) = 0;
+
+    // Serve the index and content of the frz repository that owns `path` to
+    // peers (see peer.hh). If `socket` is set, listen on a Unix socket there
+    // and serve one peer at a time, until killed. Otherwise, serve the single
+    // peer that sends requests to `read_fd` and reads answers from
+    // `write_fd`, until it hangs up.
+    struct ServeOptions {
+        std::optional<std::filesystem::path> socket;
+        int read_fd = 0;
+        int write_fd = 1;
+    };
+    virtual void Serve(Log& log, const std::filesystem::path& path,
+                       const ServeOptions& options) = 0;
 };
 
 }  // namespace frz
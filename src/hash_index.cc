@@ -16,15 +16,32 @@
 
 #include "hash_index.hh"
 
+#include <absl/base/optimization.h>
+#include <absl/base/thread_annotations.h>
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/strings/str_cat.h>
+#include <absl/synchronization/mutex.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <filesystem>
 #include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <system_error>
+#include <utility>
+#include <vector>
 
+#include "assert.hh"
 #include "base32.hh"
+#include "dir_snapshot.hh"
 #include "exceptions.hh"
 #include "hash.hh"
 #include "log.hh"
+#include "worker.hh"
 
 namespace frz {
 namespace {
@@ -38,10 +55,24 @@ class RamHashIndex final : public HashIndex<HashBits> {
         return inserted;
     }
 
+    void Replace(const HashAndSize<HashBits>& hs,
+                 const std::filesystem::path& path) override {
+        index_.insert_or_assign(hs, path);
+    }
+
     bool Contains(const HashAndSize<HashBits>& hs) const override {
         return index_.contains(hs);
     }
 
+    std::optional<std::filesystem::path> Lookup(
+        const HashAndSize<HashBits>& hs) const override {
+        auto it = index_.find(hs);
+        if (it == index_.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
     void Scrub(Log& /*log*/,
                std::function<bool(const HashAndSize<HashBits>& hs,
                                   const std::filesystem::path& path)>
@@ -56,6 +87,98 @@ class RamHashIndex final : public HashIndex<HashBits> {
     absl::flat_hash_map<HashAndSize<HashBits>, std::filesystem::path> index_;
 };
 
+// Like RamHashIndex, but split into shards that are locked independently, so
+// that concurrent callers only contend if they happen to touch the same shard.
+// Keys are assigned to shards by the first byte of their hash, which is
+// uniformly distributed.
+template <int HashBits>
+class ConcurrentRamHashIndex final : public HashIndex<HashBits> {
+  public:
+    explicit ConcurrentRamHashIndex(int num_scrub_threads)
+        : num_scrub_threads_(num_scrub_threads) {}
+
+    bool Insert(const HashAndSize<HashBits>& hs,
+                const std::filesystem::path& path) override {
+        Shard& shard = GetShard(hs);
+        absl::MutexLock ml(&shard.mutex);
+        auto [iter, inserted] = shard.index.try_emplace(hs, path);
+        return inserted;
+    }
+
+    void Replace(const HashAndSize<HashBits>& hs,
+                 const std::filesystem::path& path) override {
+        Shard& shard = GetShard(hs);
+        absl::MutexLock ml(&shard.mutex);
+        shard.index.insert_or_assign(hs, path);
+    }
+
+    bool Contains(const HashAndSize<HashBits>& hs) const override {
+        const Shard& shard = GetShard(hs);
+        absl::ReaderMutexLock ml(&shard.mutex);
+        return shard.index.contains(hs);
+    }
+
+    std::optional<std::filesystem::path> Lookup(
+        const HashAndSize<HashBits>& hs) const override {
+        const Shard& shard = GetShard(hs);
+        absl::ReaderMutexLock ml(&shard.mutex);
+        auto it = shard.index.find(hs);
+        if (it == shard.index.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void Scrub(Log& /*log*/,
+               std::function<bool(const HashAndSize<HashBits>& hs,
+                                  const std::filesystem::path& path)>
+                   is_good) override {
+        WorkerPool pool(num_scrub_threads_);
+        for (Shard& shard : shards_) {
+            pool.Do([&] {
+                // Call `is_good` without holding the lock, since it may use
+                // the index itself.
+                std::vector<std::pair<HashAndSize<HashBits>,
+                                      std::filesystem::path>>
+                    entries;
+                {
+                    absl::ReaderMutexLock ml(&shard.mutex);
+                    entries.assign(shard.index.begin(), shard.index.end());
+                }
+                std::erase_if(entries, [&](const auto& entry) {
+                    return is_good(entry.first, entry.second);
+                });
+                absl::MutexLock ml(&shard.mutex);
+                for (const auto& [key, value] : entries) {
+                    // Leave entries alone that were replaced meanwhile.
+                    if (auto it = shard.index.find(key);
+                        it != shard.index.end() && it->second == value) {
+                        shard.index.erase(it);
+                    }
+                }
+            });
+        }
+        pool.Wait();
+    }
+
+  private:
+    struct alignas(ABSL_CACHELINE_SIZE) Shard {
+        mutable absl::Mutex mutex;
+        absl::flat_hash_map<HashAndSize<HashBits>, std::filesystem::path> index
+            ABSL_GUARDED_BY(mutex);
+    };
+
+    Shard& GetShard(const HashAndSize<HashBits>& hs) {
+        return shards_[std::to_integer<std::size_t>(hs.GetHash().Bytes()[0])];
+    }
+    const Shard& GetShard(const HashAndSize<HashBits>& hs) const {
+        return shards_[std::to_integer<std::size_t>(hs.GetHash().Bytes()[0])];
+    }
+
+    const int num_scrub_threads_;
+    std::array<Shard, 256> shards_;
+};
+
 // Return a copy of the argument.
 template <typename T>
 T Copy(const T& x) {
@@ -65,51 +188,300 @@ T Copy(const T& x) {
 template <int HashBits>
 class DiskHashIndex final : public HashIndex<HashBits> {
   public:
-    DiskHashIndex(const std::filesystem::path& index_dir)
-        : index_dir_(index_dir) {}
+    // New symlinks are created in `layouts[0]`, but symlinks in any of the
+    // given layouts are recognized.
+    DiskHashIndex(const std::filesystem::path& index_dir,
+                  std::vector<SymlinkLayout> layouts)
+        : index_dir_(index_dir), layouts_(std::move(layouts)) {
+        FRZ_ASSERT(!layouts_.empty());
+    }
 
     bool Insert(const HashAndSize<HashBits>& hs,
                 const std::filesystem::path& path) override try {
-        std::filesystem::directory_entry symlink(index_dir_ /
-                                                 SymlinkPath(hs.ToBase32()));
-        if (symlink.is_symlink()) {
+        if (FindSymlink(hs).has_value()) {
             return false;
-        } else if (symlink.exists()) {
-            throw Error("%s exists but is not a symlink", symlink.path());
         }
+        const std::filesystem::path symlink =
+            index_dir_ / SymlinkPath(hs.ToBase32(), layouts_[0]);
         const std::filesystem::path symlink_dir =
-            Copy(symlink.path()).remove_filename();
-        std::filesystem::create_directories(symlink_dir);
+            Copy(symlink).remove_filename();
         const std::filesystem::path symlink_target =
             path.lexically_normal().lexically_proximate(
                 symlink_dir.lexically_normal());
-        std::filesystem::create_symlink(symlink_target, symlink.path());
+        std::error_code error;
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            // If a layout conversion removes the directory just after we
+            // created it, we try again.
+            std::filesystem::create_directories(symlink_dir);
+            std::filesystem::create_symlink(symlink_target, symlink, error);
+            if (error != std::errc::no_such_file_or_directory) {
+                break;
+            }
+        }
+        if (error == std::errc::file_exists) {
+            // Another thread or process inserted the same hash after we
+            // checked. First writer wins.
+            return false;
+        } else if (error) {
+            throw std::filesystem::filesystem_error("cannot create symlink",
+                                                    symlink, error);
+        }
         return true;
     } catch (const std::filesystem::filesystem_error& e) {
         throw Error(e.what());
     }
 
+    void Replace(const HashAndSize<HashBits>& hs,
+                 const std::filesystem::path& path) override try {
+        const std::optional<std::filesystem::path> symlink = FindSymlink(hs);
+        if (!symlink.has_value()) {
+            Insert(hs, path);
+            return;
+        }
+
+        // Create the new symlink next to the old one, and rename it over the
+        // old one. The temporary name isn't a hash, so if we crash in
+        // between, the next scrub removes it.
+        std::filesystem::path tmp = *symlink;
+        tmp += "~";
+        std::filesystem::remove(tmp);
+        std::filesystem::create_symlink(
+            path.lexically_normal().lexically_proximate(
+                symlink->parent_path().lexically_normal()),
+            tmp);
+        std::filesystem::rename(tmp, *symlink);
+    } catch (const std::filesystem::filesystem_error& e) {
+        throw Error(e.what());
+    }
+
     bool Contains(const HashAndSize<HashBits>& hs) const override try {
-        std::filesystem::directory_entry symlink(index_dir_ /
-                                                 SymlinkPath(hs.ToBase32()));
-        if (symlink.is_symlink()) {
-            return true;
-        } else if (symlink.exists()) {
-            throw Error("%s exists but is not a symlink", symlink.path());
-        } else {
-            return false;
+        return FindSymlink(hs).has_value();
+    } catch (const std::filesystem::filesystem_error& e) {
+        throw Error(e.what());
+    }
+
+    std::optional<std::filesystem::path> Lookup(
+        const HashAndSize<HashBits>& hs) const override try {
+        const std::optional<std::filesystem::path> symlink = FindSymlink(hs);
+        if (!symlink.has_value()) {
+            return std::nullopt;
         }
+        return symlink->parent_path() / std::filesystem::read_symlink(*symlink);
+    } catch (const std::filesystem::filesystem_error& e) {
+        throw Error(e.what());
+    }
+
+    std::vector<HashAndSize<HashBits>> FindMissing(
+        std::vector<HashAndSize<HashBits>> hashes) const override try {
+        for (const SymlinkLayout& layout : layouts_) {
+            hashes = FindMissingInLayout(std::move(hashes), layout);
+        }
+        return hashes;
     } catch (const std::filesystem::filesystem_error& e) {
         throw Error(e.what());
     }
 
     void Scrub(Log& log, std::function<bool(const HashAndSize<HashBits>& hs,
                                             const std::filesystem::path& path)>
-                             is_good) override try {
+                             is_good) override {
+        ScrubIndex(log, is_good, nullptr, nullptr);
+    }
+
+    void ScrubChanged(Log& log,
+                      std::function<bool(const HashAndSize<HashBits>& hs,
+                                         const std::filesystem::path& path)>
+                          is_good,
+                      DirChangeTracker& tracker) override {
+        ScrubIndex(log, is_good, nullptr, &tracker);
+    }
+
+    void ScrubBatched(
+        Log& log,
+        std::function<bool(const HashAndSize<HashBits>& hs,
+                           const std::filesystem::path& path)>
+            is_good,
+        std::function<void(std::span<const HashIndexEntry<HashBits>> entries)>
+            prefetch,
+        DirChangeTracker* tracker) override {
+        ScrubIndex(log, is_good, prefetch, tracker);
+    }
+
+  private:
+    // Is `path` a symlink? Throw if it exists but isn't a symlink.
+    static bool IsSymlink(const std::filesystem::path& path) {
+        std::filesystem::directory_entry dent(path);
+        if (dent.is_symlink()) {
+            return true;
+        } else if (dent.exists()) {
+            throw Error("%s exists but is not a symlink", path);
+        } else {
+            return false;
+        }
+    }
+
+    // Return the path of the symlink for `hs`, in whichever layout it's
+    // found, or nullopt if there is none.
+    std::optional<std::filesystem::path> FindSymlink(
+        const HashAndSize<HashBits>& hs) const {
+        const std::string base32 = hs.ToBase32();
+        for (const SymlinkLayout& layout : layouts_) {
+            std::filesystem::path symlink =
+                index_dir_ / SymlinkPath(base32, layout);
+            if (IsSymlink(symlink)) {
+                return symlink;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Return the hashes in `hashes` that have no symlink in the given layout,
+    // sorted by hash.
+    std::vector<HashAndSize<HashBits>> FindMissingInLayout(
+        std::vector<HashAndSize<HashBits>> hashes,
+        const SymlinkLayout& layout) const {
+        // Sort the hashes so that all hashes that live in the same leaf
+        // directory end up next to each other, and the directories are
+        // visited in order. Since the base-32 digits are just the hash bits in
+        // order, sorting by hash bytes is the same as sorting by symlink path.
+        std::ranges::sort(hashes, [](const HashAndSize<HashBits>& a,
+                                     const HashAndSize<HashBits>& b) {
+            return std::ranges::lexicographical_compare(a.GetHash().Bytes(),
+                                                        b.GetHash().Bytes());
+        });
+        std::vector<HashAndSize<HashBits>> missing;
+        std::vector<std::string> names;
+        for (auto group_begin = hashes.begin(); group_begin != hashes.end();) {
+            // Find all hashes whose symlinks live in the same leaf directory
+            // as `*group_begin`.
+            names.clear();
+            std::filesystem::path dir;
+            auto group_end = group_begin;
+            for (; group_end != hashes.end(); ++group_end) {
+                const std::filesystem::path p =
+                    SymlinkPath(group_end->ToBase32(), layout);
+                if (group_end == group_begin) {
+                    dir = index_dir_ / p.parent_path();
+                } else if (index_dir_ / p.parent_path() != dir) {
+                    break;
+                }
+                names.push_back(p.filename());
+            }
+            const auto group = std::span(group_begin, group_end);
+            if (!WorthListing(dir, group.size())) {
+                for (std::size_t i = 0; i < group.size(); ++i) {
+                    if (!IsSymlink(dir / names[i])) {
+                        missing.push_back(group[i]);
+                    }
+                }
+            } else {
+                // Read the whole directory once, instead of looking up the
+                // symlinks one at a time.
+                const absl::flat_hash_set<std::string> present =
+                    ListSymlinks(dir, names);
+                for (std::size_t i = 0; i < group.size(); ++i) {
+                    if (!present.contains(names[i])) {
+                        missing.push_back(group[i]);
+                    }
+                }
+            }
+            group_begin = group_end;
+        }
+        return missing;
+    }
+
+    // Should FindMissing() list `dir` instead of looking up each of the
+    // `num_wanted` symlinks in it individually? Measured with a warm cache on
+    // ext4 and tmpfs, listing a directory costs about as much as three
+    // lookups, plus half a lookup per entry, so it only pays off for groups
+    // that are large compared to the directory. We estimate the number of
+    // entries from the directory's size, assuming entries as small as
+    // tmpfs's (20 bytes); other filesystems report more bytes per entry, so
+    // we err on the side of lookups.
+    static bool WorthListing(const std::filesystem::path& dir,
+                             std::size_t num_wanted) {
+        constexpr std::size_t kFixedCost = 4;  // including our `stat`
+        constexpr std::int64_t kMinBytesPerEntry = 20;
+        if (num_wanted <= kFixedCost) {
+            return false;
+        }
+        struct stat st;
+        if (stat(dir.c_str(), &st) != 0) {
+            return false;  // the lookups will fail quickly
+        }
+        const std::int64_t num_entries = st.st_size / kMinBytesPerEntry;
+        return 2 * static_cast<std::int64_t>(num_wanted - kFixedCost) >=
+               num_entries;
+    }
+
+    // Return the subset of `wanted_names` that are symlinks in `dir`. Throw if
+    // one of them exists but isn't a symlink.
+    absl::flat_hash_set<std::string> ListSymlinks(
+        const std::filesystem::path& dir,
+        std::span<const std::string> wanted_names) const {
+        absl::flat_hash_set<std::string> wanted(wanted_names.begin(),
+                                                wanted_names.end());
+        absl::flat_hash_set<std::string> present;
+        std::error_code error;
+        std::filesystem::directory_iterator it(dir, error);
+        if (error == std::errc::no_such_file_or_directory) {
+            return present;
+        } else if (error) {
+            throw std::filesystem::filesystem_error("cannot list directory",
+                                                    dir, error);
+        }
+        for (const std::filesystem::directory_entry& dent : it) {
+            std::string name = dent.path().filename();
+            if (!wanted.contains(name)) {
+                continue;
+            } else if (dent.is_symlink()) {
+                present.insert(std::move(name));
+            } else {
+                throw Error("%s exists but is not a symlink", dent.path());
+            }
+        }
+        return present;
+    }
+
+    // Symlinks are checked in batches of this size, so that `prefetch` gets
+    // enough work to do in parallel, and enough files to read in a sensible
+    // order. Entries from several small directories are collected in the same
+    // batch.
+    static constexpr std::size_t kScrubBatchSize = 4096;
+
+    // State shared by all directories visited by a single scrub.
+    struct ScrubState {
+        Log& log;
+        std::function<bool(const HashAndSize<HashBits>& hs,
+                           const std::filesystem::path& path)>
+            is_good;
+        std::function<void(std::span<const HashIndexEntry<HashBits>> entries)>
+            prefetch;
+        DirChangeTracker* tracker;
+
+        // Symlinks that are waiting to be checked, and their paths.
+        std::vector<HashIndexEntry<HashBits>> batch;
+        std::vector<std::filesystem::path> batch_symlinks;
+    };
+
+    void ScrubIndex(Log& log,
+                    std::function<bool(const HashAndSize<HashBits>& hs,
+                                       const std::filesystem::path& path)>
+                        is_good,
+                    std::function<void(
+                        std::span<const HashIndexEntry<HashBits>> entries)>
+                        prefetch,
+                    DirChangeTracker* tracker) try {
         std::filesystem::file_status stat =
             std::filesystem::symlink_status(index_dir_);
         if (std::filesystem::is_directory(stat)) {
-            ScrubDir(log, is_good, index_dir_, "");
+            ScrubState state = {.log = log,
+                                .is_good = std::move(is_good),
+                                .prefetch = std::move(prefetch),
+                                .tracker = tracker,
+                                .batch = {},
+                                .batch_symlinks = {}};
+            ScrubDir(state, index_dir_, "", 0, layouts_);
+            CheckBatch(state);
         } else if (std::filesystem::exists(stat)) {
             throw Error("%s is not a directory", index_dir_);
         }
@@ -117,69 +489,208 @@ class DiskHashIndex final : public HashIndex<HashBits> {
         throw Error(e.what());
     }
 
-  private:
-    void ScrubDir(Log& log,
-                  std::function<bool(const HashAndSize<HashBits>& hs,
-                                     const std::filesystem::path& path)>
-                      is_good,
-                  const std::filesystem::path& dir, std::string_view prefix) {
+    // Return the layouts in `layouts` that allow a subdirectory named
+    // `dirname` at the given depth.
+    static std::vector<SymlinkLayout> SubdirLayouts(
+        std::span<const SymlinkLayout> layouts, int depth,
+        const std::string& dirname) {
+        std::vector<SymlinkLayout> result;
+        if (IsBase32Number(dirname)) {
+            for (const SymlinkLayout& layout : layouts) {
+                if (layout.subdirs > depth &&
+                    std::cmp_equal(layout.subdir_digits, dirname.size())) {
+                    result.push_back(layout);
+                }
+            }
+        }
+        return result;
+    }
+
+    // Check the symlinks in `state.batch`, and remove the bad ones.
+    static void CheckBatch(ScrubState& state) {
+        if (state.batch.empty()) {
+            return;
+        }
+        if (state.prefetch) {
+            state.prefetch(state.batch);
+        }
+        for (std::size_t i = 0; i < state.batch.size(); ++i) {
+            if (!state.is_good(state.batch[i].hs, state.batch[i].path)) {
+                // We don't log here, because we expect `is_good` to do so.
+                std::filesystem::remove(state.batch_symlinks[i]);
+            }
+        }
+        state.batch.clear();
+        state.batch_symlinks.clear();
+    }
+
+    // Scrub the subtree rooted at `dir`, which is `depth` levels below the
+    // index root and has the subdirectory names that make up `prefix`.
+    // `layouts` are the layouts that allow that path. If `state.tracker` is
+    // non-null, skip the directories it says are unchanged. Symlinks are
+    // added to `state.batch`, so some of them may not have been checked yet
+    // when we return.
+    void ScrubDir(ScrubState& state, const std::filesystem::path& dir,
+                  std::string_view prefix, int depth,
+                  std::span<const SymlinkLayout> layouts) {
+        Log& log = state.log;
+        DirChangeTracker* const tracker = state.tracker;
+        if (tracker != nullptr) {
+            if (auto subdirs = tracker->Unchanged(dir)) {
+                for (const std::filesystem::path& subdir : *subdirs) {
+                    const std::string dirname = subdir.filename();
+                    const std::vector<SymlinkLayout> subdir_layouts =
+                        SubdirLayouts(layouts, depth, dirname);
+                    if (!subdir_layouts.empty()) {
+                        ScrubDir(state, subdir, absl::StrCat(prefix, dirname),
+                                 depth + 1, subdir_layouts);
+                    }
+                }
+                return;
+            }
+        }
+        const bool expect_symlinks =
+            std::ranges::any_of(layouts, [&](const SymlinkLayout& layout) {
+                return layout.subdirs == depth;
+            });
+        const bool expect_subdirs =
+            std::ranges::any_of(layouts, [&](const SymlinkLayout& layout) {
+                return layout.subdirs > depth;
+            });
         std::vector<std::filesystem::path> to_remove;
+        DirChangeTracker::Listing listing;
         for (const std::filesystem::directory_entry& dent :
              std::filesystem::directory_iterator(dir)) {
-            if (prefix.size() == kSymlinkSubdirs * kSymlinkSubdirDigits) {
-                // We expect symlinks here, no subdirs.
+            listing.Add(dent.path().filename().native());
+            const std::string name = dent.path().filename();
+            if (expect_symlinks && dent.is_symlink()) {
                 const std::optional<HashAndSize<256>> hs =
-                    HashAndSize<256>::FromBase32(
-                        absl::StrCat(prefix, dent.path().filename().string()));
-                if (!dent.is_symlink()) {
-                    log.Info("Removing %s because it isn't a symlink.",
-                             dent.path());
-                    to_remove.push_back(dent.path());
-                } else if (!hs.has_value()) {
+                    HashAndSize<256>::FromBase32(absl::StrCat(prefix, name));
+                if (!hs.has_value()) {
                     log.Info("Removing %s because its filename is not a hash.",
                              dent.path());
                     to_remove.push_back(dent.path());
-                } else if (!is_good(*hs, dent.path().parent_path() /
-                                             std::filesystem::read_symlink(
-                                                 dent.path()))) {
-                    // We don't log here, because we expect `is_good` to do so.
-                    to_remove.push_back(dent.path());
+                } else {
+                    state.batch.push_back(
+                        {.hs = *hs,
+                         .path = dent.path().parent_path() /
+                                 std::filesystem::read_symlink(dent.path())});
+                    state.batch_symlinks.push_back(dent.path());
+                    if (state.batch.size() >= kScrubBatchSize) {
+                        CheckBatch(state);
+                    }
                 }
-            } else {
-                // We expect subdirs here, no symlinks.
-                const std::string dirname = dent.path().filename();
-                if (!std::filesystem::is_directory(dent.symlink_status())) {
-                    log.Info("Removing %s because it's not a directory.",
-                             dent.path());
-                    to_remove.push_back(dent.path());
-                } else if (dirname.size() != kSymlinkSubdirDigits ||
-                           !IsBase32Number(dirname)) {
+            } else if (expect_subdirs &&
+                       std::filesystem::is_directory(dent.symlink_status())) {
+                const std::vector<SymlinkLayout> subdir_layouts =
+                    SubdirLayouts(layouts, depth, name);
+                if (subdir_layouts.empty()) {
                     log.Info("Removing %s because its name is malformed.",
                              dent.path());
                     to_remove.push_back(dent.path());
                 } else {
-                    ScrubDir(log, is_good, dent.path(),
-                             absl::StrCat(prefix, dirname));
+                    ScrubDir(state, dent.path(), absl::StrCat(prefix, name),
+                             depth + 1, subdir_layouts);
                 }
+            } else if (expect_symlinks) {
+                log.Info("Removing %s because it isn't a symlink.",
+                         dent.path());
+                to_remove.push_back(dent.path());
+            } else {
+                log.Info("Removing %s because it's not a directory.",
+                         dent.path());
+                to_remove.push_back(dent.path());
             }
         }
+        if (tracker != nullptr) {
+            tracker->Listed(dir, listing);
+        }
         for (const std::filesystem::path& p : to_remove) {
             std::filesystem::remove_all(p);
         }
     }
 
     const std::filesystem::path index_dir_;
+    const std::vector<SymlinkLayout> layouts_;
 };
 
+// Give each symlink in the `from` layout below `dir` a twin in `to_index`,
+// and remove the original if `remove_old` is true. Return the number of
+// symlinks processed.
+std::int64_t ConvertLayoutDir(DiskHashIndex<256>& to_index,
+                              const std::filesystem::path& dir,
+                              std::string_view prefix, int depth,
+                              SymlinkLayout from, bool remove_old) {
+    std::int64_t count = 0;
+    for (const std::filesystem::directory_entry& dent :
+         std::filesystem::directory_iterator(dir)) {
+        const std::string name = dent.path().filename();
+        if (depth < from.subdirs) {
+            if (std::filesystem::is_directory(dent.symlink_status()) &&
+                std::cmp_equal(name.size(), from.subdir_digits) &&
+                IsBase32Number(name)) {
+                count += ConvertLayoutDir(to_index, dent.path(),
+                                          absl::StrCat(prefix, name),
+                                          depth + 1, from, remove_old);
+            }
+        } else if (dent.is_symlink()) {
+            const std::optional<HashAndSize<256>> hs =
+                HashAndSize<256>::FromBase32(absl::StrCat(prefix, name));
+            if (!hs.has_value()) {
+                continue;  // Not ours; leave it for Scrub to deal with.
+            }
+            const std::filesystem::path target =
+                dent.path().parent_path() /
+                std::filesystem::read_symlink(dent.path());
+            to_index.Insert(*hs, target);
+            if (remove_old) {
+                std::filesystem::remove(dent.path());
+            }
+            ++count;
+        }
+    }
+    if (remove_old && depth > 0) {
+        // Remove the directory if it's now empty. (If it isn't, this fails,
+        // and that's fine.)
+        std::error_code error;
+        std::filesystem::remove(dir, error);
+    }
+    return count;
+}
+
 }  // namespace
 
 std::unique_ptr<HashIndex<256>> CreateRamHashIndex() {
     return std::make_unique<RamHashIndex<256>>();
 }
 
+std::unique_ptr<HashIndex<256>> CreateConcurrentRamHashIndex(
+    int num_scrub_threads) {
+    return std::make_unique<ConcurrentRamHashIndex<256>>(num_scrub_threads);
+}
+
 std::unique_ptr<HashIndex<256>> CreateDiskHashIndex(
-    const std::filesystem::path& index_dir) {
-    return std::make_unique<DiskHashIndex<256>>(index_dir);
+    const std::filesystem::path& index_dir, SymlinkLayout layout,
+    std::optional<SymlinkLayout> previous_layout) {
+    std::vector<SymlinkLayout> layouts = {layout};
+    if (previous_layout.has_value()) {
+        layouts.push_back(*previous_layout);
+    }
+    return std::make_unique<DiskHashIndex<256>>(index_dir, std::move(layouts));
+}
+
+std::int64_t ConvertDiskHashIndexLayout(const std::filesystem::path& index_dir,
+                                        SymlinkLayout from, SymlinkLayout to,
+                                        bool remove_old) try {
+    FRZ_CHECK(from != to);
+    if (!std::filesystem::is_directory(
+            std::filesystem::symlink_status(index_dir))) {
+        return 0;
+    }
+    DiskHashIndex<256> to_index(index_dir, {to});
+    return ConvertLayoutDir(to_index, index_dir, "", 0, from, remove_old);
+} catch (const std::filesystem::filesystem_error& e) {
+    throw Error(e.what());
 }
 
 }  // namespace frz
@@ -17,16 +17,32 @@
 #ifndef FRZ_HASH_INDEX_HH_
 #define FRZ_HASH_INDEX_HH_
 
+#include <cstdint>
 #include <filesystem>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <span>
+#include <vector>
 
+#include "base32.hh"
+#include "dir_snapshot.hh"
 #include "hash.hh"
 #include "log.hh"
 
 namespace frz {
 
+// One entry of a HashIndex.
+template <int HashBits>
+struct HashIndexEntry {
+    HashAndSize<HashBits> hs;
+    std::filesystem::path path;
+};
+
 // Map from HashAndSize<HashBits> to std::filesystem::path.
+//
+// Unless otherwise noted by the function that creates them, HashIndex objects
+// are not thread safe.
 template <int HashBits>
 class HashIndex {
   public:
@@ -37,27 +53,118 @@ class HashIndex {
     virtual bool Insert(const HashAndSize<HashBits>& hs,
                         const std::filesystem::path& path) = 0;
 
+    // Make the entry for `hs` point to `path`, inserting it if there is none.
+    // An existing entry is replaced atomically, so that the hash never
+    // appears to be missing from the index. A `Scrub` callback may replace
+    // the entry it was called for (and should then keep it).
+    virtual void Replace(const HashAndSize<HashBits>& hs,
+                         const std::filesystem::path& path) = 0;
+
     // Does the index have an entry for the given hash?
     virtual bool Contains(const HashAndSize<HashBits>& hs) const = 0;
 
+    // Return the path for the given hash, or nullopt if the index has no entry
+    // for it.
+    virtual std::optional<std::filesystem::path> Lookup(
+        const HashAndSize<HashBits>& hs) const = 0;
+
+    // Return the hashes in `hashes` that the index has no entry for. This is
+    // equivalent to calling `Contains` for each hash, but may be implemented
+    // much more efficiently for large batches. The returned hashes are in an
+    // order that's efficient for this index, not necessarily the input order.
+    virtual std::vector<HashAndSize<HashBits>> FindMissing(
+        std::vector<HashAndSize<HashBits>> hashes) const {
+        std::erase_if(hashes, [&](const HashAndSize<HashBits>& hs) {
+            return Contains(hs);
+        });
+        return hashes;
+    }
+
     // Remove junk from the index. Any entries that aren't syntactically valid
     // are removed; for the entries that are syntactically valid, the supplied
-    // callback decides whether to keep them or not.
+    // callback decides whether to keep them or not. Indexes that are
+    // documented to be thread safe may call the callback concurrently from
+    // several threads.
     virtual void Scrub(Log& log,
                        std::function<bool(const HashAndSize<HashBits>& hs,
                                           const std::filesystem::path& path)>
                            is_good) = 0;
+
+    // Like `Scrub`, but skip parts of the index that `tracker` says haven't
+    // changed since the last time. Indexes that aren't stored in directories
+    // scrub everything.
+    virtual void ScrubChanged(
+        Log& log,
+        std::function<bool(const HashAndSize<HashBits>& hs,
+                           const std::filesystem::path& path)>
+            is_good,
+        DirChangeTracker& /*tracker*/) {
+        Scrub(log, std::move(is_good));
+    }
+
+    // Like `ScrubChanged` (or `Scrub`, if `tracker` is null), but before
+    // calling `is_good` for an entry, pass it to `prefetch` along with a batch
+    // of other entries that are about to be checked. This lets the caller
+    // gather whatever `is_good` needs for the whole batch concurrently instead
+    // of one entry at a time. Indexes that can't easily batch their entries
+    // call `prefetch` with one entry at a time.
+    virtual void ScrubBatched(
+        Log& log,
+        std::function<bool(const HashAndSize<HashBits>& hs,
+                           const std::filesystem::path& path)>
+            is_good,
+        std::function<void(std::span<const HashIndexEntry<HashBits>> entries)>
+            prefetch,
+        DirChangeTracker* tracker) {
+        auto prefetch_and_check = [&](const HashAndSize<HashBits>& hs,
+                                      const std::filesystem::path& path) {
+            const HashIndexEntry<HashBits> entry = {.hs = hs, .path = path};
+            prefetch(std::span(&entry, 1));
+            return is_good(hs, path);
+        };
+        if (tracker == nullptr) {
+            Scrub(log, prefetch_and_check);
+        } else {
+            ScrubChanged(log, prefetch_and_check, *tracker);
+        }
+    }
 };
 
 // Create an in-memory map.
 std::unique_ptr<HashIndex<256>> CreateRamHashIndex();
 
+// Create an in-memory map that is split into shards by hash prefix, with a
+// separate lock for each shard. It is thread safe: `Insert` and `Contains` may
+// be called concurrently from any number of threads, and if several threads
+// race to insert the same hash, the first one wins. `Scrub` visits the shards
+// in parallel using `num_scrub_threads` threads.
+std::unique_ptr<HashIndex<256>> CreateConcurrentRamHashIndex(
+    int num_scrub_threads);
+
 // Create a disk-based map. The base-32 representation of the keys are
-// converted to symlink names (the first two digits to a subdirectory name, the
-// next two digits to a second-level subdirectory name, and the remaining
-// digits to the symlink filename), and the value becomes the symlink target.
+// converted to symlink names according to `layout` (by default, the first two
+// digits become a subdirectory name, the next two digits a second-level
+// subdirectory name, and the remaining digits the symlink filename), and the
+// value becomes the symlink target. If `previous_layout` is set, symlinks in
+// that layout are recognized too, but new ones are always created in
+// `layout`; this is used while the index is being converted from one layout
+// to another. `Insert` and `Contains` may be called concurrently from several
+// threads; the filesystem decides which of several racing inserts of the same
+// hash wins.
 std::unique_ptr<HashIndex<256>> CreateDiskHashIndex(
-    const std::filesystem::path& index_dir);
+    const std::filesystem::path& index_dir,
+    SymlinkLayout layout = kDefaultSymlinkLayout,
+    std::optional<SymlinkLayout> previous_layout = std::nullopt);
+
+// Convert a disk-based index from layout `from` to layout `to`, by giving
+// every symlink in the `from` layout a twin in the `to` layout, and then
+// removing the original if `remove_old` is true. Return the number of
+// symlinks converted. Other processes may use the index in the meantime, as
+// long as they recognize both layouts; and if the conversion is interrupted,
+// it's safe to simply run it again.
+std::int64_t ConvertDiskHashIndexLayout(const std::filesystem::path& index_dir,
+                                        SymlinkLayout from, SymlinkLayout to,
+                                        bool remove_old);
 
 }  // namespace frz
 
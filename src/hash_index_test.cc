@@ -0,0 +1,285 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "hash_index.hh"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "filesystem_testing.hh"
+#include "hash.hh"
+#include "log.hh"
+
+namespace frz {
+namespace {
+
+// Construct a HashAndSize whose hash bytes are derived from `n`.
+HashAndSize<256> TestHash(int n) {
+    std::array<std::byte, 32> bytes = {};
+    for (int i = 0; i < 4; ++i) {
+        bytes[i] = static_cast<std::byte>(n >> (8 * i));
+    }
+    bytes[31] = std::byte{0x17};
+    return HashAndSize<256>(Hash<256>(bytes), n);
+}
+
+struct IndexFactory {
+    std::string name;
+    std::function<std::unique_ptr<HashIndex<256>>(
+        const std::filesystem::path& dir)>
+        create;
+};
+
+class TestHashIndex : public testing::TestWithParam<IndexFactory> {
+  public:
+    std::unique_ptr<HashIndex<256>> CreateIndex() {
+        return GetParam().create(dir_.Path() / "index");
+    }
+
+  private:
+    TempDir dir_;
+};
+INSTANTIATE_TEST_SUITE_P(
+    , TestHashIndex,
+    testing::Values(
+        IndexFactory{.name = "ram",
+                     .create = [](const std::filesystem::path&) {
+                         return CreateRamHashIndex();
+                     }},
+        IndexFactory{.name = "concurrent_ram",
+                     .create = [](const std::filesystem::path&) {
+                         return CreateConcurrentRamHashIndex(4);
+                     }},
+        IndexFactory{.name = "disk",
+                     .create =
+                         [](const std::filesystem::path& dir) {
+                             return CreateDiskHashIndex(dir);
+                         }},
+        IndexFactory{.name = "disk_flat",
+                     .create =
+                         [](const std::filesystem::path& dir) {
+                             return CreateDiskHashIndex(
+                                 dir, {.subdirs = 0, .subdir_digits = 1});
+                         }},
+        IndexFactory{.name = "disk_migrating",
+                     .create =
+                         [](const std::filesystem::path& dir) {
+                             return CreateDiskHashIndex(
+                                 dir, {.subdirs = 3, .subdir_digits = 1},
+                                 kDefaultSymlinkLayout);
+                         }}),
+    [](const auto& info) { return info.param.name; });
+
+TEST_P(TestHashIndex, InsertAndContains) {
+    std::unique_ptr<HashIndex<256>> index = CreateIndex();
+    EXPECT_FALSE(index->Contains(TestHash(1)));
+    EXPECT_TRUE(index->Insert(TestHash(1), "/content/a"));
+    EXPECT_TRUE(index->Contains(TestHash(1)));
+    EXPECT_FALSE(index->Contains(TestHash(2)));
+    EXPECT_FALSE(index->Insert(TestHash(1), "/content/b"));
+    EXPECT_TRUE(index->Insert(TestHash(2), "/content/b"));
+    EXPECT_TRUE(index->Contains(TestHash(2)));
+}
+
+TEST_P(TestHashIndex, Replace) {
+    std::unique_ptr<HashIndex<256>> index = CreateIndex();
+    index->Replace(TestHash(1), "/content/a");
+    EXPECT_EQ(index->Lookup(TestHash(1))->lexically_normal(), "/content/a");
+    EXPECT_TRUE(index->Insert(TestHash(2), "/content/b"));
+    index->Replace(TestHash(2), "/content/c");
+    EXPECT_EQ(index->Lookup(TestHash(2))->lexically_normal(), "/content/c");
+
+    // A scrub callback may re-point the entry it's looking at.
+    Log log;
+    index->Scrub(log, [&](const HashAndSize<256>& hs,
+                          const std::filesystem::path& /*path*/) {
+        index->Replace(hs, "/content/d");
+        return true;
+    });
+    EXPECT_EQ(index->Lookup(TestHash(1))->lexically_normal(), "/content/d");
+    EXPECT_EQ(index->Lookup(TestHash(2))->lexically_normal(), "/content/d");
+}
+
+TEST_P(TestHashIndex, Scrub) {
+    std::unique_ptr<HashIndex<256>> index = CreateIndex();
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_TRUE(index->Insert(TestHash(i), "/content/x"));
+    }
+    Log log;
+    std::atomic<int> num_visited = 0;
+    index->Scrub(log, [&](const HashAndSize<256>& hs,
+                          const std::filesystem::path& /*path*/) {
+        ++num_visited;
+        return hs.GetSize() % 2 == 0;
+    });
+    EXPECT_EQ(num_visited, 100);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(index->Contains(TestHash(i)), i % 2 == 0);
+    }
+}
+
+TEST_P(TestHashIndex, ScrubBatched) {
+    std::unique_ptr<HashIndex<256>> index = CreateIndex();
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_TRUE(index->Insert(TestHash(i), "/content/x"));
+    }
+    Log log;
+    std::mutex mutex;
+    std::set<std::int64_t> prefetched;
+    std::atomic<int> num_visited = 0;
+    std::atomic<int> num_not_prefetched = 0;
+    index->ScrubBatched(
+        log,
+        [&](const HashAndSize<256>& hs, const std::filesystem::path& path) {
+            EXPECT_EQ(path.lexically_normal(), "/content/x");
+            ++num_visited;
+            std::lock_guard lock(mutex);
+            if (!prefetched.contains(hs.GetSize())) {
+                ++num_not_prefetched;
+            }
+            return hs.GetSize() % 2 == 0;
+        },
+        [&](std::span<const HashIndexEntry<256>> entries) {
+            std::lock_guard lock(mutex);
+            for (const HashIndexEntry<256>& entry : entries) {
+                EXPECT_TRUE(prefetched.insert(entry.hs.GetSize()).second);
+            }
+        },
+        /*tracker=*/nullptr);
+    EXPECT_EQ(num_visited, 1000);
+    EXPECT_EQ(num_not_prefetched, 0);
+    EXPECT_EQ(prefetched.size(), 1000);
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(index->Contains(TestHash(i)), i % 2 == 0);
+    }
+}
+
+TEST_P(TestHashIndex, FindMissing) {
+    std::unique_ptr<HashIndex<256>> index = CreateIndex();
+    std::vector<HashAndSize<256>> hashes;
+    for (int i = 0; i < 1000; ++i) {
+        if (i % 3 == 0) {
+            EXPECT_TRUE(index->Insert(TestHash(i), "/content/x"));
+        }
+        hashes.push_back(TestHash(i));
+    }
+    std::vector<HashAndSize<256>> expected;
+    for (int i = 0; i < 1000; ++i) {
+        if (i % 3 != 0) {
+            expected.push_back(TestHash(i));
+        }
+    }
+    EXPECT_THAT(index->FindMissing(hashes),
+                testing::UnorderedElementsAreArray(expected));
+    EXPECT_THAT(index->FindMissing({}), testing::IsEmpty());
+}
+
+// Run `num_threads` threads that all try to insert the same set of hashes,
+// and check that each hash was successfully inserted exactly once.
+void TestConcurrentInserts(HashIndex<256>& index) {
+    constexpr int kNumThreads = 8;
+    constexpr int kNumHashes = 500;
+    std::atomic<int> num_inserted = 0;
+    {
+        std::vector<std::jthread> threads;
+        for (int t = 0; t < kNumThreads; ++t) {
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < kNumHashes; ++i) {
+                    if (index.Insert(TestHash(i), std::to_string(t))) {
+                        ++num_inserted;
+                    }
+                    EXPECT_TRUE(index.Contains(TestHash(i)));
+                }
+            });
+        }
+    }
+    EXPECT_EQ(num_inserted, kNumHashes);
+}
+
+TEST(TestConcurrentHashIndex, RamFirstWriterWins) {
+    TestConcurrentInserts(*CreateConcurrentRamHashIndex(4));
+}
+
+TEST(TestConcurrentHashIndex, ScrubCallbackMayUseTheIndex) {
+    std::unique_ptr<HashIndex<256>> index = CreateConcurrentRamHashIndex(4);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_TRUE(index->Insert(TestHash(i), "/content/old"));
+    }
+    Log log;
+    index->Scrub(log, [&](const HashAndSize<256>& hs,
+                          const std::filesystem::path& path) {
+        EXPECT_EQ(index->Lookup(hs), path);
+        if (hs.GetSize() >= 1000) {
+            return true;  // added below, in a shard not yet scrubbed
+        }
+        // Other entries, in this shard or another, may be added too.
+        index->Insert(TestHash(static_cast<int>(hs.GetSize()) + 1000),
+                      "/content/new");
+        return hs.GetSize() % 2 == 0;
+    });
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(index->Contains(TestHash(i)), i % 2 == 0) << i;
+        EXPECT_TRUE(index->Contains(TestHash(i + 1000))) << i;
+    }
+}
+
+TEST(TestConcurrentHashIndex, DiskFirstWriterWins) {
+    TempDir d;
+    TestConcurrentInserts(*CreateDiskHashIndex(d.Path() / "index"));
+}
+
+TEST(TestDiskHashIndex, ConvertLayout) {
+    TempDir d;
+    const std::filesystem::path dir = d.Path() / "index";
+    const SymlinkLayout kNewLayout = {.subdirs = 1, .subdir_digits = 3};
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_TRUE(CreateDiskHashIndex(dir)->Insert(TestHash(i), "/content"));
+    }
+
+    // After converting without removing the old symlinks, both layouts
+    // contain all hashes.
+    EXPECT_EQ(10, ConvertDiskHashIndexLayout(dir, kDefaultSymlinkLayout,
+                                             kNewLayout, /*remove_old=*/false));
+    for (SymlinkLayout layout : {kDefaultSymlinkLayout, kNewLayout}) {
+        std::unique_ptr<HashIndex<256>> index =
+            CreateDiskHashIndex(dir, layout);
+        for (int i = 0; i < 10; ++i) {
+            EXPECT_TRUE(index->Contains(TestHash(i)));
+        }
+    }
+
+    // Removing the old symlinks leaves only the new layout.
+    EXPECT_EQ(10, ConvertDiskHashIndexLayout(dir, kDefaultSymlinkLayout,
+                                             kNewLayout, /*remove_old=*/true));
+    EXPECT_FALSE(CreateDiskHashIndex(dir)->Contains(TestHash(0)));
+    EXPECT_TRUE(CreateDiskHashIndex(dir, kNewLayout)->Contains(TestHash(0)));
+    EXPECT_EQ(RecursiveListDirectory(dir).size(), 10);
+}
+
+}  // namespace
+}  // namespace frz
@@ -22,6 +22,7 @@
 #include <absl/time/time.h>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
@@ -52,7 +53,9 @@ void ProgressLogCounter::Increment(std::int64_t diff) {
 
 ProgressLog::~ProgressLog() {
     Render(true);
-    std::putchar('\n');
+    if (!quiet_) {
+        std::putchar('\n');
+    }
     FRZ_ASSERT_EQ(in_progress_.back(), this);
     in_progress_.pop_back();
     if (!in_progress_.empty()) {
@@ -69,8 +72,8 @@ ProgressLogCounter ProgressLog::AddCounter(
 }
 
 ProgressLog::ProgressLog(std::vector<ProgressLog*>& in_progress,
-                         std::string desc)
-    : in_progress_(in_progress), desc_(std::move(desc)) {
+                         std::string desc, bool quiet)
+    : in_progress_(in_progress), desc_(std::move(desc)), quiet_(quiet) {
     if (!in_progress.empty()) {
         in_progress.back()->Pause();
     }
@@ -79,6 +82,9 @@ ProgressLog::ProgressLog(std::vector<ProgressLog*>& in_progress,
 }
 
 void ProgressLog::PrintStatus(std::string_view new_status) {
+    if (quiet_) {
+        return;
+    }
     MoveCursorLeft(status_characters_printed_);
     absl::PrintF("%-*s", status_characters_printed_, new_status);
     MoveCursorLeft(status_characters_printed_ - std::ssize(new_status));
@@ -127,7 +133,9 @@ void ProgressLog::Refresh() {
 
 void ProgressLog::Pause() {
     FRZ_ASSERT(!paused_);
-    if (clear_entire_line_on_pause_) {
+    if (quiet_) {
+        // Nothing to erase.
+    } else if (clear_entire_line_on_pause_) {
         // We've been paused at least once before, so this time we'll clear the
         // entire line.
         const int total_characters_printed =
@@ -154,13 +162,19 @@ void ProgressLog::Resume() {
     FRZ_ASSERT_EQ(status_characters_printed_, 0);
     FRZ_ASSERT_GE(in_progress_.size(), 1);
     FRZ_ASSERT_EQ(in_progress_.back(), this);
-    absl::PrintF("%*s%s", (in_progress_.size() - 1) * 2, "", desc_);
+    if (!quiet_) {
+        absl::PrintF("%*s%s", (in_progress_.size() - 1) * 2, "", desc_);
+    }
     paused_ = false;
     Render(false);
     FRZ_ASSERT(last_render_.has_value());
 }
 
 void Log::OutputLine(std::string_view line) {
+    if (output_ != nullptr) {
+        output_(line);
+        return;
+    }
     if (!in_progress_.empty()) {
         in_progress_.back()->Pause();
     }
@@ -171,7 +185,8 @@ void Log::OutputLine(std::string_view line) {
 }
 
 ProgressLog Log::StartProgress(std::string desc) {
-    return ProgressLog(in_progress_, std::move(desc));
+    return ProgressLog(in_progress_, std::move(desc),
+                       /*quiet=*/output_ != nullptr);
 }
 
 }  // namespace frz
@@ -21,6 +21,7 @@
 #include <absl/strings/str_format.h>
 #include <absl/time/time.h>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
@@ -86,7 +87,8 @@ class ProgressLog final {
         std::unique_ptr<std::int64_t> counter;
     };
 
-    ProgressLog(std::vector<ProgressLog*>& current_progress, std::string desc);
+    ProgressLog(std::vector<ProgressLog*>& current_progress, std::string desc,
+                bool quiet);
 
     // Erase the current status string and print `new_status` instead.
     void PrintStatus(std::string_view new_status);
@@ -110,6 +112,9 @@ class ProgressLog final {
     const std::string desc_;
     std::vector<Counter> counters_;
 
+    // If true, we keep track of our state as usual but never print anything.
+    const bool quiet_;
+
     // How many status characters have we printed? (This is the stuff after the
     // "... ".)
     int status_characters_printed_ = 0;
@@ -131,6 +136,14 @@ class ProgressLog final {
 class Log final {
   public:
     Log() = default;
+
+    // Create a log that hands each line to `output` instead of printing it,
+    // and doesn't display progress at all. This is useful for work that runs
+    // on another thread than the one that owns the console; `output` is
+    // responsible for any locking that's needed.
+    explicit Log(std::function<void(std::string_view line)> output)
+        : output_(std::move(output)) {}
+
     Log(const Log&) = delete;
     Log& operator=(const Log&) = delete;
     ~Log() { FRZ_ASSERT_EQ(in_progress_.size(), 0); }
@@ -180,6 +193,9 @@ class Log final {
 
     // Stack of the currently ongoing ProgressLogs.
     std::vector<ProgressLog*> in_progress_;
+
+    // Where our lines go, if not to the console.
+    const std::function<void(std::string_view line)> output_;
 };
 
 }  // namespace frz
@@ -20,6 +20,9 @@
 #include <absl/time/time.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace frz {
 namespace {
@@ -88,5 +91,20 @@ TEST(LogTest, NestedProgress) {
     absl::SleepFor(absl::Milliseconds(2000));
 }
 
+TEST(LogTest, Forwarded) {
+    std::vector<std::string> lines;
+    Log log([&](std::string_view line) { lines.emplace_back(line); });
+    {
+        auto p = log.Progress("Some quiet work");
+        auto c = p.AddCounter("things", 10);
+        c.Increment(3);
+        log.Info("Found %d things", 3);
+        auto p2 = log.Progress("Some nested quiet work");
+        log.Error("Oops");
+    }
+    EXPECT_THAT(lines, testing::ElementsAre("Found 3 things",
+                                            "*** ERROR: Oops"));
+}
+
 }  // namespace
 }  // namespace frz
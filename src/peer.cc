@@ -0,0 +1,548 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "peer.hh"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "assert.hh"
+#include "content_source.hh"
+#include "content_store.hh"
+#include "exceptions.hh"
+#include "file_stream.hh"
+#include "hash.hh"
+#include "hasher.hh"
+#include "log.hh"
+#include "stream.hh"
+
+namespace frz {
+
+namespace {
+
+constexpr std::string_view kGreeting = "frz-peer";
+
+constexpr std::byte kContainsRequest{'C'};
+constexpr std::byte kGetRequest{'G'};
+constexpr std::byte kAbsent{0};
+constexpr std::byte kPresent{1};
+
+// The size of one entry in a request: a hash and a size.
+constexpr int kEntrySize = 40;
+
+// Requests with more entries than this are assumed to be garbage.
+constexpr std::uint64_t kMaxEntries = std::uint64_t{1} << 26;
+
+// Write all of `buffer` to `fd`.
+void WriteAll(int fd, std::span<const std::byte> buffer) {
+    while (!buffer.empty()) {
+        const ssize_t n = ::write(fd, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw Error("Writing to peer: %s", std::strerror(errno));
+        }
+        buffer = buffer.subspan(n);
+    }
+}
+
+// Read up to `buffer.size()` bytes from `fd`, and return how many we got;
+// fewer than asked for only if the other end hung up.
+std::size_t ReadUpTo(int fd, std::span<std::byte> buffer) {
+    std::size_t num_read = 0;
+    while (num_read < buffer.size()) {
+        const ssize_t n = ::read(fd, buffer.data() + num_read,
+                                 buffer.size() - num_read);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw Error("Reading from peer: %s", std::strerror(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+        num_read += n;
+    }
+    return num_read;
+}
+
+void ReadExactly(int fd, std::span<std::byte> buffer) {
+    if (ReadUpTo(fd, buffer) != buffer.size()) {
+        throw Error("Peer hung up unexpectedly");
+    }
+}
+
+void PutU64(std::vector<std::byte>& out, std::uint64_t x) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<std::byte>(x >> (8 * i)));
+    }
+}
+
+std::uint64_t GetU64(std::span<const std::byte, 8> bytes) {
+    std::uint64_t x = 0;
+    for (int i = 0; i < 8; ++i) {
+        x |= std::to_integer<std::uint64_t>(bytes[i]) << (8 * i);
+    }
+    return x;
+}
+
+void SendRequest(int fd, std::byte type,
+                 std::span<const HashAndSize<256>> entries) {
+    std::vector<std::byte> request;
+    request.reserve(9 + entries.size() * kEntrySize);
+    request.push_back(type);
+    PutU64(request, entries.size());
+    for (const HashAndSize<256>& hs : entries) {
+        const auto hash = hs.GetHash().Bytes();
+        request.insert(request.end(), hash.begin(), hash.end());
+        PutU64(request, static_cast<std::uint64_t>(hs.GetSize()));
+    }
+    WriteAll(fd, request);
+}
+
+// Read the rest of a request, after its type byte.
+std::vector<HashAndSize<256>> ReceiveEntries(int fd) {
+    std::array<std::byte, 8> count_bytes;
+    ReadExactly(fd, count_bytes);
+    const std::uint64_t count = GetU64(count_bytes);
+    if (count > kMaxEntries) {
+        throw Error("Peer sent a request with %d entries", count);
+    }
+    std::vector<std::byte> bytes(count * kEntrySize);
+    ReadExactly(fd, bytes);
+    std::vector<HashAndSize<256>> entries;
+    entries.reserve(count);
+    for (std::uint64_t i = 0; i < count; ++i) {
+        const auto entry =
+            std::span(bytes).subspan(i * kEntrySize).first<kEntrySize>();
+        const std::uint64_t size = GetU64(entry.subspan<32, 8>());
+        if (size > std::uint64_t{INT64_MAX}) {
+            throw Error("Peer sent a bad size");
+        }
+        entries.push_back(HashAndSize<256>(
+            Hash<256>(entry.first<32>()), static_cast<std::int64_t>(size)));
+    }
+    return entries;
+}
+
+// Reads the next `size` bytes that the peer sends.
+class PeerStreamSource final : public StreamSource {
+  public:
+    PeerStreamSource(int fd, std::int64_t size) : fd_(fd), size_(size) {}
+
+    std::variant<BytesCopied, End> GetBytes(
+        std::span<std::byte> buffer) override {
+        if (pos_ >= size_) {
+            return End{};
+        }
+        const std::size_t n = ReadUpTo(
+            fd_, buffer.first(std::min(std::ssize(buffer), size_ - pos_)));
+        if (n == 0) {
+            throw Error("Peer hung up unexpectedly");
+        }
+        pos_ += n;
+        return BytesCopied{.num_bytes = static_cast<int>(n)};
+    }
+
+    std::int64_t GetPosition() const override { return pos_; }
+
+    void SetPosition(std::int64_t pos) override { FRZ_CHECK_EQ(pos, pos_); }
+
+  private:
+    const int fd_;
+    const std::int64_t size_;
+    std::int64_t pos_ = 0;
+};
+
+// Writes a file of the given size to the peer. Throws if the file turns out
+// to be larger, before sending any of the extra bytes.
+class PeerStreamSink final : public StreamSink {
+  public:
+    PeerStreamSink(int fd, std::int64_t size) : fd_(fd), size_(size) {}
+
+    void AddBytes(std::span<const std::byte> buffer) override {
+        if (std::ssize(buffer) > size_ - num_bytes_) {
+            throw Error("File grew while we were sending it");
+        }
+        WriteAll(fd_, buffer);
+        num_bytes_ += std::ssize(buffer);
+    }
+
+    std::int64_t NumBytes() const { return num_bytes_; }
+
+  private:
+    const int fd_;
+    const std::int64_t size_;
+    std::int64_t num_bytes_ = 0;
+};
+
+class PeerContentSource final : public ContentSource<256> {
+  public:
+    PeerContentSource(
+        std::unique_ptr<PeerConnection> connection, Streamer& streamer,
+        std::function<std::unique_ptr<Hasher<256>>()> create_hasher)
+        : connection_(std::move(connection)),
+          streamer_(streamer),
+          create_hasher_(std::move(create_hasher)) {}
+
+    std::optional<std::filesystem::path> Fetch(
+        Log& log, const HashAndSize<256>& hs,
+        ContentStore& content_store) override {
+        std::optional<std::filesystem::path> result;
+        FetchMany(
+            log, std::span(&hs, 1), content_store,
+            [&](const HashAndSize<256>&, const std::filesystem::path& path) {
+                result = path;
+            },
+            nullptr);
+        return result;
+    }
+
+    void FetchMany(
+        Log& log, std::span<const HashAndSize<256>> wanted,
+        ContentStore& content_store,
+        std::function<void(const HashAndSize<256>& hs,
+                           const std::filesystem::path& path)>
+            fetched,
+        std::function<bool(const HashAndSize<256>& hs)> still_wanted) override {
+        if (broken_) {
+            return;
+        }
+        try {
+            // If anything goes wrong in here, we no longer know where in
+            // the stream of answers we are.
+            broken_ = true;
+            if (!greeted_) {
+                std::array<std::byte, kGreeting.size()> greeting;
+                ReadExactly(connection_->ReadFd(), greeting);
+                if (std::string_view(
+                        reinterpret_cast<const char*>(greeting.data()),
+                        greeting.size()) != kGreeting) {
+                    throw Error("Not a frz peer");
+                }
+                greeted_ = true;
+            }
+            std::vector<HashAndSize<256>> present = Contains(wanted);
+            if (still_wanted != nullptr) {
+                // Everything we ask for will be sent, so this is our last
+                // chance to leave out what others have already fetched.
+                std::erase_if(present, [&](const HashAndSize<256>& hs) {
+                    return !still_wanted(hs);
+                });
+            }
+            GetAll(log, present, content_store, fetched);
+            broken_ = false;
+        } catch (const Error& e) {
+            log.Important("When fetching from peer: %s", e.what());
+        }
+    }
+
+  private:
+    // Ask the peer which of `wanted` it has.
+    std::vector<HashAndSize<256>> Contains(
+        std::span<const HashAndSize<256>> wanted) {
+        SendRequest(connection_->WriteFd(), kContainsRequest, wanted);
+        std::vector<std::byte> answers(wanted.size());
+        ReadExactly(connection_->ReadFd(), answers);
+        std::vector<HashAndSize<256>> present;
+        for (std::size_t i = 0; i < wanted.size(); ++i) {
+            if (answers[i] == kPresent) {
+                present.push_back(wanted[i]);
+            }
+        }
+        return present;
+    }
+
+    // Get everything in `wanted` from the peer, in a single request.
+    void GetAll(Log& log, std::span<const HashAndSize<256>> wanted,
+                ContentStore& content_store,
+                const std::function<void(const HashAndSize<256>& hs,
+                                         const std::filesystem::path& path)>&
+                    fetched) {
+        if (wanted.empty()) {
+            return;
+        }
+        std::int64_t num_bytes = 0;
+        for (const HashAndSize<256>& hs : wanted) {
+            num_bytes += hs.GetSize();
+        }
+        auto progress = log.Progress("Fetching from peer");
+        auto file_counter = progress.AddCounter("files", std::ssize(wanted));
+        auto byte_counter = progress.AddCounter("bytes", num_bytes);
+        SendRequest(connection_->WriteFd(), kGetRequest, wanted);
+        for (const HashAndSize<256>& hs : wanted) {
+            std::byte status;
+            ReadExactly(connection_->ReadFd(), std::span(&status, 1));
+            if (status != kPresent) {
+                continue;
+            }
+            PeerStreamSource source(connection_->ReadFd(), hs.GetSize());
+            const std::optional<std::filesystem::path> path =
+                content_store.StreamInsertHashed(
+                    [&](StreamSink& content_sink)
+                        -> std::optional<HashAndSize<256>> {
+                        SizeHasher hasher(create_hasher_());
+                        TeeSink sink(hasher, content_sink);
+                        streamer_.Stream(source, sink, [&](int n) {
+                            byte_counter.Increment(n);
+                        });
+                        if (hasher.Finish() == hs) {
+                            return hs;
+                        }
+                        log.Important("Peer sent bad content for %s",
+                                      hs.ToBase32());
+                        return std::nullopt;
+                    });
+            if (path.has_value()) {
+                file_counter.Increment(1);
+                fetched(hs, *path);
+            }
+        }
+    }
+
+    const std::unique_ptr<PeerConnection> connection_;
+    Streamer& streamer_;
+    const std::function<std::unique_ptr<Hasher<256>>()> create_hasher_;
+    bool greeted_ = false;
+    bool broken_ = false;
+};
+
+// Connect to the Unix socket at `path`, and return the file descriptor.
+int ConnectToSocket(const std::filesystem::path& path) {
+    sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = {}};
+    if (path.native().size() >= sizeof addr.sun_path) {
+        throw Error("Socket path too long: %s", path.string());
+    }
+    std::ranges::copy(path.native(), addr.sun_path);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw Error("Creating socket: %s", std::strerror(errno));
+    }
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) !=
+        0) {
+        const int connect_errno = errno;
+        ::close(fd);
+        throw Error("Connecting to %s: %s", path.string(),
+                    std::strerror(connect_errno));
+    }
+    return fd;
+}
+
+}  // namespace
+
+std::unique_ptr<PeerConnection> PeerConnection::Connect(
+    const std::string& address) {
+    // If the peer goes away, we want our writes to fail with EPIPE rather
+    // than get killed by SIGPIPE.
+    std::signal(SIGPIPE, SIG_IGN);
+    if (address.starts_with("unix:")) {
+        const int fd = ConnectToSocket(address.substr(5));
+        return std::unique_ptr<PeerConnection>(new PeerConnection(fd, fd, -1));
+    }
+    if (!address.starts_with("exec:")) {
+        throw Error("Bad peer address \"%s\" (expected unix:PATH or "
+                    "exec:COMMAND)",
+                    address);
+    }
+    int to_child[2];
+    int from_child[2];
+    if (::pipe2(to_child, O_CLOEXEC) != 0) {
+        throw Error("Creating pipe: %s", std::strerror(errno));
+    }
+    if (::pipe2(from_child, O_CLOEXEC) != 0) {
+        const int pipe_errno = errno;
+        ::close(to_child[0]);
+        ::close(to_child[1]);
+        throw Error("Creating pipe: %s", std::strerror(pipe_errno));
+    }
+    const pid_t child = ::fork();
+    if (child == 0) {
+        // The pipes are close-on-exec, but their duplicates aren't.
+        ::dup2(to_child[0], STDIN_FILENO);
+        ::dup2(from_child[1], STDOUT_FILENO);
+        ::execl("/bin/sh", "sh", "-c", address.c_str() + 5, nullptr);
+        ::_exit(127);
+    }
+    const int fork_errno = errno;
+    ::close(to_child[0]);
+    ::close(from_child[1]);
+    if (child < 0) {
+        ::close(to_child[1]);
+        ::close(from_child[0]);
+        throw Error("Starting \"%s\": %s", address.substr(5),
+                    std::strerror(fork_errno));
+    }
+    return std::unique_ptr<PeerConnection>(
+        new PeerConnection(from_child[0], to_child[1], child));
+}
+
+PeerConnection::~PeerConnection() {
+    ::close(write_fd_);
+    if (read_fd_ != write_fd_) {
+        ::close(read_fd_);
+    }
+    if (child_ > 0) {
+        int status;
+        while (::waitpid(child_, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+std::unique_ptr<ContentSource<256>> CreatePeerContentSource(
+    std::unique_ptr<PeerConnection> connection, Streamer& streamer,
+    std::function<std::unique_ptr<Hasher<256>>()> create_hasher) {
+    return std::make_unique<PeerContentSource>(std::move(connection), streamer,
+                                               std::move(create_hasher));
+}
+
+void ServePeer(
+    int read_fd, int write_fd,
+    const std::function<std::optional<std::filesystem::path>(
+        const HashAndSize<256>& hs)>& lookup,
+    Streamer& streamer) {
+    WriteAll(write_fd, std::as_bytes(std::span(kGreeting)));
+    while (true) {
+        std::byte type;
+        if (ReadUpTo(read_fd, std::span(&type, 1)) == 0) {
+            return;  // The client hung up.
+        }
+        const std::vector<HashAndSize<256>> entries = ReceiveEntries(read_fd);
+
+        // The content file for each entry, if we have one of the right size.
+        auto find = [&](const HashAndSize<256>& hs)
+            -> std::optional<std::filesystem::path> {
+            std::optional<std::filesystem::path> path = lookup(hs);
+            std::error_code error;
+            if (!path.has_value() ||
+                !std::filesystem::is_regular_file(
+                    std::filesystem::status(*path, error)) ||
+                !std::cmp_equal(std::filesystem::file_size(*path, error),
+                                hs.GetSize())) {
+                return std::nullopt;
+            }
+            return path;
+        };
+
+        if (type == kContainsRequest) {
+            std::vector<std::byte> answers;
+            answers.reserve(entries.size());
+            for (const HashAndSize<256>& hs : entries) {
+                answers.push_back(find(hs).has_value() ? kPresent : kAbsent);
+            }
+            WriteAll(write_fd, answers);
+        } else if (type == kGetRequest) {
+            for (const HashAndSize<256>& hs : entries) {
+                const std::optional<std::filesystem::path> path = find(hs);
+                std::unique_ptr<StreamSource> source;
+                if (path.has_value()) {
+                    try {
+                        source = CreateFileSource(*path);
+                    } catch (const Error&) {
+                        // Unreadable, so we don't have it after all.
+                    }
+                }
+                const std::byte status =
+                    source == nullptr ? kAbsent : kPresent;
+                WriteAll(write_fd, std::span(&status, 1));
+                if (source != nullptr) {
+                    // Once we've promised the content, a read error or a
+                    // file that no longer has the promised size leaves us no
+                    // choice but to hang up. The client then gets an error,
+                    // instead of waiting for bytes that never come.
+                    PeerStreamSink sink(write_fd, hs.GetSize());
+                    streamer.Stream(*source, sink);
+                    if (sink.NumBytes() != hs.GetSize()) {
+                        throw Error("%s shrank while we were sending it",
+                                    path->string());
+                    }
+                }
+            }
+        } else {
+            throw Error("Peer sent an unknown request");
+        }
+    }
+}
+
+void ListenForPeers(const std::filesystem::path& socket_path,
+                    const std::function<void(int fd)>& serve) {
+    std::signal(SIGPIPE, SIG_IGN);
+    sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = {}};
+    if (socket_path.native().size() >= sizeof addr.sun_path) {
+        throw Error("Socket path too long: %s", socket_path.string());
+    }
+    std::ranges::copy(socket_path.native(), addr.sun_path);
+    std::error_code error;
+    if (std::filesystem::is_socket(
+            std::filesystem::symlink_status(socket_path, error))) {
+        std::filesystem::remove(socket_path, error);
+    }
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw Error("Creating socket: %s", std::strerror(errno));
+    }
+    if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) !=
+            0 ||
+        ::listen(fd, 16) != 0) {
+        const int bind_errno = errno;
+        ::close(fd);
+        throw Error("Listening on %s: %s", socket_path.string(),
+                    std::strerror(bind_errno));
+    }
+    while (true) {
+        const int client = ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            const int accept_errno = errno;
+            ::close(fd);
+            throw Error("Accepting on %s: %s", socket_path.string(),
+                        std::strerror(accept_errno));
+        }
+        try {
+            serve(client);
+        } catch (...) {
+            ::close(client);
+            throw;
+        }
+        ::close(client);
+    }
+}
+
+}  // namespace frz
@@ -0,0 +1,111 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_PEER_HH_
+#define FRZ_PEER_HH_
+
+/*
+
+  The peer protocol lets one frz process fetch content from another
+  repository, which is served by `frz serve` at the other end of a byte
+  stream: a Unix socket, or a pair of pipes (which may be tunnelled through
+  e.g. ssh).
+
+  On connecting, the server sends the 8-byte greeting "frz-peer". After that,
+  the client sends requests, and the server answers each of them in turn.
+  Every request is a single byte that says what it is, the number of entries
+  (8 bytes, little endian), and that many entries, each being a hash (32
+  bytes) and a size (8 bytes, little endian).
+
+    'C' (contains): The server answers with one byte per entry: 1 if it has
+        the content, 0 if it doesn't.
+
+    'G' (get): The server answers each entry in order with one byte, 1 if it
+        has the content and 0 if it doesn't, and in the former case follows
+        it with the content itself.
+
+  Since a single request covers any number of files, and the server streams
+  the answers back to back, a fill costs two round trips regardless of the
+  number of files. The transport provides the flow control: the server
+  blocks when the client isn't reading fast enough. The client hangs up when
+  it's done.
+
+*/
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+
+#include "content_source.hh"
+#include "hash.hh"
+#include "hasher.hh"
+#include "stream.hh"
+
+namespace frz {
+
+// The client end of a connection to a peer.
+class PeerConnection final {
+  public:
+    // Connect to the peer at `address`, which is either "unix:PATH" (a Unix
+    // socket that `frz serve --socket=PATH` listens on), or "exec:COMMAND"
+    // (a shell command, such as "ssh host frz serve", that talks the peer
+    // protocol on its standard input and output). Throw `Error` on failure.
+    static std::unique_ptr<PeerConnection> Connect(const std::string& address);
+
+    // Hang up, and wait for the child process to exit, if there is one.
+    ~PeerConnection();
+
+    int ReadFd() const { return read_fd_; }
+    int WriteFd() const { return write_fd_; }
+
+  private:
+    PeerConnection(int read_fd, int write_fd, pid_t child)
+        : read_fd_(read_fd), write_fd_(write_fd), child_(child) {}
+
+    const int read_fd_;
+    const int write_fd_;
+    const pid_t child_;
+};
+
+// A content source that fetches content from a peer. The content is hashed
+// as it arrives, and discarded if it doesn't have the expected hash.
+std::unique_ptr<ContentSource<256>> CreatePeerContentSource(
+    std::unique_ptr<PeerConnection> connection, Streamer& streamer,
+    std::function<std::unique_ptr<Hasher<256>>()> create_hasher);
+
+// Serve one client, which sends requests to `read_fd` and reads our answers
+// from `write_fd`, until it hangs up. `lookup` returns the path of the
+// content file for a hash, or nullopt if we don't have it. Throw `Error` if
+// the client breaks the protocol, the connection fails, or a content file
+// changes size while we're sending it.
+void ServePeer(
+    int read_fd, int write_fd,
+    const std::function<std::optional<std::filesystem::path>(
+        const HashAndSize<256>& hs)>& lookup,
+    Streamer& streamer);
+
+// Listen on a Unix socket at `socket_path` (replacing any stale socket that's
+// already there), and call `serve` with each connection, one at a time.
+// Never returns, except by throwing `Error`.
+void ListenForPeers(const std::filesystem::path& socket_path,
+                    const std::function<void(int fd)>& serve);
+
+}  // namespace frz
+
+#endif  // FRZ_PEER_HH_
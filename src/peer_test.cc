@@ -0,0 +1,220 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "peer.hh"
+
+#include <filesystem>
+#include <functional>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "blake3_256_hasher.hh"
+#include "content_store.hh"
+#include "exceptions.hh"
+#include "file_stream.hh"
+#include "filesystem_testing.hh"
+#include "hash.hh"
+#include "hash_index.hh"
+#include "hasher.hh"
+#include "log.hh"
+#include "stream.hh"
+
+namespace frz {
+namespace {
+
+using ::testing::StrEq;
+
+HashAndSize<256> HashOf(const std::filesystem::path& file,
+                        Streamer& streamer) {
+    auto source = CreateFileSource(file);
+    SizeHasher hasher(CreateBlake3_256Hasher());
+    streamer.Stream(*source, hasher);
+    return hasher.Finish();
+}
+
+TEST(TestPeer, FetchOverSocket) {
+    TempDir d;
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    std::vector<HashAndSize<256>> wanted;
+    std::unique_ptr<HashIndex<256>> index = CreateRamHashIndex();
+    for (int i = 0; i < 20; ++i) {
+        const std::string name = "server/" + std::to_string(i);
+        d.File(name, std::string(i * 100, 'a' + i % 26));
+        wanted.push_back(HashOf(d.Path() / name, *streamer));
+        if (i % 4 != 0) {
+            index->Insert(wanted.back(), d.Path() / name);
+        }
+    }
+    // The server claims to have this one, but the file has the wrong size.
+    d.File("wrong", "x");
+    d.File("right", "yy");
+    wanted.push_back(HashOf(d.Path() / "right", *streamer));
+    index->Insert(wanted.back(), d.Path() / "wrong");
+
+    const std::filesystem::path socket = d.Path() / "socket";
+    std::jthread server([&] {
+        try {
+            ListenForPeers(socket, [&](int fd) {
+                const std::unique_ptr<Streamer> server_streamer =
+                    CreateSingleThreadedStreamer({.buffer_size = 7});
+                ServePeer(
+                    fd, fd,
+                    [&](const HashAndSize<256>& hs) {
+                        return index->Lookup(hs);
+                    },
+                    *server_streamer);
+                throw Error("done");
+            });
+        } catch (const Error&) {
+        }
+    });
+    std::unique_ptr<PeerConnection> connection;
+    while (connection == nullptr) {
+        try {
+            connection = PeerConnection::Connect("unix:" + socket.string());
+        } catch (const Error&) {
+            // The server isn't listening yet.
+            std::this_thread::yield();
+        }
+    }
+
+    std::unique_ptr<ContentStore> store =
+        ContentStore::Create(d.Path() / "store");
+    std::unique_ptr<ContentSource<256>> source = CreatePeerContentSource(
+        std::move(connection), *streamer, CreateBlake3_256Hasher);
+    Log log;
+    std::vector<HashAndSize<256>> fetched;
+    source->FetchMany(log, wanted, *store,
+                      [&](const HashAndSize<256>& hs,
+                          const std::filesystem::path& path) {
+                          EXPECT_EQ(HashOf(path, *streamer), hs);
+                          fetched.push_back(hs);
+                      });
+    std::vector<HashAndSize<256>> expected;
+    for (int i = 0; i < 20; ++i) {
+        if (i % 4 != 0) {
+            expected.push_back(wanted[i]);
+        }
+    }
+    EXPECT_EQ(fetched, expected);
+
+    // The connection can be reused.
+    EXPECT_THAT(source->Fetch(log, wanted[3], *store),
+                testing::Optional(ReadContents(StrEq(std::string(300, 'd')))));
+    EXPECT_EQ(source->Fetch(log, wanted[4], *store), std::nullopt);
+}
+
+// A streamer that truncates `file` before each stream, as if someone had
+// modified it after the server checked its size.
+class TruncatingStreamer final : public Streamer {
+  public:
+    explicit TruncatingStreamer(const std::filesystem::path& file)
+        : file_(file),
+          streamer_(CreateSingleThreadedStreamer({.buffer_size = 7})) {}
+
+    using Streamer::Stream;
+    void Stream(StreamSource& source, StreamSink& sink,
+                std::function<void(int num_bytes)> progress) override {
+        std::filesystem::resize_file(file_, 1);
+        streamer_->Stream(source, sink, std::move(progress));
+    }
+
+    void ForkedStream(ForkedStreamArgs args) override {
+        streamer_->ForkedStream(std::move(args));
+    }
+
+  private:
+    const std::filesystem::path file_;
+    const std::unique_ptr<Streamer> streamer_;
+};
+
+TEST(TestPeer, FileShrinksWhileServed) {
+    TempDir d;
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    d.File("server/f", std::string(100, 'f'));
+    const HashAndSize<256> hs = HashOf(d.Path() / "server/f", *streamer);
+    std::unique_ptr<HashIndex<256>> index = CreateRamHashIndex();
+    index->Insert(hs, d.Path() / "server/f");
+
+    // The server sends what's left of the file, and then hangs up, since
+    // the client expects more.
+    const std::filesystem::path socket = d.Path() / "socket";
+    std::string server_error;
+    std::jthread server([&] {
+        try {
+            ListenForPeers(socket, [&](int fd) {
+                TruncatingStreamer server_streamer(d.Path() / "server/f");
+                ServePeer(
+                    fd, fd,
+                    [&](const HashAndSize<256>& wanted) {
+                        return index->Lookup(wanted);
+                    },
+                    server_streamer);
+            });
+        } catch (const Error& e) {
+            server_error = e.what();
+        }
+    });
+    std::unique_ptr<PeerConnection> connection;
+    while (connection == nullptr) {
+        try {
+            connection = PeerConnection::Connect("unix:" + socket.string());
+        } catch (const Error&) {
+            std::this_thread::yield();
+        }
+    }
+    std::unique_ptr<ContentStore> store =
+        ContentStore::Create(d.Path() / "store");
+    std::unique_ptr<ContentSource<256>> source = CreatePeerContentSource(
+        std::move(connection), *streamer, CreateBlake3_256Hasher);
+    Log log;
+    EXPECT_EQ(source->Fetch(log, hs, *store), std::nullopt);
+    server.join();
+    EXPECT_THAT(server_error, testing::HasSubstr("shrank"));
+}
+
+TEST(TestPeer, BadAddress) {
+    EXPECT_THROW(PeerConnection::Connect("tcp:localhost"), Error);
+    TempDir d;
+    EXPECT_THROW(PeerConnection::Connect("unix:" + (d.Path() / "x").string()),
+                 Error);
+}
+
+TEST(TestPeer, NotAPeer) {
+    TempDir d;
+    d.File("f", "abc");
+    std::unique_ptr<ContentStore> store =
+        ContentStore::Create(d.Path() / "store");
+    const std::unique_ptr<Streamer> streamer =
+        CreateSingleThreadedStreamer({.buffer_size = 16});
+    std::unique_ptr<ContentSource<256>> source = CreatePeerContentSource(
+        PeerConnection::Connect("exec:echo hello"), *streamer,
+        CreateBlake3_256Hasher);
+    Log log;
+    const HashAndSize<256> hs = HashOf(d.Path() / "f", *streamer);
+    EXPECT_EQ(source->Fetch(log, hs, *store), std::nullopt);
+}
+
+}  // namespace
+}  // namespace frz
@@ -0,0 +1,91 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "read_order.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <fcntl.h>
+#include <filesystem>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <numeric>
+#include <span>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "worker.hh"
+
+namespace frz {
+
+namespace {
+
+// The number of files that `DiskReadOrder` examines concurrently.
+constexpr int kNumLocateThreads = 16;
+
+}  // namespace
+
+DiskLocation GetDiskLocation(const std::filesystem::path& file) {
+    DiskLocation location;
+    const int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return location;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0) {
+        location.device = st.st_dev;
+        location.inode = st.st_ino;
+    }
+
+    // Ask for just the first extent.
+    alignas(fiemap) std::byte buffer[sizeof(fiemap) + sizeof(fiemap_extent)] =
+        {};
+    fiemap* const fm = reinterpret_cast<fiemap*>(buffer);
+    fm->fm_start = 0;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+    if (::ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents > 0 &&
+        (fm->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) == 0) {
+        location.physical_offset = fm->fm_extents[0].fe_physical;
+    }
+    ::close(fd);
+    return location;
+}
+
+std::vector<std::size_t> DiskReadOrder(
+    std::span<const std::filesystem::path> files) {
+    std::vector<std::size_t> order(files.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (files.size() < 2) {
+        return order;
+    }
+    std::vector<DiskLocation> locations(files.size());
+    {
+        WorkerPool pool(std::min<std::size_t>(kNumLocateThreads, files.size()));
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            pool.Do([&, i] { locations[i] = GetDiskLocation(files[i]); });
+        }
+        pool.Wait();
+    }
+    std::ranges::stable_sort(order, [&](std::size_t a, std::size_t b) {
+        return locations[a] < locations[b];
+    });
+    return order;
+}
+
+}  // namespace frz
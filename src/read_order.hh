@@ -0,0 +1,59 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_READ_ORDER_HH_
+#define FRZ_READ_ORDER_HH_
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+namespace frz {
+
+// Where a file's data is on disk, as far as we can tell. Reading files in
+// order of their locations lets a rotating disk sweep across them instead of
+// seeking back and forth.
+struct DiskLocation {
+    std::uint64_t device = 0;
+
+    // The physical byte offset of the start of the file's data, as reported
+    // by the FIEMAP ioctl; or 0 if the filesystem doesn't support FIEMAP,
+    // or the file has no data yet.
+    std::uint64_t physical_offset = 0;
+
+    // Files without a known physical offset are ordered by inode number,
+    // which on most filesystems correlates with where their data is.
+    std::uint64_t inode = 0;
+
+    auto operator<=>(const DiskLocation&) const = default;
+};
+
+// Return the location of `file`. Files that can't be examined get the
+// default location.
+DiskLocation GetDiskLocation(const std::filesystem::path& file);
+
+// Return the indices of `files`, in the order the files should be read:
+// that of their disk locations. The files are examined concurrently, since
+// that's mostly waiting for the disk to read their inodes.
+std::vector<std::size_t> DiskReadOrder(
+    std::span<const std::filesystem::path> files);
+
+}  // namespace frz
+
+#endif  // FRZ_READ_ORDER_HH_
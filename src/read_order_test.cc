@@ -0,0 +1,64 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "read_order.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "filesystem_testing.hh"
+
+namespace frz {
+namespace {
+
+TEST(TestReadOrder, SortsByLocation) {
+    TempDir d;
+    std::vector<std::filesystem::path> files;
+    for (int i = 0; i < 50; ++i) {
+        // Create the files in a different order than we list them.
+        const std::string name = std::to_string((i * 7) % 50);
+        d.File(name, std::string(1000 * (i + 1), 'x'));
+    }
+    for (int i = 0; i < 50; ++i) {
+        files.push_back(d.Path() / std::to_string(i));
+    }
+    files.push_back(d.Path() / "does-not-exist");
+
+    const std::vector<std::size_t> order = DiskReadOrder(files);
+    std::vector<std::size_t> sorted_order = order;
+    std::ranges::sort(sorted_order);
+    std::vector<std::size_t> expected_indices(files.size());
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        expected_indices[i] = i;
+    }
+    EXPECT_EQ(sorted_order, expected_indices);
+
+    // The missing file has the default location, so it goes first.
+    EXPECT_EQ(order.front(), files.size() - 1);
+    EXPECT_EQ(GetDiskLocation(files.back()), DiskLocation());
+    for (std::size_t i = 1; i < order.size(); ++i) {
+        EXPECT_LE(GetDiskLocation(files[order[i - 1]]),
+                  GetDiskLocation(files[order[i]]));
+    }
+    EXPECT_NE(GetDiskLocation(files[0]).inode, 0u);
+}
+
+}  // namespace
+}  // namespace frz
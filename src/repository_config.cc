@@ -0,0 +1,190 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "repository_config.hh"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "base32.hh"
+#include "exceptions.hh"
+
+namespace frz {
+
+namespace {
+
+// Parse `value` as a SymlinkLayout field, and store it in `layout`.
+void SetLayoutField(std::optional<SymlinkLayout>& layout,
+                    int SymlinkLayout::*field, std::string_view key,
+                    std::string_view value) {
+    int n;
+    if (!absl::SimpleAtoi(value, &n)) {
+        throw Error("Bad value for config key %s: %s", key, value);
+    }
+    if (!layout.has_value()) {
+        layout = kDefaultSymlinkLayout;
+    }
+    (*layout).*field = n;
+}
+
+// Parse `value` as a boolean.
+bool ParseBool(std::string_view key, std::string_view value) {
+    if (value == "true") {
+        return true;
+    } else if (value == "false") {
+        return false;
+    } else {
+        throw Error("Bad value for config key %s: %s", key, value);
+    }
+}
+
+// Parse `value` as a non-negative integer.
+std::int64_t ParseCount(std::string_view key, std::string_view value) {
+    std::int64_t n;
+    if (!absl::SimpleAtoi(value, &n) || n < 0) {
+        throw Error("Bad value for config key %s: %s", key, value);
+    }
+    return n;
+}
+
+}  // namespace
+
+RepositoryConfig RepositoryConfig::Load(const std::filesystem::path& file) {
+    std::ifstream in(file);
+    if (!in.is_open()) {
+        if (std::filesystem::exists(file)) {
+            throw Error("Could not open %s", file);
+        }
+        return RepositoryConfig();
+    }
+    std::optional<SymlinkLayout> index_layout;
+    std::optional<SymlinkLayout> previous_index_layout;
+    std::optional<SymlinkLayout> content_layout;
+    bool durable = false;
+    std::optional<std::int64_t> cold_min_size;
+    std::optional<std::int64_t> cold_min_idle_days;
+    std::string line;
+    while (std::getline(in, line)) {
+        const std::string_view stripped = absl::StripAsciiWhitespace(line);
+        if (stripped.empty() || stripped.starts_with('#')) {
+            continue;
+        }
+        const std::string_view::size_type eq = stripped.find('=');
+        if (eq == std::string_view::npos) {
+            throw Error("Malformed line in %s: %s", file, line);
+        }
+        const std::string_view key =
+            absl::StripAsciiWhitespace(stripped.substr(0, eq));
+        const std::string_view value =
+            absl::StripAsciiWhitespace(stripped.substr(eq + 1));
+        if (key == "index.subdirs") {
+            SetLayoutField(index_layout, &SymlinkLayout::subdirs, key, value);
+        } else if (key == "index.subdir-digits") {
+            SetLayoutField(index_layout, &SymlinkLayout::subdir_digits, key,
+                           value);
+        } else if (key == "index.previous-subdirs") {
+            SetLayoutField(previous_index_layout, &SymlinkLayout::subdirs, key,
+                           value);
+        } else if (key == "index.previous-subdir-digits") {
+            SetLayoutField(previous_index_layout,
+                           &SymlinkLayout::subdir_digits, key, value);
+        } else if (key == "content.subdirs") {
+            SetLayoutField(content_layout, &SymlinkLayout::subdirs, key,
+                           value);
+        } else if (key == "content.subdir-digits") {
+            SetLayoutField(content_layout, &SymlinkLayout::subdir_digits, key,
+                           value);
+        } else if (key == "durable") {
+            durable = ParseBool(key, value);
+        } else if (key == "tier.cold-min-size") {
+            cold_min_size = ParseCount(key, value);
+        } else if (key == "tier.cold-min-idle-days") {
+            cold_min_idle_days = ParseCount(key, value);
+        } else {
+            throw Error("Unknown key in %s: %s", file, key);
+        }
+    }
+
+    RepositoryConfig config;
+    if (index_layout.has_value()) {
+        config.index_layout = *index_layout;
+    }
+    config.previous_index_layout = previous_index_layout;
+    config.content_layout = content_layout;
+    config.durable = durable;
+    config.cold_min_size = cold_min_size;
+    if (cold_min_idle_days.has_value()) {
+        if (*cold_min_idle_days > 36500) {
+            throw Error("Bad value for config key tier.cold-min-idle-days: %d",
+                        *cold_min_idle_days);
+        }
+        config.cold_min_idle_days = *cold_min_idle_days;
+    }
+    if (!IsValidSymlinkLayout(config.index_layout) ||
+        (config.previous_index_layout.has_value() &&
+         !IsValidSymlinkLayout(*config.previous_index_layout))) {
+        throw Error("Unsupported index layout in %s", file);
+    }
+    if (config.content_layout.has_value() &&
+        !IsValidSymlinkLayout(*config.content_layout)) {
+        throw Error("Unsupported content layout in %s", file);
+    }
+    return config;
+}
+
+void RepositoryConfig::Save(const std::filesystem::path& file) const {
+    std::filesystem::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << "index.subdirs = " << index_layout.subdirs << '\n'
+            << "index.subdir-digits = " << index_layout.subdir_digits << '\n';
+        if (previous_index_layout.has_value()) {
+            out << "index.previous-subdirs = "
+                << previous_index_layout->subdirs << '\n'
+                << "index.previous-subdir-digits = "
+                << previous_index_layout->subdir_digits << '\n';
+        }
+        if (content_layout.has_value()) {
+            out << "content.subdirs = " << content_layout->subdirs << '\n'
+                << "content.subdir-digits = " << content_layout->subdir_digits
+                << '\n';
+        }
+        if (durable) {
+            out << "durable = true\n";
+        }
+        if (cold_min_size.has_value()) {
+            out << "tier.cold-min-size = " << *cold_min_size << '\n';
+        }
+        if (cold_min_idle_days != RepositoryConfig().cold_min_idle_days) {
+            out << "tier.cold-min-idle-days = " << cold_min_idle_days << '\n';
+        }
+        out.close();
+        if (!out) {
+            throw Error("Failed to write %s", tmp);
+        }
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+}  // namespace frz
@@ -0,0 +1,68 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_REPOSITORY_CONFIG_HH_
+#define FRZ_REPOSITORY_CONFIG_HH_
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+
+#include "base32.hh"
+
+namespace frz {
+
+// Per-repository settings, stored in `.frz/config`. The file consists of
+// lines of the form `key = value`; empty lines and lines starting with `#` are
+// ignored. Settings that aren't mentioned in the file have their default
+// values, so repositories without a config file get the default settings.
+struct RepositoryConfig {
+    // Read the config file. Return the default config if the file doesn't
+    // exist; throw an Error if it can't be parsed, or contains keys we don't
+    // understand (since they may have been written by a newer version of Frz
+    // that stores things in ways we don't know about).
+    static RepositoryConfig Load(const std::filesystem::path& file);
+
+    // Atomically replace the config file.
+    void Save(const std::filesystem::path& file) const;
+
+    // The layout of the index symlink tree.
+    SymlinkLayout index_layout = kDefaultSymlinkLayout;
+
+    // If set, the index is being migrated from this layout to `index_layout`,
+    // and may contain symlinks in both layouts.
+    std::optional<SymlinkLayout> previous_index_layout;
+
+    // If set, content files are put at paths derived from their hashes, with
+    // this fan-out. If not set, they get random names.
+    std::optional<SymlinkLayout> content_layout;
+
+    // If true, new content is synced to stable storage before any index or
+    // user file symlinks that point to it are created. Content is synced in
+    // batches, so that a crash can't leave symlinks pointing to content that
+    // was never written, without having to wait for the disk once per file.
+    bool durable = false;
+
+    // If set, the content store has a cold tier in `.frz/cold-content`, and
+    // `frz tier` moves content files of at least this many bytes there once
+    // they've been in the repository for `cold_min_idle_days` days.
+    std::optional<std::int64_t> cold_min_size;
+    int cold_min_idle_days = 30;
+};
+
+}  // namespace frz
+
+#endif  // FRZ_REPOSITORY_CONFIG_HH_
@@ -0,0 +1,87 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "repository_config.hh"
+
+#include <gtest/gtest.h>
+#include <optional>
+
+#include "exceptions.hh"
+#include "filesystem_testing.hh"
+
+namespace frz {
+namespace {
+
+TEST(TestRepositoryConfig, MissingFileGivesDefaults) {
+    TempDir d;
+    const RepositoryConfig config = RepositoryConfig::Load(d.Path() / "config");
+    EXPECT_EQ(config.index_layout, kDefaultSymlinkLayout);
+    EXPECT_FALSE(config.previous_index_layout.has_value());
+    EXPECT_FALSE(config.content_layout.has_value());
+    EXPECT_FALSE(config.durable);
+    EXPECT_FALSE(config.cold_min_size.has_value());
+    EXPECT_EQ(config.cold_min_idle_days, 30);
+}
+
+TEST(TestRepositoryConfig, SaveAndLoad) {
+    TempDir d;
+    RepositoryConfig config;
+    config.index_layout = {.subdirs = 3, .subdir_digits = 1};
+    config.previous_index_layout = kDefaultSymlinkLayout;
+    config.content_layout = {.subdirs = 1, .subdir_digits = 2};
+    config.durable = true;
+    config.cold_min_size = 1 << 20;
+    config.cold_min_idle_days = 7;
+    config.Save(d.Path() / "config");
+    const RepositoryConfig loaded = RepositoryConfig::Load(d.Path() / "config");
+    EXPECT_EQ(loaded.index_layout, config.index_layout);
+    EXPECT_EQ(loaded.previous_index_layout, config.previous_index_layout);
+    EXPECT_EQ(loaded.content_layout, config.content_layout);
+    EXPECT_TRUE(loaded.durable);
+    EXPECT_EQ(loaded.cold_min_size, 1 << 20);
+    EXPECT_EQ(loaded.cold_min_idle_days, 7);
+}
+
+TEST(TestRepositoryConfig, CommentsAndPartialSettings) {
+    TempDir d;
+    d.File("config",
+           "# Wide and shallow.\n"
+           "\n"
+           "  index.subdirs = 1\n");
+    const RepositoryConfig config = RepositoryConfig::Load(d.Path() / "config");
+    EXPECT_EQ(config.index_layout.subdirs, 1);
+    EXPECT_EQ(config.index_layout.subdir_digits,
+              kDefaultSymlinkLayout.subdir_digits);
+}
+
+TEST(TestRepositoryConfig, BadFilesAreRejected) {
+    TempDir d;
+    d.File("unknown-key", "index.levels = 2\n");
+    EXPECT_THROW(RepositoryConfig::Load(d.Path() / "unknown-key"), Error);
+    d.File("bad-value", "index.subdirs = two\n");
+    EXPECT_THROW(RepositoryConfig::Load(d.Path() / "bad-value"), Error);
+    d.File("bad-layout", "index.subdir-digits = 9\n");
+    EXPECT_THROW(RepositoryConfig::Load(d.Path() / "bad-layout"), Error);
+    d.File("no-equals", "index.subdirs 2\n");
+    EXPECT_THROW(RepositoryConfig::Load(d.Path() / "no-equals"), Error);
+    d.File("bad-bool", "durable = yes\n");
+    EXPECT_THROW(RepositoryConfig::Load(d.Path() / "bad-bool"), Error);
+    d.File("negative-size", "tier.cold-min-size = -1\n");
+    EXPECT_THROW(RepositoryConfig::Load(d.Path() / "negative-size"), Error);
+}
+
+}  // namespace
+}  // namespace frz
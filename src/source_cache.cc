@@ -0,0 +1,292 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "source_cache.hh"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/escaping.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <system_error>
+#include <time.h>
+#include <vector>
+
+#include "assert.hh"
+#include "dir_snapshot.hh"
+#include "exceptions.hh"
+#include "file_list.hh"
+#include "hash.hh"
+
+namespace frz {
+
+namespace {
+
+// The first line of a cache file. Change the number if the format changes;
+// old caches will then be ignored.
+constexpr std::string_view kHeader = "frz-source-cache 1";
+
+// A file modified less than this long before we looked at it may be modified
+// again without its mtime changing, so we don't save its hash.
+constexpr std::int64_t kRacyWindowNs = 2'000'000'000;
+
+std::filesystem::path DirsFile(const std::filesystem::path& file) {
+    std::filesystem::path dirs_file = file;
+    dirs_file += ".dirs";
+    return dirs_file;
+}
+
+std::int64_t NowNs() {
+    struct timespec ts;
+    FRZ_CHECK_EQ(::clock_gettime(CLOCK_REALTIME, &ts), 0);
+    return std::int64_t{ts.tv_sec} * 1'000'000'000 + ts.tv_nsec;
+}
+
+}  // namespace
+
+std::optional<SourceCache::FileState> SourceCache::Stat(
+    const std::filesystem::path& file) {
+    struct stat st;
+    if (::lstat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return std::nullopt;
+    }
+    return FileState{.size = static_cast<std::uintmax_t>(st.st_size),
+                     .mtime_ns = std::int64_t{st.st_mtim.tv_sec} *
+                                     1'000'000'000 +
+                                 st.st_mtim.tv_nsec,
+                     .inode = st.st_ino};
+}
+
+SourceCache::SourceCache(const std::filesystem::path& root,
+                         const std::filesystem::path& file)
+    : root_(root), file_(file) {
+    std::ifstream in(file_);
+    std::string line;
+    if (!std::getline(in, line) || line != kHeader) {
+        return;
+    }
+    absl::flat_hash_map<std::string, FileList::DirId> dir_ids;
+    while (std::getline(in, line)) {
+        const std::vector<std::string_view> fields =
+            absl::StrSplit(line, absl::MaxSplits(' ', 4));
+        Entry entry;
+        std::string key;
+        if (fields.size() != 5 ||
+            !absl::SimpleAtoi(fields[0], &entry.state.size) ||
+            !absl::SimpleAtoi(fields[1], &entry.state.mtime_ns) ||
+            !absl::SimpleAtoi(fields[2], &entry.state.inode) ||
+            !absl::CUnescape(fields[4], &key)) {
+            ForgetPrevious();
+            return;
+        }
+        if (fields[3] != "-") {
+            entry.hs = HashAndSize<256>::FromBase32(fields[3]);
+        }
+        const std::size_t slash = key.rfind('/');
+        std::string dir_key =
+            slash == std::string::npos ? "" : key.substr(0, slash);
+        auto [it, inserted] = dir_ids.try_emplace(dir_key);
+        if (inserted) {
+            it->second = previous_list_.AddDir(FileList::kNoDir, dir_key);
+        }
+        const FileList::FileId f = previous_list_.AddFile(
+            it->second, std::string_view(key).substr(slash + 1));
+        previous_files_.push_back(std::move(entry));
+        previous_files_by_dir_[std::move(dir_key)].push_back(f);
+    }
+    if (!in.eof()) {
+        ForgetPrevious();
+        return;
+    }
+
+    // The directory snapshot is only of use along with the files in them.
+    previous_dirs_ = DirSnapshot::Load(DirsFile(file_));
+}
+
+void SourceCache::List(
+    FileList& file_list,
+    std::function<void(FileList::FileId file, const FileState& state,
+                       const std::optional<HashAndSize<256>>& hs)>
+        listed) {
+    FRZ_ASSERT(file_list_ == nullptr);
+    file_list_ = &file_list;
+    DirChangeTracker tracker(
+        root_, previous_dirs_.has_value() ? &*previous_dirs_ : nullptr, dirs_);
+    ListDir(root_, file_list.AddDir(FileList::kNoDir, root_.native()), tracker,
+            listed);
+}
+
+void SourceCache::ListDir(const std::filesystem::path& dir,
+                          FileList::DirId dir_id, DirChangeTracker& tracker,
+                          const ListedFun& listed) {
+    const auto previous_it = previous_files_by_dir_.find(Key(dir));
+    if (auto subdirs = tracker.Unchanged(dir)) {
+        // Same entries as last time, so the files are the ones we recorded
+        // (though they may have been modified in place). Files with hashes
+        // are checked by `Verify` if anyone wants them; the others are
+        // wanted by size, so make sure we have the right one.
+        if (previous_it != previous_files_by_dir_.end()) {
+            for (FileList::FileId previous : previous_it->second) {
+                const Entry& entry = previous_files_[previous];
+                const std::string_view name = previous_list_.FileName(previous);
+                if (entry.hs.has_value()) {
+                    unverified_.insert(AddFile(dir_id, name, entry, listed));
+                } else if (const std::optional<FileState> state =
+                               Stat(dir / name)) {
+                    AddFile(dir_id, name,
+                            {.state = *state, .hs = std::nullopt}, listed);
+                }
+            }
+        }
+        for (const std::filesystem::path& subdir : *subdirs) {
+            ListDir(subdir,
+                    file_list_->AddDir(dir_id, subdir.filename().native()),
+                    tracker, listed);
+        }
+        return;
+    }
+
+    // The files we recorded in this directory last time, by name.
+    absl::flat_hash_map<std::string_view, FileList::FileId> previous_by_name;
+    if (previous_it != previous_files_by_dir_.end()) {
+        for (FileList::FileId previous : previous_it->second) {
+            previous_by_name.insert(
+                {previous_list_.FileName(previous), previous});
+        }
+    }
+    DirChangeTracker::Listing listing;
+    for (const std::filesystem::directory_entry& dent :
+         std::filesystem::directory_iterator(dir)) {
+        const std::filesystem::path filename = dent.path().filename();
+        const std::string& name = filename.native();
+        listing.Add(name);
+        const std::filesystem::file_status status = dent.symlink_status();
+        if (std::filesystem::is_directory(status)) {
+            ListDir(dent.path(), file_list_->AddDir(dir_id, name), tracker,
+                    listed);
+        } else if (std::filesystem::is_regular_file(status)) {
+            const std::optional<FileState> state = Stat(dent.path());
+            if (!state.has_value()) {
+                continue;  // just removed or replaced
+            }
+            Entry entry = {.state = *state, .hs = std::nullopt};
+            if (auto it = previous_by_name.find(name);
+                it != previous_by_name.end() &&
+                previous_files_[it->second].state == *state) {
+                // The file looks the same as when we hashed it.
+                entry.hs = previous_files_[it->second].hs;
+            }
+            AddFile(dir_id, name, entry, listed);
+        }
+    }
+    tracker.Listed(dir, listing);
+}
+
+FileList::FileId SourceCache::AddFile(FileList::DirId dir_id,
+                                      std::string_view name,
+                                      const Entry& entry,
+                                      const ListedFun& listed) {
+    const FileList::FileId f = file_list_->AddFile(dir_id, name);
+    if (std::ssize(files_) <= f) {
+        files_.resize(f + 1);
+    }
+    files_[f] = entry;
+    listed(f, entry.state, entry.hs);
+    return f;
+}
+
+void SourceCache::ForgetPrevious() {
+    previous_list_ = FileList();
+    previous_files_.clear();
+    previous_files_by_dir_.clear();
+}
+
+bool SourceCache::Verify(FileList::FileId file) {
+    if (unverified_.erase(file) == 0) {
+        return true;
+    }
+    std::optional<Entry>& entry = files_.at(file);
+    FRZ_ASSERT(entry.has_value());
+    const std::optional<FileState> state = Stat(file_list_->Path(file));
+    if (state == entry->state) {
+        return true;
+    }
+    if (state.has_value()) {
+        entry = Entry{.state = *state, .hs = std::nullopt};
+    } else {
+        entry.reset();
+    }
+    return false;
+}
+
+void SourceCache::SetHash(FileList::FileId file, const HashAndSize<256>& hs) {
+    if (file < std::ssize(files_) && files_[file].has_value()) {
+        files_[file]->hs = hs;
+    }
+}
+
+void SourceCache::Save() const {
+    std::filesystem::path tmp = file_;
+    tmp += ".tmp";
+    const std::int64_t racy_ns = NowNs() - kRacyWindowNs;
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << kHeader << '\n';
+        for (FileList::FileId f = 0; f < std::ssize(files_); ++f) {
+            const std::optional<Entry>& entry = files_[f];
+            if (!entry.has_value()) {
+                continue;
+            }
+            out << absl::StrFormat(
+                "%d %d %d %s %s\n", entry->state.size, entry->state.mtime_ns,
+                entry->state.inode,
+                entry->hs.has_value() && entry->state.mtime_ns < racy_ns
+                    ? entry->hs->ToBase32()
+                    : "-",
+                absl::CEscape(Key(file_list_->Path(f))));
+        }
+        out.close();
+        if (!out) {
+            throw Error("Failed to write %s", tmp);
+        }
+    }
+
+    // The file list goes first, so that the directory snapshot never
+    // describes directories whose files we haven't recorded.
+    std::error_code error;
+    std::filesystem::rename(tmp, file_, error);
+    if (error) {
+        throw Error("Failed to rename %s: %s", tmp, error.message());
+    }
+    dirs_.Save(DirsFile(file_));
+}
+
+std::string SourceCache::Key(const std::filesystem::path& path) const {
+    const std::filesystem::path relative = path.lexically_relative(root_);
+    return relative == "." ? "" : relative.generic_string();
+}
+
+}  // namespace frz
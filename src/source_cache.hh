@@ -0,0 +1,133 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_SOURCE_CACHE_HH_
+#define FRZ_SOURCE_CACHE_HH_
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dir_snapshot.hh"
+#include "file_list.hh"
+#include "hash.hh"
+
+namespace frz {
+
+// A record of the regular files under a content source directory, and of
+// the hashes of those we've hashed, that is saved to a file so that the next
+// run can reuse it. Directories that haven't changed since the record was
+// saved needn't be listed again, and files that haven't changed needn't be
+// hashed again. Not thread safe.
+class SourceCache final {
+  public:
+    struct FileState {
+        std::uintmax_t size = 0;
+        std::int64_t mtime_ns = 0;
+        std::uint64_t inode = 0;
+
+        bool operator==(const FileState&) const = default;
+    };
+
+    // Return the state of `file`, or nullopt if it isn't a regular file.
+    static std::optional<FileState> Stat(const std::filesystem::path& file);
+
+    // Load the record of `root` from `file`, if there is one. (A missing or
+    // unparseable file just means an empty record.)
+    SourceCache(const std::filesystem::path& root,
+                const std::filesystem::path& file);
+
+    // List the regular files under the root: add them (and the directories
+    // they're in) to `file_list`, and call `listed` with the id, state, and
+    // hash (if we know it) of each. Directories that haven't changed since
+    // the record was saved aren't actually listed. The other member
+    // functions refer to files by their ids in `file_list`, which must
+    // outlive this object. Call this just once.
+    void List(FileList& file_list,
+              std::function<void(FileList::FileId file, const FileState& state,
+                                 const std::optional<HashAndSize<256>>& hs)>
+                  listed);
+
+    // Check that `file`, which was listed with a hash, is still what it was
+    // when that hash was computed. Files in directories that weren't listed
+    // this time haven't been looked at, so they're checked now (just once).
+    // If the file has changed, forget its hash and return false.
+    bool Verify(FileList::FileId file);
+
+    // Record the hash of `file`, which was listed.
+    void SetHash(FileList::FileId file, const HashAndSize<256>& hs);
+
+    // Atomically replace the saved record with what we know now.
+    void Save() const;
+
+  private:
+    struct Entry {
+        FileState state;
+        std::optional<HashAndSize<256>> hs;
+    };
+
+    using ListedFun =
+        std::function<void(FileList::FileId file, const FileState& state,
+                           const std::optional<HashAndSize<256>>& hs)>;
+
+    // List `dir`, whose id in `*file_list_` is `dir_id`.
+    void ListDir(const std::filesystem::path& dir, FileList::DirId dir_id,
+                 DirChangeTracker& tracker, const ListedFun& listed);
+
+    // Add the file `name` in directory `dir_id` to `*file_list_`, record
+    // `entry` for it, and pass it on to `listed`. Return its id.
+    FileList::FileId AddFile(FileList::DirId dir_id, std::string_view name,
+                             const Entry& entry, const ListedFun& listed);
+
+    // Forget everything we loaded.
+    void ForgetPrevious();
+
+    // The key of `path` in `previous_files_by_dir_`: its path relative to
+    // the root, in generic format.
+    std::string Key(const std::filesystem::path& path) const;
+
+    const std::filesystem::path root_;
+    const std::filesystem::path file_;
+
+    // What we loaded. The names of the files are in `previous_list_`, and
+    // their entries in `previous_files_`, indexed by their ids there. The
+    // files are also listed by directory, keyed by `Key`.
+    std::optional<DirSnapshot> previous_dirs_;
+    FileList previous_list_;
+    std::vector<Entry> previous_files_;
+    absl::flat_hash_map<std::string, std::vector<FileList::FileId>>
+        previous_files_by_dir_;
+
+    // What we know now, indexed by file id in `*file_list_`. Files that
+    // turned out to be gone after they were listed are nullopt.
+    FileList* file_list_ = nullptr;
+    DirSnapshot dirs_;
+    std::vector<std::optional<Entry>> files_;
+
+    // Files whose state and hash we took from `previous_files_` without
+    // looking at them.
+    absl::flat_hash_set<FileList::FileId> unverified_;
+};
+
+}  // namespace frz
+
+#endif  // FRZ_SOURCE_CACHE_HH_
@@ -0,0 +1,182 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "source_cache.hh"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <map>
+#include <optional>
+#include <string>
+
+#include "file_list.hh"
+#include "filesystem_testing.hh"
+#include "hash.hh"
+
+namespace frz {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::Optional;
+using ::testing::Pair;
+
+HashAndSize<256> TestHash(int n) {
+    std::array<std::byte, 32> bytes = {};
+    bytes[0] = static_cast<std::byte>(n);
+    return HashAndSize<256>(Hash<256>(bytes), n);
+}
+
+// Pretend that the given file or directory was last modified an hour ago, so
+// that it isn't considered too recently modified to be trusted.
+void Backdate(const std::filesystem::path& path) {
+    std::filesystem::last_write_time(
+        path, std::filesystem::file_time_type::clock::now() -
+                  std::chrono::hours(1));
+}
+
+// A cache listing: the listed files, relative to the root, with their ids
+// and hashes.
+struct Listing {
+    FileList file_list;
+    std::map<std::string, FileList::FileId> ids;
+    std::map<std::string, std::uintmax_t> sizes;
+    std::map<std::string, std::optional<HashAndSize<256>>> hashes;
+};
+
+// List `cache` into `listing`, and return the hashes.
+std::map<std::string, std::optional<HashAndSize<256>>> List(
+    SourceCache& cache, const std::filesystem::path& root, Listing& listing) {
+    cache.List(listing.file_list, [&](FileList::FileId f,
+                                      const SourceCache::FileState& state,
+                                      const std::optional<HashAndSize<256>>&
+                                          hs) {
+        const std::string name =
+            listing.file_list.Path(f).lexically_relative(root).generic_string();
+        listing.ids[name] = f;
+        listing.sizes[name] = state.size;
+        listing.hashes[name] = hs;
+    });
+    return listing.hashes;
+}
+
+TEST(TestSourceCache, RemembersHashes) {
+    TempDir d;
+    d.File("src/a", "1");
+    d.File("src/sub/b", "22");
+    for (const char* p : {"src/a", "src/sub/b", "src/sub", "src"}) {
+        Backdate(d.Path() / p);
+    }
+    const std::filesystem::path root = d.Path() / "src";
+    const std::filesystem::path file = d.Path() / "cache";
+    {
+        Listing listing;
+        SourceCache cache(root, file);
+        EXPECT_THAT(List(cache, root, listing),
+                    ElementsAre(Pair("a", Eq(std::nullopt)),
+                                Pair("sub/b", Eq(std::nullopt))));
+        cache.SetHash(listing.ids.at("a"), TestHash(1));
+        cache.SetHash(listing.ids.at("sub/b"), TestHash(2));
+        cache.Save();
+    }
+
+    // Nothing has changed, so the hashes are still good.
+    {
+        Listing listing;
+        SourceCache cache(root, file);
+        EXPECT_THAT(List(cache, root, listing),
+                    ElementsAre(Pair("a", Optional(TestHash(1))),
+                                Pair("sub/b", Optional(TestHash(2)))));
+        EXPECT_TRUE(cache.Verify(listing.ids.at("a")));
+        EXPECT_TRUE(cache.Verify(listing.ids.at("sub/b")));
+        cache.Save();
+    }
+
+    // Modify one file in place, and add another file to its directory. The
+    // directory must be listed again, but the untouched file keeps its hash.
+    d.File("src/sub/b", "33");
+    d.File("src/sub/c", "4");
+    {
+        Listing listing;
+        SourceCache cache(root, file);
+        EXPECT_THAT(List(cache, root, listing),
+                    ElementsAre(Pair("a", Optional(TestHash(1))),
+                                Pair("sub/b", Eq(std::nullopt)),
+                                Pair("sub/c", Eq(std::nullopt))));
+        cache.Save();
+    }
+
+    // Modify a file without changing its directory. Its stale hash is
+    // listed, but it doesn't survive verification.
+    d.File("src/a", "5");
+    {
+        Listing listing;
+        SourceCache cache(root, file);
+        EXPECT_THAT(List(cache, root, listing)["a"], Optional(TestHash(1)));
+        EXPECT_FALSE(cache.Verify(listing.ids.at("a")));
+        cache.Save();
+    }
+    {
+        Listing listing;
+        SourceCache cache(root, file);
+        EXPECT_THAT(List(cache, root, listing)["a"], Eq(std::nullopt));
+    }
+}
+
+TEST(TestSourceCache, UnhashedFilesInUnchangedDirectoriesAreStated) {
+    TempDir d;
+    d.File("src/a", "1");
+    Backdate(d.Path() / "src/a");
+    Backdate(d.Path() / "src");
+    const std::filesystem::path root = d.Path() / "src";
+    const std::filesystem::path file = d.Path() / "cache";
+    {
+        Listing listing;
+        SourceCache cache(root, file);
+        List(cache, root, listing);
+        EXPECT_THAT(listing.sizes, ElementsAre(Pair("a", 1)));
+        cache.Save();
+    }
+
+    // The directory is unchanged, but the file isn't; it must be listed
+    // with its new size, since that's what it will be looked for by.
+    d.File("src/a", "333");
+    {
+        Listing listing;
+        SourceCache cache(root, file);
+        List(cache, root, listing);
+        EXPECT_THAT(listing.sizes, ElementsAre(Pair("a", 3)));
+    }
+}
+
+TEST(TestSourceCache, IgnoresGarbage) {
+    TempDir d;
+    d.File("src/a", "1");
+    d.File("cache", "not a cache\n");
+    const std::filesystem::path root = d.Path() / "src";
+    Listing listing;
+    SourceCache cache(root, d.Path() / "cache");
+    EXPECT_THAT(List(cache, root, listing),
+                ElementsAre(Pair("a", Eq(std::nullopt))));
+}
+
+}  // namespace
+}  // namespace frz
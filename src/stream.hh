@@ -78,6 +78,21 @@ class StreamSink {
     virtual void AddBytes(std::span<const std::byte> buffer) = 0;
 };
 
+// A StreamSink that passes the same bytes on to two other sinks.
+class TeeSink final : public StreamSink {
+  public:
+    TeeSink(StreamSink& a, StreamSink& b) : a_(a), b_(b) {}
+
+    void AddBytes(std::span<const std::byte> buffer) override {
+        a_.AddBytes(buffer);
+        b_.AddBytes(buffer);
+    }
+
+  private:
+    StreamSink& a_;
+    StreamSink& b_;
+};
+
 // Interface for an object that can read bytes from a source and feed them to a
 // sink. The Streamer can be reused for several source+sink pairs.
 class Streamer {
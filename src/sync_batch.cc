@@ -0,0 +1,91 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "sync_batch.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <unistd.h>
+
+#include "assert.hh"
+#include "exceptions.hh"
+#include "worker.hh"
+
+namespace frz {
+namespace {
+
+// Flush the given file or directory to stable storage. For regular files,
+// only the data and the metadata needed to read it back are flushed.
+void SyncPath(const std::filesystem::path& path, bool is_dir) {
+    const int fd =
+        ::open(path.c_str(), O_RDONLY | O_CLOEXEC | (is_dir ? O_DIRECTORY : 0));
+    if (fd == -1) {
+        throw Error("Could not open %s for syncing: %s", path,
+                    std::strerror(errno));
+    }
+    const int result = is_dir ? ::fsync(fd) : ::fdatasync(fd);
+    const int sync_errno = errno;
+    ::close(fd);
+    if (result != 0) {
+        throw Error("Could not sync %s: %s", path, std::strerror(sync_errno));
+    }
+}
+
+}  // namespace
+
+SyncBatch::SyncBatch(const std::filesystem::path& root, int num_threads)
+    : root_(root.lexically_normal()), num_threads_(num_threads) {
+    FRZ_ASSERT_GE(num_threads_, 1);
+}
+
+void SyncBatch::Add(const std::filesystem::path& file) {
+    const std::filesystem::path relative =
+        file.lexically_normal().lexically_relative(root_);
+    FRZ_ASSERT(!relative.empty() && *relative.begin() != "..");
+    files_.push_back(file);
+    for (std::filesystem::path dir = relative.parent_path();;
+         dir = dir.parent_path()) {
+        const std::filesystem::path full_dir =
+            dir.empty() ? root_ : root_ / dir;
+        if (!dirs_.insert(full_dir.native()).second || dir.empty()) {
+            break;  // already seen (and thus its parents), or at the root
+        }
+    }
+}
+
+void SyncBatch::Sync() {
+    {
+        WorkerPool pool(num_threads_);
+        for (const std::filesystem::path& file : files_) {
+            pool.Do([&file] { SyncPath(file, /*is_dir=*/false); });
+        }
+        pool.Wait();
+
+        // Only now that the files' data is safe may their directory entries
+        // be made permanent.
+        for (const std::string& dir : dirs_) {
+            pool.Do([&dir] { SyncPath(dir, /*is_dir=*/true); });
+        }
+        pool.Wait();
+    }
+    files_.clear();
+    dirs_.clear();
+}
+
+}  // namespace frz
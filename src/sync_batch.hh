@@ -0,0 +1,60 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_SYNC_BATCH_HH_
+#define FRZ_SYNC_BATCH_HH_
+
+#include <absl/container/flat_hash_set.h>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace frz {
+
+// A set of newly written files under a root directory, which are synced to
+// stable storage together. Syncing many files at once is much faster than
+// syncing each one as soon as it's written, since the syncs can run in
+// parallel and each directory needs to be synced only once.
+class SyncBatch final {
+  public:
+    // `num_threads` is the number of files to sync concurrently.
+    SyncBatch(const std::filesystem::path& root, int num_threads);
+
+    // Add `file`, which must be under the root directory, to the batch. The
+    // directories between it and the root (inclusive) are synced along with
+    // it, so that the file can be found after a crash even if some of them
+    // were newly created.
+    void Add(const std::filesystem::path& file);
+
+    // The number of files in the batch.
+    std::ptrdiff_t size() const { return std::ssize(files_); }
+
+    // Sync the data of all files in the batch, and then the directories that
+    // contain them, and empty the batch. Throw an Error if anything couldn't
+    // be synced (in which case the batch is left as it was).
+    void Sync();
+
+  private:
+    const std::filesystem::path root_;
+    const int num_threads_;
+    std::vector<std::filesystem::path> files_;
+    absl::flat_hash_set<std::string> dirs_;
+};
+
+}  // namespace frz
+
+#endif  // FRZ_SYNC_BATCH_HH_
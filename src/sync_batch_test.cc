@@ -0,0 +1,54 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "sync_batch.hh"
+
+#include <gtest/gtest.h>
+
+#include "exceptions.hh"
+#include "filesystem_testing.hh"
+
+namespace frz {
+namespace {
+
+TEST(TestSyncBatch, SyncEmptiesTheBatch) {
+    TempDir d;
+    d.File("root/a", "aa");
+    d.File("root/sub/dir/b", "bb");
+    d.File("root/sub/dir/c", "cc");
+    SyncBatch batch(d.Path() / "root", /*num_threads=*/2);
+    EXPECT_EQ(batch.size(), 0);
+    batch.Add(d.Path() / "root/a");
+    batch.Add(d.Path() / "root/sub/dir/b");
+    batch.Add(d.Path() / "root/sub/dir/c");
+    EXPECT_EQ(batch.size(), 3);
+    batch.Sync();
+    EXPECT_EQ(batch.size(), 0);
+    batch.Sync();  // nothing to do
+}
+
+TEST(TestSyncBatch, MissingFileIsAnError) {
+    TempDir d;
+    d.File("root/a", "aa");
+    SyncBatch batch(d.Path() / "root", /*num_threads=*/1);
+    batch.Add(d.Path() / "root/a");
+    batch.Add(d.Path() / "root/gone");
+    EXPECT_THROW(batch.Sync(), Error);
+    EXPECT_EQ(batch.size(), 2);
+}
+
+}  // namespace
+}  // namespace frz
@@ -0,0 +1,305 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "tar_reader.hh"
+
+#include <absl/strings/numbers.h>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "assert.hh"
+#include "exceptions.hh"
+#include "stream.hh"
+
+namespace frz {
+
+namespace {
+
+constexpr int kBlockSize = 512;
+
+// Metadata members (long names and pax headers) larger than this are assumed
+// to be garbage.
+constexpr std::int64_t kMaxMetadataSize = 1024 * 1024;
+
+// Offsets and sizes of the ustar header fields we use.
+constexpr int kNameOffset = 0;
+constexpr int kNameSize = 100;
+constexpr int kSizeOffset = 124;
+constexpr int kSizeSize = 12;
+constexpr int kChecksumOffset = 148;
+constexpr int kChecksumSize = 8;
+constexpr int kTypeOffset = 156;
+constexpr int kMagicOffset = 257;
+constexpr int kPrefixOffset = 345;
+constexpr int kPrefixSize = 155;
+
+std::string_view Field(std::span<const std::byte> block, int offset,
+                       int size) {
+    const std::string_view field(
+        reinterpret_cast<const char*>(block.data()) + offset, size);
+    return field.substr(0, field.find('\0'));
+}
+
+// Parse a numeric header field: either octal digits, optionally surrounded
+// by spaces and NULs, or (the GNU extension for large values) a big-endian
+// base-256 number whose first byte has the high bit set.
+std::int64_t ParseNumber(std::span<const std::byte> block, int offset,
+                         int size) {
+    const std::span<const std::byte> field = block.subspan(offset, size);
+    std::int64_t value = 0;
+    if ((field[0] & std::byte{0x80}) != std::byte{0}) {
+        value = std::to_integer<std::int64_t>(field[0] & std::byte{0x7f});
+        for (std::byte b : field.subspan(1)) {
+            if (value >= (std::int64_t{1} << 55)) {
+                throw Error("Tar header number out of range");
+            }
+            value = (value << 8) | std::to_integer<std::int64_t>(b);
+        }
+        return value;
+    }
+    std::string_view digits(reinterpret_cast<const char*>(field.data()),
+                            field.size());
+    digits.remove_prefix(
+        std::min(digits.size(), digits.find_first_not_of(" ")));
+    for (char c : digits) {
+        if (c == ' ' || c == '\0') {
+            break;
+        }
+        if (c < '0' || c > '7' || value >= (std::int64_t{1} << 60)) {
+            throw Error("Bad number in tar header");
+        }
+        value = value * 8 + (c - '0');
+    }
+    return value;
+}
+
+// Check the header checksum: the sum of all header bytes, with the checksum
+// field itself counted as spaces. Some old tar programs summed signed chars,
+// so accept that too.
+bool ChecksumIsValid(std::span<const std::byte> block) {
+    std::int64_t unsigned_sum = 0;
+    std::int64_t signed_sum = 0;
+    for (int i = 0; i < kBlockSize; ++i) {
+        const bool in_checksum =
+            i >= kChecksumOffset && i < kChecksumOffset + kChecksumSize;
+        const std::byte b = in_checksum ? std::byte{' '} : block[i];
+        unsigned_sum += std::to_integer<unsigned char>(b);
+        signed_sum += static_cast<signed char>(std::to_integer<char>(b));
+    }
+    const std::int64_t expected =
+        ParseNumber(block, kChecksumOffset, kChecksumSize);
+    return expected == unsigned_sum || expected == signed_sum;
+}
+
+// Does a member of this type have data? Links, device nodes, directories,
+// and FIFOs don't, whatever their size field says.
+bool HasData(char type) { return type < '1' || type > '6'; }
+
+bool IsRegularFile(char type) {
+    return type == '0' || type == '\0' || type == '7';
+}
+
+// The records of a pax extended header that we care about.
+struct PaxRecords {
+    std::optional<std::string> path;
+    std::optional<std::int64_t> size;
+};
+
+// Parse pax extended header records, each of the form "<length>
+// <key>=<value>\n", where <length> counts the whole record.
+PaxRecords ParsePaxRecords(std::string_view data) {
+    PaxRecords records;
+    while (!data.empty()) {
+        const std::size_t space = data.find(' ');
+        std::size_t length;
+        if (space == std::string_view::npos ||
+            !absl::SimpleAtoi(data.substr(0, space), &length) ||
+            length <= space + 1 || length > data.size() ||
+            data[length - 1] != '\n') {
+            throw Error("Bad pax extended header in tar archive");
+        }
+        const std::string_view record =
+            data.substr(space + 1, length - space - 2);
+        data.remove_prefix(length);
+        const std::size_t eq = record.find('=');
+        if (eq == std::string_view::npos) {
+            throw Error("Bad pax extended header in tar archive");
+        }
+        const std::string_view key = record.substr(0, eq);
+        const std::string_view value = record.substr(eq + 1);
+        if (key == "path") {
+            records.path = std::string(value);
+        } else if (key == "size") {
+            std::int64_t size;
+            if (!absl::SimpleAtoi(value, &size) || size < 0) {
+                throw Error("Bad size in pax extended header");
+            }
+            records.size = size;
+        }
+    }
+    return records;
+}
+
+}  // namespace
+
+// Reads one member's data from the archive, and nothing more.
+class TarReader::MemberSource final : public StreamSource {
+  public:
+    MemberSource(StreamSource& archive, std::int64_t size)
+        : archive_(archive), size_(size) {}
+
+    std::variant<BytesCopied, End> GetBytes(
+        std::span<std::byte> buffer) override {
+        if (pos_ >= size_) {
+            return End{};
+        }
+        const auto r = archive_.GetBytes(buffer.first(
+            std::min(std::ssize(buffer), std::int64_t{size_ - pos_})));
+        if (std::holds_alternative<End>(r)) {
+            throw Error("Unexpected end of tar archive");
+        }
+        pos_ += std::get<BytesCopied>(r).num_bytes;
+        return r;
+    }
+
+    std::int64_t GetPosition() const override { return pos_; }
+
+    void SetPosition(std::int64_t pos) override { FRZ_CHECK_EQ(pos, pos_); }
+
+    std::int64_t Remaining() const { return size_ - pos_; }
+
+  private:
+    StreamSource& archive_;
+    const std::int64_t size_;
+    std::int64_t pos_ = 0;
+};
+
+TarReader::TarReader(StreamSource& archive)
+    : archive_(archive), data_(std::make_unique<MemberSource>(archive, 0)) {}
+
+TarReader::~TarReader() = default;
+
+std::optional<TarReader::Member> TarReader::Next() {
+    std::optional<std::string> long_name;
+    PaxRecords pax;
+    while (true) {
+        Skip(data_->Remaining() + padding_);
+        data_ = std::make_unique<MemberSource>(archive_, 0);
+        padding_ = 0;
+
+        std::array<std::byte, kBlockSize> block;
+        if (!ReadBlock(block) ||
+            std::all_of(block.begin(), block.end(),
+                        [](std::byte b) { return b == std::byte{0}; })) {
+            // Either the end-of-archive marker, or an archive that was
+            // missing one; there's nothing more either way.
+            return std::nullopt;
+        }
+        if (!ChecksumIsValid(block)) {
+            throw Error("Bad tar header checksum");
+        }
+        const char type = std::to_integer<char>(block[kTypeOffset]);
+        const std::int64_t size =
+            !HasData(type)         ? 0
+            : pax.size.has_value() ? *pax.size
+                                   : ParseNumber(block, kSizeOffset, kSizeSize);
+        data_ = std::make_unique<MemberSource>(archive_, size);
+        padding_ = (kBlockSize - size % kBlockSize) % kBlockSize;
+
+        switch (type) {
+            case 'L':  // GNU long name for the next member.
+                long_name = ReadData();
+                long_name->erase(std::min(long_name->size(),
+                                          long_name->find('\0')));
+                continue;
+            case 'x':  // pax extended header for the next member.
+                pax = ParsePaxRecords(ReadData());
+                continue;
+            case 'g':  // pax global header; nothing we need.
+            case 'K':  // GNU long link name.
+                continue;
+        }
+
+        std::string name;
+        if (pax.path.has_value()) {
+            name = *pax.path;
+        } else if (long_name.has_value()) {
+            name = *long_name;
+        } else {
+            name = std::string(Field(block, kNameOffset, kNameSize));
+            if (Field(block, kMagicOffset, 5) == "ustar") {
+                const std::string_view prefix =
+                    Field(block, kPrefixOffset, kPrefixSize);
+                if (!prefix.empty()) {
+                    name = std::string(prefix) + "/" + name;
+                }
+            }
+        }
+        return Member{.name = std::move(name),
+                      .size = size,
+                      .is_regular_file = IsRegularFile(type)};
+    }
+}
+
+StreamSource& TarReader::Data() { return *data_; }
+
+bool TarReader::ReadBlock(std::span<std::byte> block) {
+    const FillBufferFromStreamResult r = FillBufferFromStream(archive_, block);
+    if (r.num_bytes == 0 && r.end) {
+        return false;
+    }
+    if (r.num_bytes < std::ssize(block)) {
+        throw Error("Unexpected end of tar archive");
+    }
+    return true;
+}
+
+void TarReader::Skip(std::int64_t num_bytes) {
+    std::vector<std::byte> buffer(
+        std::min(num_bytes, std::int64_t{64 * 1024}));
+    while (num_bytes > 0) {
+        const FillBufferFromStreamResult r = FillBufferFromStream(
+            archive_,
+            std::span(buffer).first(std::min(std::ssize(buffer), num_bytes)));
+        num_bytes -= r.num_bytes;
+        if (r.end && num_bytes > 0) {
+            throw Error("Unexpected end of tar archive");
+        }
+    }
+}
+
+std::string TarReader::ReadData() {
+    if (data_->Remaining() > kMaxMetadataSize) {
+        throw Error("Tar metadata member too large");
+    }
+    std::string data(data_->Remaining(), '\0');
+    const FillBufferFromStreamResult r = FillBufferFromStream(
+        *data_, std::as_writable_bytes(std::span(data)));
+    FRZ_CHECK_EQ(r.num_bytes, std::ssize(data));
+    return data;
+}
+
+}  // namespace frz
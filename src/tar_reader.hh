@@ -0,0 +1,81 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRZ_TAR_READER_HH_
+#define FRZ_TAR_READER_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+
+#include "stream.hh"
+
+namespace frz {
+
+// Reads the members of a tar archive (ustar, with the GNU and pax extensions
+// for long names and large sizes) in order, making a single sequential pass
+// over the archive. The archive source is never asked to seek, so it may be a
+// tape, a pipe, or anything else that's slow or unable to.
+class TarReader final {
+  public:
+    struct Member {
+        std::string name;
+        std::int64_t size = 0;
+
+        // Is this a regular file? Other members (directories, links, and so
+        // on) have no data.
+        bool is_regular_file = false;
+    };
+
+    explicit TarReader(StreamSource& archive);
+    ~TarReader();
+
+    // Skip whatever is left of the current member's data, and read the next
+    // member's header. Return nullopt at the end of the archive. Throw
+    // `Error` if the archive is malformed or truncated.
+    std::optional<Member> Next();
+
+    // The data of the member last returned by `Next`. Its position can't be
+    // set to anything but the current position. Invalidated by the next call
+    // to `Next`.
+    StreamSource& Data();
+
+  private:
+    class MemberSource;
+
+    // Read exactly one 512-byte block into `block`. Return false if the
+    // archive ended cleanly before it, and throw if it ended mid-block.
+    bool ReadBlock(std::span<std::byte> block);
+
+    // Read and throw away `num_bytes` bytes.
+    void Skip(std::int64_t num_bytes);
+
+    // Read all of the current member's data into a string.
+    std::string ReadData();
+
+    StreamSource& archive_;
+    std::unique_ptr<MemberSource> data_;
+
+    // The number of padding bytes after the current member's data.
+    std::int64_t padding_ = 0;
+};
+
+}  // namespace frz
+
+#endif  // FRZ_TAR_READER_HH_
@@ -0,0 +1,174 @@
+/*
+  Copyright 2021 Karl Wiberg
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "tar_reader.hh"
+
+#include <absl/strings/str_cat.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "exceptions.hh"
+#include "file_stream.hh"
+#include "filesystem_testing.hh"
+#include "stream.hh"
+
+namespace frz {
+namespace {
+
+// Append a ustar header block to `tar`. If `base256_size` is true, encode the
+// size the way GNU tar does for sizes that don't fit in octal.
+void AddHeader(std::string& tar, std::string_view name, char type,
+               std::int64_t size, bool base256_size = false) {
+    std::string header(512, '\0');
+    name.copy(header.data(), std::min<std::size_t>(name.size(), 100));
+    std::snprintf(&header[100], 8, "%07o", 0644);
+    if (base256_size) {
+        header[124] = static_cast<char>(0x80);
+        for (int i = 0; i < 8; ++i) {
+            header[135 - i] = static_cast<char>(size >> (8 * i));
+        }
+    } else {
+        std::snprintf(&header[124], 12, "%011llo",
+                      static_cast<unsigned long long>(size));
+    }
+    header[156] = type;
+    std::string_view("ustar\0" "00", 8).copy(&header[257], 8);
+    std::fill_n(&header[148], 8, ' ');
+    unsigned checksum = 0;
+    for (char c : header) {
+        checksum += static_cast<unsigned char>(c);
+    }
+    std::snprintf(&header[148], 8, "%06o", checksum);
+    tar += header;
+}
+
+// Append a member with the given data to `tar`.
+void AddMember(std::string& tar, std::string_view name, char type,
+               std::string_view data, bool base256_size = false) {
+    AddHeader(tar, name, type, std::ssize(data), base256_size);
+    tar += data;
+    tar.append((512 - data.size() % 512) % 512, '\0');
+}
+
+std::string PaxRecord(std::string_view key, std::string_view value) {
+    // The length includes itself, so try lengths until one fits.
+    for (std::size_t n = 1;; ++n) {
+        std::string record = absl::StrCat(n, " ", key, "=", value, "\n");
+        if (record.size() == n) {
+            return record;
+        }
+    }
+}
+
+std::string ReadAll(StreamSource& source) {
+    std::string data;
+    char buffer[7];  // Small, so that reads are split up.
+    while (true) {
+        const FillBufferFromStreamResult r = FillBufferFromStream(
+            source, std::as_writable_bytes(std::span(buffer)));
+        data.append(buffer, r.num_bytes);
+        if (r.end) {
+            return data;
+        }
+    }
+}
+
+TEST(TestTarReader, ReadsMembers) {
+    std::string tar;
+    AddMember(tar, "dir/", '5', "");
+    AddMember(tar, "dir/a", '0', "first file");
+    AddMember(tar, "dir/link", '2', "");
+    AddMember(tar, "././@LongLink", 'L', std::string(150, 'n') + '\0');
+    AddMember(tar, "short-name", '0', std::string(1000, 'b'));
+    AddMember(tar, "PaxHeaders/c", 'x',
+              PaxRecord("path", "pax/name") + PaxRecord("mtime", "1.5"));
+    AddMember(tar, "c", '0', "third");
+    AddMember(tar, "d", '0', "fourth", /*base256_size=*/true);
+    tar.append(1024, '\0');
+    TempDir d;
+    d.File("archive.tar", tar);
+    auto source = CreateFileSource(d.Path() / "archive.tar");
+    TarReader reader(*source);
+
+    auto member = reader.Next();
+    ASSERT_TRUE(member.has_value());
+    EXPECT_EQ(member->name, "dir/");
+    EXPECT_FALSE(member->is_regular_file);
+
+    member = reader.Next();
+    ASSERT_TRUE(member.has_value());
+    EXPECT_EQ(member->name, "dir/a");
+    EXPECT_EQ(member->size, 10);
+    EXPECT_TRUE(member->is_regular_file);
+    EXPECT_EQ(ReadAll(reader.Data()), "first file");
+
+    member = reader.Next();
+    ASSERT_TRUE(member.has_value());
+    EXPECT_EQ(member->name, "dir/link");
+    EXPECT_FALSE(member->is_regular_file);
+
+    // Don't read this member's data; `Next` skips it.
+    member = reader.Next();
+    ASSERT_TRUE(member.has_value());
+    EXPECT_EQ(member->name, std::string(150, 'n'));
+    EXPECT_EQ(member->size, 1000);
+
+    member = reader.Next();
+    ASSERT_TRUE(member.has_value());
+    EXPECT_EQ(member->name, "pax/name");
+    EXPECT_EQ(ReadAll(reader.Data()), "third");
+
+    member = reader.Next();
+    ASSERT_TRUE(member.has_value());
+    EXPECT_EQ(member->name, "d");
+    EXPECT_EQ(ReadAll(reader.Data()), "fourth");
+
+    EXPECT_FALSE(reader.Next().has_value());
+}
+
+TEST(TestTarReader, TruncatedArchive) {
+    std::string tar;
+    AddMember(tar, "a", '0', std::string(600, 'a'));
+    tar.resize(800);
+    TempDir d;
+    d.File("archive.tar", tar);
+    auto source = CreateFileSource(d.Path() / "archive.tar");
+    TarReader reader(*source);
+    ASSERT_TRUE(reader.Next().has_value());
+    EXPECT_THROW(ReadAll(reader.Data()), Error);
+}
+
+TEST(TestTarReader, BadChecksum) {
+    std::string tar;
+    AddMember(tar, "a", '0', "a");
+    tar[0] = 'b';
+    TempDir d;
+    d.File("archive.tar", tar);
+    auto source = CreateFileSource(d.Path() / "archive.tar");
+    TarReader reader(*source);
+    EXPECT_THROW(reader.Next(), Error);
+}
+
+}  // namespace
+}  // namespace frz
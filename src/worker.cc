@@ -17,6 +17,7 @@
 #include "worker.hh"
 
 #include <absl/synchronization/mutex.h>
+#include <exception>
 #include <functional>
 
 #include "assert.hh"
@@ -57,4 +58,69 @@ void Worker::WorkLoop() {
     }
 }
 
+WorkerPool::WorkerPool(int num_threads) : max_queued_(num_threads) {
+    FRZ_ASSERT_GE(num_threads, 1);
+    for (int i = 0; i < num_threads; ++i) {
+        threads_.emplace_back([this] { WorkLoop(); });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    absl::MutexLock ml(&mutex_);
+    FRZ_ASSERT(!quitting_);
+    quitting_ = true;
+}
+
+void WorkerPool::Do(std::function<void()> work) {
+    auto not_blocked = [&] { return std::ssize(work_queue_) < max_queued_; };
+    absl::MutexLock ml(&mutex_, absl::Condition(&not_blocked));
+    FRZ_ASSERT(!quitting_);
+    work_queue_.push(std::move(work));
+}
+
+void WorkerPool::Wait() {
+    std::exception_ptr exception;
+    {
+        auto all_done = [&] {
+            return work_queue_.empty() && num_running_ == 0;
+        };
+        absl::MutexLock ml(&mutex_, absl::Condition(&all_done));
+        std::swap(exception, exception_);
+    }
+    if (exception != nullptr) {
+        std::rethrow_exception(exception);
+    }
+}
+
+void WorkerPool::WorkLoop() {
+    while (true) {
+        std::function<void()> work;
+        {
+            auto not_blocked = [&] {
+                return quitting_ || !work_queue_.empty();
+            };
+            absl::MutexLock ml(&mutex_, absl::Condition(&not_blocked));
+            if (work_queue_.empty()) {
+                FRZ_ASSERT(quitting_);
+                return;
+            } else {
+                work = std::move(work_queue_.front());
+                work_queue_.pop();
+                ++num_running_;
+            }
+        }
+        std::exception_ptr exception;
+        try {
+            work();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        absl::MutexLock ml(&mutex_);
+        --num_running_;
+        if (exception_ == nullptr) {
+            exception_ = exception;
+        }
+    }
+}
+
 }  // namespace frz
@@ -19,9 +19,11 @@
 
 #include <absl/base/thread_annotations.h>
 #include <absl/synchronization/mutex.h>
+#include <exception>
 #include <functional>
 #include <queue>
 #include <thread>
+#include <vector>
 
 namespace frz {
 
@@ -47,6 +49,39 @@ class Worker final {
     const std::jthread thread_;
 };
 
+// A pool of worker threads that accept work items and execute them in
+// parallel. Work items are started in the order they were scheduled, but may
+// finish in any order.
+class WorkerPool final {
+  public:
+    explicit WorkerPool(int num_threads);
+
+    // Finishes the remaining work, and joins with the worker threads.
+    ~WorkerPool();
+
+    // Schedule the given function to be run by one of the worker threads as
+    // soon as possible. If there is already enough queued work to keep all
+    // threads busy, block until there isn't; otherwise, return immediately
+    // without waiting for the work to run. May not be called once the
+    // destructor has started.
+    void Do(std::function<void()> work);
+
+    // Wait until all scheduled work has finished. If any of the work items
+    // threw an exception, rethrow the first one here.
+    void Wait();
+
+  private:
+    void WorkLoop();
+
+    const int max_queued_;
+    absl::Mutex mutex_;
+    std::queue<std::function<void()>> work_queue_ ABSL_GUARDED_BY(mutex_);
+    int num_running_ ABSL_GUARDED_BY(mutex_) = 0;
+    std::exception_ptr exception_ ABSL_GUARDED_BY(mutex_);
+    bool quitting_ ABSL_GUARDED_BY(mutex_) = false;
+    std::vector<std::jthread> threads_;
+};
+
 }  // namespace frz
 
 #endif  // FRZ_WORKER_HH_